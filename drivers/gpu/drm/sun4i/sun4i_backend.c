@@ -10,6 +10,7 @@
 #include <drm/drm_atomic.h>
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_crtc.h>
+#include <drm/drm_debugfs.h>
 #include <drm/drm_fb_cma_helper.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_plane_helper.h>
@@ -20,6 +21,7 @@
 #include <linux/of_device.h>
 #include <linux/of_graph.h>
 #include <linux/reset.h>
+#include <linux/seq_file.h>
 
 #include "sun4i_crtc.h"
 #include "sun4i_backend.h"
@@ -68,19 +70,62 @@ static void sun4i_backend_disable_color_correction(struct sunxi_engine *engine)
 			   SUN4I_BACKEND_OCCTL_ENABLE, 0);
 }
 
+/*
+ * Requests the load at the next vblank. This is done under flip_lock, so
+ * that the vblank sees the load request and the flip bookkeeping that goes
+ * with it at once. An old framebuffer, if any, is released at the vblank
+ * that loads the new configuration.
+ */
+static void sun4i_backend_flip_start(struct sun4i_backend *backend,
+				     struct drm_framebuffer *old_fb)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&backend->flip_lock, flags);
+	regmap_write(backend->engine.regs, SUN4I_BACKEND_REGBUFFCTL_REG,
+		     SUN4I_BACKEND_REGBUFFCTL_AUTOLOAD_DIS |
+		     SUN4I_BACKEND_REGBUFFCTL_LOADCTL);
+
+	if (backend->flip_pending)
+		backend->flips_replaced++;
+	backend->flip_pending = true;
+	backend->flip_start = ktime_get();
+
+	if (old_fb) {
+		drm_framebuffer_get(old_fb);
+		drm_flip_work_queue(&backend->fb_unref_work, old_fb);
+	}
+	spin_unlock_irqrestore(&backend->flip_lock, flags);
+}
+
 static void sun4i_backend_commit(struct drm_crtc *crtc,
 				 struct drm_crtc_state *state_old)
 {
 	struct sun4i_crtc *scrtc = drm_crtc_to_sun4i_crtc(crtc);
 	struct sunxi_engine *engine = scrtc->engine;
+	struct sun4i_backend *backend = engine_to_sun4i_backend(engine);
+	unsigned long flags;
 
 	DRM_DEBUG_DRIVER("Committing changes\n");
 
 	sun4i_sprites_crtc_commit(crtc, state_old);
 
-	regmap_write(engine->regs, SUN4I_BACKEND_REGBUFFCTL_REG,
-		     SUN4I_BACKEND_REGBUFFCTL_AUTOLOAD_DIS |
-		     SUN4I_BACKEND_REGBUFFCTL_LOADCTL);
+	spin_lock_irqsave(&backend->wb_lock, flags);
+
+	/* a queued write back gets loaded together with this composition. */
+	if (backend->wb_state == SUN4I_BACKEND_WB_QUEUED) {
+		regmap_write(engine->regs, SUN4I_BACKEND_INT_FLAG_REG,
+			     SUN4I_BACKEND_WB_FINISHED);
+		regmap_update_bits(engine->regs, SUN4I_BACKEND_WBCTL_REG,
+				   SUN4I_BACKEND_WBCTL_WBEN,
+				   SUN4I_BACKEND_WBCTL_WBEN);
+		backend->wb_state = SUN4I_BACKEND_WB_ARMED;
+		backend->wb_vblanks = SUN4I_BACKEND_WB_TIMEOUT;
+	}
+
+	sun4i_backend_flip_start(backend, NULL);
+
+	spin_unlock_irqrestore(&backend->wb_lock, flags);
 }
 
 void sun4i_backend_layer_enable(struct sun4i_backend *backend,
@@ -254,10 +299,16 @@ static void sun4i_backend_rgb_packed_format_set(struct sun4i_backend *backend,
 	/* select format and ordering */
 	switch (plane->state->fb->format->format) {
 	case DRM_FORMAT_ARGB8888:
-		value = SUN4I_BACKEND_LAY_FBFMT_ARGB8888;
+		if (sun4i_layer_has_pixel_alpha(plane->state))
+			value = SUN4I_BACKEND_LAY_FBFMT_ARGB8888;
+		else
+			value = SUN4I_BACKEND_LAY_FBFMT_XRGB8888;
 		break;
 	case DRM_FORMAT_BGRA8888:
-		value = SUN4I_BACKEND_LAY_FBFMT_ARGB8888;
+		if (sun4i_layer_has_pixel_alpha(plane->state))
+			value = SUN4I_BACKEND_LAY_FBFMT_ARGB8888;
+		else
+			value = SUN4I_BACKEND_LAY_FBFMT_XRGB8888;
 		value |= 0x02;
 		break;
 	case DRM_FORMAT_ARGB4444:
@@ -387,6 +438,7 @@ void sun4i_backend_update_layer_alpha(struct sun4i_backend *backend,
 }
 
 void sun4i_backend_frontend_set(struct sun4i_backend *backend,
+				struct sun4i_frontend *frontend,
 				int layer, uint32_t format)
 {
 	/* enable frontend input */
@@ -409,7 +461,7 @@ void sun4i_backend_frontend_set(struct sun4i_backend *backend,
 			   SUN4I_BACKEND_LAYFB_H4ADD_MSK(layer), 0);
 
 	/* select frontend */
-	if (backend->frontend->id == 1)
+	if (frontend->id == 1)
 		regmap_update_bits(backend->engine.regs,
 				   SUN4I_BACKEND_ATTCTL_REG0(layer),
 				   0x10, 0x10);
@@ -518,25 +570,22 @@ static void sun4i_backend_rgb_planar_buffer_set(struct sun4i_backend *backend,
 	struct drm_plane_state *state = plane->state;
 	struct drm_framebuffer *fb = state->fb;
 	dma_addr_t paddr;
-	uint32_t stride;
-
-	/* pitch is the same for all channels for this format */
-	stride = fb->pitches[0] * 8;
-	regmap_write(backend->engine.regs,
-		     SUN4I_BACKEND_IYUVLINEWIDTH_REG(0), stride);
-	regmap_write(backend->engine.regs,
-		     SUN4I_BACKEND_IYUVLINEWIDTH_REG(1), stride);
-	regmap_write(backend->engine.regs,
-		     SUN4I_BACKEND_IYUVLINEWIDTH_REG(2), stride);
-
-	paddr = drm_fb_cma_get_gem_addr(fb, state, 0);
-	regmap_write(backend->engine.regs, SUN4I_BACKEND_IYUVADD_REG(0), paddr);
+	int i;
 
-	paddr = drm_fb_cma_get_gem_addr(fb, state, 1);
-	regmap_write(backend->engine.regs, SUN4I_BACKEND_IYUVADD_REG(1), paddr);
+	/*
+	 * The three channels can come from three separately imported
+	 * dma-bufs, like the planes of a sun4i-csi1 capture buffer, so
+	 * do not assume that they share a pitch.
+	 */
+	for (i = 0; i < 3; i++) {
+		regmap_write(backend->engine.regs,
+			     SUN4I_BACKEND_IYUVLINEWIDTH_REG(i),
+			     fb->pitches[i] * 8);
 
-	paddr = drm_fb_cma_get_gem_addr(fb, state, 2);
-	regmap_write(backend->engine.regs, SUN4I_BACKEND_IYUVADD_REG(2), paddr);
+		paddr = drm_fb_cma_get_gem_addr(fb, state, i);
+		regmap_write(backend->engine.regs,
+			     SUN4I_BACKEND_IYUVADD_REG(i), paddr);
+	}
 }
 
 void sun4i_backend_update_layer_buffer(struct sun4i_backend *backend,
@@ -569,6 +618,23 @@ void sun4i_backend_update_layer_buffer(struct sun4i_backend *backend,
 	}
 }
 
+/*
+ * Async plane update: point the layer at its new buffer, and have it
+ * loaded at the next vblank, together with whatever else is pending.
+ * Unlike atomic_begin, this does not wait for a previous load, so a
+ * newer buffer simply replaces one which has not been shown yet.
+ *
+ * The old framebuffer is still being scanned out until then, so we hold
+ * on to it until the vblank that loads the new address.
+ */
+void sun4i_backend_layer_flip(struct sun4i_backend *backend,
+			      int layer, struct drm_plane *plane,
+			      struct drm_framebuffer *old_fb)
+{
+	sun4i_backend_update_layer_buffer(backend, layer, plane);
+	sun4i_backend_flip_start(backend, old_fb);
+}
+
 void sun4i_backend_update_layer_zpos(struct sun4i_backend *backend, int layer,
 				     struct drm_plane *plane)
 {
@@ -641,6 +707,7 @@ static int sun4i_backend_layers_atomic_check(struct sunxi_engine *engine,
 	unsigned int num_planes = 0;
 	unsigned int num_alpha_planes = 0;
 	unsigned int num_alpha_planes_max = 1;
+	unsigned int num_yuv_planes = 0;
 	unsigned int current_pipe = 0;
 	unsigned int i;
 	uint32_t layers_mask = crtc_state->plane_mask & backend->layers_mask;
@@ -653,10 +720,31 @@ static int sun4i_backend_layers_atomic_check(struct sunxi_engine *engine,
 	drm_for_each_plane_mask(plane, drm, layers_mask) {
 		struct drm_plane_state *plane_state =
 			drm_atomic_get_plane_state(state, plane);
+		struct sun4i_layer_state *layer_state =
+			state_to_sun4i_layer_state(plane_state);
+		struct sun4i_layer *layer = plane_to_sun4i_layer(plane);
 		struct drm_framebuffer *fb = plane_state->fb;
 
-		if (fb->format->has_alpha ||
-		    (plane_state->alpha != DRM_BLEND_ALPHA_OPAQUE))
+		/*
+		 * There is only one yuv/planar input channel. Layers that can
+		 * go through the frontend instead, do so when it is taken.
+		 */
+		if (!layer_state->uses_frontend &&
+		    (fb->format->is_yuv || (fb->format->num_planes > 1))) {
+			if (num_yuv_planes < SUN4I_BACKEND_NUM_YUV_PLANES) {
+				num_yuv_planes++;
+			} else if (layer->frontend &&
+				   !sun4i_layer_claim_frontend(plane_state)) {
+				layer_state->uses_frontend = true;
+			} else {
+				DRM_DEBUG_DRIVER("%s(%d): Too many yuv/planar "
+						 "planes.\n", __func__,
+						 engine->id);
+				return -EINVAL;
+			}
+		}
+
+		if (sun4i_layer_has_alpha(plane_state))
 			num_alpha_planes++;
 
 		DRM_DEBUG_DRIVER("Plane zpos is %d\n",
@@ -680,8 +768,7 @@ static int sun4i_backend_layers_atomic_check(struct sunxi_engine *engine,
 
 	/* We can't have an alpha plane at the lowest position */
 	if (!backend->quirks->supports_lowest_plane_alpha &&
-	    (plane_states[0]->fb->format->has_alpha ||
-	     (plane_states[0]->alpha != DRM_BLEND_ALPHA_OPAQUE))) {
+	    sun4i_layer_has_alpha(plane_states[0])) {
 		DRM_ERROR("%s(%d): Bottom plane cannot have alpha.\n",
 			  __func__, engine->id);
 		return -EINVAL;
@@ -689,14 +776,13 @@ static int sun4i_backend_layers_atomic_check(struct sunxi_engine *engine,
 
 	for (i = 1; i < num_planes; i++) {
 		struct drm_plane_state *p_state = plane_states[i];
-		struct drm_framebuffer *fb = p_state->fb;
 		struct sun4i_layer_state *s_state = state_to_sun4i_layer_state(p_state);
 
 		/*
 		 * The only alpha position is the lowest plane of the
 		 * second pipe.
 		 */
-		if (fb->format->has_alpha || (p_state->alpha != DRM_BLEND_ALPHA_OPAQUE))
+		if (sun4i_layer_has_alpha(p_state))
 			current_pipe++;
 
 		s_state->pipe = current_pipe;
@@ -730,10 +816,7 @@ static int sun4i_backend_atomic_check(struct sunxi_engine *engine,
 static void sun4i_backend_vblank_quirk(struct sunxi_engine *engine)
 {
 	struct sun4i_backend *backend = engine_to_sun4i_backend(engine);
-	struct sun4i_frontend *frontend = backend->frontend;
-
-	if (!frontend)
-		return;
+	int i;
 
 	/*
 	 * In a teardown scenario with the frontend involved, we have
@@ -750,13 +833,322 @@ static void sun4i_backend_vblank_quirk(struct sunxi_engine *engine)
 	 * visual artifacts.
 	 */
 	spin_lock(&backend->frontend_lock);
-	if (backend->frontend_teardown) {
-		sun4i_frontend_exit(frontend);
-		backend->frontend_teardown = false;
+	for (i = 0; i < SUN4I_BACKEND_NUM_FRONTEND_LAYERS; i++) {
+		struct sun4i_frontend *frontend = backend->frontends[i];
+
+		if (frontend &&
+		    (backend->frontend_teardown & BIT(frontend->id))) {
+			sun4i_frontend_exit(frontend);
+			backend->frontend_teardown &= ~BIT(frontend->id);
+		}
 	}
 	spin_unlock(&backend->frontend_lock);
 };
 
+static void sun4i_backend_flip_account(struct sun4i_backend *backend)
+{
+	u32 val;
+	u64 us;
+
+	spin_lock(&backend->flip_lock);
+	regmap_read(backend->engine.regs, SUN4I_BACKEND_REGBUFFCTL_REG, &val);
+
+	if (val & SUN4I_BACKEND_REGBUFFCTL_LOADCTL) {
+		/* not loaded yet, the commit came in too late. */
+		if (backend->flip_pending)
+			backend->flips_late++;
+	} else {
+		/* nothing scans out of the replaced framebuffers anymore. */
+		drm_flip_work_commit(&backend->fb_unref_work,
+				     system_unbound_wq);
+
+		if (backend->flip_pending) {
+			us = ktime_us_delta(ktime_get(), backend->flip_start);
+			backend->flip_latency[min_t(unsigned int, fls64(us),
+				SUN4I_BACKEND_FLIP_BUCKETS - 1)]++;
+			backend->flips++;
+			backend->flip_pending = false;
+		}
+	}
+	spin_unlock(&backend->flip_lock);
+}
+
+/*
+ * The backend can write its composited output back to memory, one frame
+ * at a time. This is exposed as a writeback connector on the crtc, so that
+ * whatever was composited ends up in a dma-buf, ready for an encoder.
+ */
+static const u32 sun4i_backend_wb_formats[] = {
+	DRM_FORMAT_XRGB8888,
+};
+
+static struct sun4i_backend *
+connector_to_sun4i_backend(struct drm_connector *connector)
+{
+	return container_of(drm_connector_to_writeback(connector),
+			    struct sun4i_backend, wb);
+}
+
+static int sun4i_backend_wb_get_modes(struct drm_connector *connector)
+{
+	struct drm_device *drm = connector->dev;
+
+	return drm_add_modes_noedid(connector, drm->mode_config.max_width,
+				    drm->mode_config.max_height);
+}
+
+static void sun4i_backend_wb_atomic_commit(struct drm_connector *connector,
+					   struct drm_connector_state *state)
+{
+	struct sun4i_backend *backend = connector_to_sun4i_backend(connector);
+	struct drm_writeback_job *job = state->writeback_job;
+	struct drm_gem_cma_object *gem;
+	struct drm_framebuffer *fb;
+	unsigned long flags;
+	dma_addr_t paddr;
+
+	if (!job || !job->fb)
+		return;
+
+	fb = job->fb;
+	gem = drm_fb_cma_get_gem_obj(fb, 0);
+	paddr = gem->paddr + fb->offsets[0];
+
+	DRM_DEBUG_DRIVER("Writing back to %pad, line width: %d bits\n",
+			 &paddr, fb->pitches[0] * 8);
+
+	/* like the rest of the backend, these only take effect on load. */
+	regmap_write(backend->engine.regs, SUN4I_BACKEND_WBADD_REG, paddr);
+	regmap_write(backend->engine.regs, SUN4I_BACKEND_WBLINEWIDTH_REG,
+		     fb->pitches[0] * 8);
+
+	drm_writeback_queue_job(&backend->wb, state);
+
+	/* the crtc flush, which comes next, arms it. */
+	spin_lock_irqsave(&backend->wb_lock, flags);
+	backend->wb_state = SUN4I_BACKEND_WB_QUEUED;
+	spin_unlock_irqrestore(&backend->wb_lock, flags);
+}
+
+static int sun4i_backend_wb_atomic_check(struct drm_encoder *encoder,
+					 struct drm_crtc_state *crtc_state,
+					 struct drm_connector_state *conn_state)
+{
+	struct sun4i_backend *backend =
+		connector_to_sun4i_backend(conn_state->connector);
+	struct drm_display_mode *mode = &crtc_state->mode;
+	struct drm_framebuffer *fb;
+	unsigned long flags;
+	bool busy;
+
+	if (!conn_state->writeback_job || !conn_state->writeback_job->fb)
+		return 0;
+
+	fb = conn_state->writeback_job->fb;
+
+	if (fb->format->format != DRM_FORMAT_XRGB8888) {
+		DRM_DEBUG_DRIVER("Invalid writeback format 0x%08X\n",
+				 fb->format->format);
+		return -EINVAL;
+	}
+
+	if ((fb->width != mode->hdisplay) || (fb->height != mode->vdisplay)) {
+		DRM_DEBUG_DRIVER("Invalid writeback size %ux%u, expected "
+				 "%ux%u\n", fb->width, fb->height,
+				 mode->hdisplay, mode->vdisplay);
+		return -EINVAL;
+	}
+
+	if (mode->flags & DRM_MODE_FLAG_INTERLACE) {
+		DRM_DEBUG_DRIVER("No writeback of interlaced modes\n");
+		return -EINVAL;
+	}
+
+	/* There is only one frame in flight. */
+	spin_lock_irqsave(&backend->wb_lock, flags);
+	busy = backend->wb_state != SUN4I_BACKEND_WB_IDLE;
+	spin_unlock_irqrestore(&backend->wb_lock, flags);
+
+	if (busy) {
+		DRM_DEBUG_DRIVER("Writeback still in progress\n");
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static const struct drm_connector_helper_funcs sun4i_backend_wb_helper_funcs = {
+	.get_modes	= sun4i_backend_wb_get_modes,
+	.atomic_commit	= sun4i_backend_wb_atomic_commit,
+};
+
+static const struct drm_connector_funcs sun4i_backend_wb_connector_funcs = {
+	.reset			= drm_atomic_helper_connector_reset,
+	.fill_modes		= drm_helper_probe_single_connector_modes,
+	.destroy		= drm_connector_cleanup,
+	.atomic_duplicate_state	= drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state	= drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_encoder_helper_funcs sun4i_backend_wb_encoder_funcs = {
+	.atomic_check	= sun4i_backend_wb_atomic_check,
+};
+
+static int sun4i_backend_writeback_init(struct drm_device *drm,
+					struct sunxi_engine *engine,
+					struct drm_crtc *crtc)
+{
+	struct sun4i_backend *backend = engine_to_sun4i_backend(engine);
+
+	backend->wb.encoder.possible_crtcs = drm_crtc_mask(crtc);
+	drm_connector_helper_add(&backend->wb.base,
+				 &sun4i_backend_wb_helper_funcs);
+
+	return drm_writeback_connector_init(drm, &backend->wb,
+					    &sun4i_backend_wb_connector_funcs,
+					    &sun4i_backend_wb_encoder_funcs,
+					    sun4i_backend_wb_formats,
+					    ARRAY_SIZE(sun4i_backend_wb_formats));
+}
+
+/*
+ * The write back is followed on vblank, so that we do not need the backend
+ * interrupt. The frame that gets written back is the first one with the
+ * newly loaded composition, so it is done at the vblank after the load.
+ */
+static void sun4i_backend_wb_account(struct sun4i_backend *backend)
+{
+	int status;
+	u32 val;
+
+	spin_lock(&backend->wb_lock);
+	switch (backend->wb_state) {
+	case SUN4I_BACKEND_WB_ARMED:
+		regmap_read(backend->engine.regs,
+			    SUN4I_BACKEND_REGBUFFCTL_REG, &val);
+		if (val & SUN4I_BACKEND_REGBUFFCTL_LOADCTL) {
+			if (--backend->wb_vblanks)
+				break;
+
+			regmap_update_bits(backend->engine.regs,
+					   SUN4I_BACKEND_WBCTL_REG,
+					   SUN4I_BACKEND_WBCTL_WBEN, 0);
+			backend->wb_state = SUN4I_BACKEND_WB_IDLE;
+
+			drm_writeback_signal_completion(&backend->wb,
+							-ETIMEDOUT);
+			break;
+		}
+
+		/* loaded, so the next load must not start it again. */
+		regmap_update_bits(backend->engine.regs,
+				   SUN4I_BACKEND_WBCTL_REG,
+				   SUN4I_BACKEND_WBCTL_WBEN, 0);
+		backend->wb_state = SUN4I_BACKEND_WB_RUNNING;
+		break;
+	case SUN4I_BACKEND_WB_RUNNING:
+		regmap_read(backend->engine.regs, SUN4I_BACKEND_INT_FLAG_REG,
+			    &val);
+		status = (val & SUN4I_BACKEND_WB_FINISHED) ? 0 : -EIO;
+
+		regmap_write(backend->engine.regs, SUN4I_BACKEND_INT_FLAG_REG,
+			     SUN4I_BACKEND_WB_FINISHED);
+		backend->wb_state = SUN4I_BACKEND_WB_IDLE;
+
+		drm_writeback_signal_completion(&backend->wb, status);
+		break;
+	default:
+		break;
+	}
+	spin_unlock(&backend->wb_lock);
+}
+
+/*
+ * Without vblanks, a writeback in flight would never be completed, and
+ * would keep all later ones out, so it is cancelled here.
+ */
+static void sun4i_backend_disable(struct sunxi_engine *engine)
+{
+	struct sun4i_backend *backend = engine_to_sun4i_backend(engine);
+	unsigned long flags;
+
+	spin_lock_irqsave(&backend->wb_lock, flags);
+	if (backend->wb_state != SUN4I_BACKEND_WB_IDLE) {
+		regmap_update_bits(engine->regs, SUN4I_BACKEND_WBCTL_REG,
+				   SUN4I_BACKEND_WBCTL_WBEN, 0);
+		regmap_write(engine->regs, SUN4I_BACKEND_INT_FLAG_REG,
+			     SUN4I_BACKEND_WB_FINISHED);
+		backend->wb_state = SUN4I_BACKEND_WB_IDLE;
+
+		drm_writeback_signal_completion(&backend->wb, -ECANCELED);
+	}
+	spin_unlock_irqrestore(&backend->wb_lock, flags);
+}
+
+/* called from the tcon vblank interrupt. */
+static void sun4i_backend_vblank(struct sunxi_engine *engine)
+{
+	struct sun4i_backend *backend = engine_to_sun4i_backend(engine);
+
+	sun4i_backend_flip_account(backend);
+	sun4i_backend_wb_account(backend);
+	sun4i_backend_vblank_quirk(engine);
+}
+
+static int sun4i_backend_flip_stats_show(struct seq_file *file, void *data)
+{
+	struct drm_info_node *node = file->private;
+	struct sun4i_backend *backend = node->info_ent->data;
+	u32 latency[SUN4I_BACKEND_FLIP_BUCKETS];
+	u64 flips, flips_late, flips_replaced;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&backend->flip_lock, flags);
+	memcpy(latency, backend->flip_latency, sizeof(latency));
+	flips = backend->flips;
+	flips_late = backend->flips_late;
+	flips_replaced = backend->flips_replaced;
+	spin_unlock_irqrestore(&backend->flip_lock, flags);
+
+	seq_printf(file, "flips: %llu\n", flips);
+	seq_printf(file, "late vblanks: %llu\n", flips_late);
+	seq_printf(file, "replaced before vblank: %llu\n", flips_replaced);
+	seq_puts(file, "commit to vblank:\n");
+	for (i = 0; i < SUN4I_BACKEND_FLIP_BUCKETS; i++) {
+		if (!latency[i])
+			continue;
+
+		if (!i)
+			seq_printf(file, "  %10s < %8uus: %u\n", "", 1,
+				   latency[i]);
+		else if (i == SUN4I_BACKEND_FLIP_BUCKETS - 1)
+			seq_printf(file, "  %8uus < %10s: %u\n",
+				   1 << (i - 1), "", latency[i]);
+		else
+			seq_printf(file, "  %8uus - %8uus: %u\n",
+				   1 << (i - 1), 1 << i, latency[i]);
+	}
+
+	return 0;
+}
+
+/* the statistics live next to the other debugfs files of the drm device. */
+static int sun4i_backend_debugfs_init(struct sunxi_engine *engine,
+				      struct drm_minor *minor)
+{
+	struct sun4i_backend *backend = engine_to_sun4i_backend(engine);
+	struct drm_info_list *files = backend->debugfs_files;
+
+	snprintf(backend->debugfs_name, sizeof(backend->debugfs_name),
+		 "backend%d_flip_stats", engine->id);
+	files[0].name = backend->debugfs_name;
+	files[0].show = sun4i_backend_flip_stats_show;
+	files[0].data = backend;
+
+	return drm_debugfs_create_files(files, 1, minor->debugfs_root, minor);
+}
+
 static int sun4i_backend_init_sat(struct device *dev) {
 	struct sun4i_backend *backend = dev_get_drvdata(dev);
 	int ret;
@@ -830,16 +1222,24 @@ static int sun4i_backend_of_get_id(struct device_node *node)
 	return of_ep.id;
 }
 
-/* TODO: This needs to take multiple pipelines into account */
-static struct sun4i_frontend *sun4i_backend_find_frontend(struct sun4i_drv *drv,
-							  struct device_node *node)
+/*
+ * The backend input port has an endpoint for every frontend. The first one
+ * which is not claimed yet becomes ours, the others are shared with the
+ * backends which claimed them, and feed a second scaled layer when those
+ * do not use them.
+ */
+static int sun4i_backend_find_frontends(struct sun4i_drv *drv,
+					struct sun4i_backend *backend,
+					struct device_node *node)
 {
+	struct sun4i_frontend *found[SUN4I_BACKEND_NUM_FRONTEND_LAYERS];
 	struct device_node *port, *ep, *remote;
 	struct sun4i_frontend *frontend;
+	int i, j, num_found = 0;
 
 	port = of_graph_get_port_by_id(node, 0);
 	if (!port)
-		return ERR_PTR(-EINVAL);
+		return -EINVAL;
 
 	for_each_available_child_of_node(port, ep) {
 		remote = of_graph_get_remote_port_parent(ep);
@@ -850,17 +1250,36 @@ static struct sun4i_frontend *sun4i_backend_find_frontend(struct sun4i_drv *drv,
 		/* does this node match any registered engines? */
 		list_for_each_entry(frontend, &drv->frontend_list, list) {
 			if (remote == frontend->node) {
-				if (frontend->claimed)
-					break;
-
-				of_node_put(port);
-				of_node_put(ep);
-				return frontend;
+				if (num_found < ARRAY_SIZE(found))
+					found[num_found++] = frontend;
+				break;
 			}
 		}
 	}
 	of_node_put(port);
-	return ERR_PTR(-EINVAL);
+
+	if (!num_found)
+		return -EINVAL;
+
+	for (i = 0; i < num_found; i++) {
+		if (!found[i]->claimed) {
+			found[i]->claimed = true;
+			backend->frontends[0] = found[i];
+			break;
+		}
+	}
+
+	for (i = 0, j = 1; i < num_found; i++)
+		if (found[i] != backend->frontends[0] &&
+		    (j < SUN4I_BACKEND_NUM_FRONTEND_LAYERS))
+			backend->frontends[j++] = found[i];
+
+	return 0;
+}
+
+static void sun4i_backend_fb_unref(struct drm_flip_work *work, void *val)
+{
+	drm_framebuffer_put(val);
 }
 
 static const struct sunxi_engine_ops sun4i_backend_engine_ops = {
@@ -870,8 +1289,11 @@ static const struct sunxi_engine_ops sun4i_backend_engine_ops = {
 	.layers_init			= sun4i_layers_init,
 	.apply_color_correction		= sun4i_backend_apply_color_correction,
 	.disable_color_correction	= sun4i_backend_disable_color_correction,
-	.vblank_quirk			= sun4i_backend_vblank_quirk,
+	.vblank_quirk			= sun4i_backend_vblank,
+	.disable			= sun4i_backend_disable,
 	.crtc_mode_set			= sun4i_backend_crtc_mode_set,
+	.writeback_init			= sun4i_backend_writeback_init,
+	.debugfs_init			= sun4i_backend_debugfs_init,
 };
 
 static struct regmap_config sun4i_backend_regmap_config = {
@@ -898,6 +1320,10 @@ static int sun4i_backend_bind(struct device *dev, struct device *master,
 		return -ENOMEM;
 	dev_set_drvdata(dev, backend);
 	spin_lock_init(&backend->frontend_lock);
+	spin_lock_init(&backend->flip_lock);
+	spin_lock_init(&backend->wb_lock);
+	drm_flip_work_init(&backend->fb_unref_work, "sun4i backend fb unref",
+			   sun4i_backend_fb_unref);
 
 	if (of_find_property(dev->of_node, "interconnects", NULL)) {
 		/*
@@ -926,9 +1352,8 @@ static int sun4i_backend_bind(struct device *dev, struct device *master,
 	if (backend->engine.id < 0)
 		return backend->engine.id;
 
-	backend->frontend = sun4i_backend_find_frontend(drv, dev->of_node);
-	backend->frontend->claimed = true;
-	if (IS_ERR(backend->frontend))
+	ret = sun4i_backend_find_frontends(drv, backend, dev->of_node);
+	if (ret)
 		dev_warn(dev, "Couldn't find matching frontend, frontend features disabled\n");
 
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
@@ -1051,6 +1476,11 @@ static void sun4i_backend_unbind(struct device *dev, struct device *master,
 {
 	struct sun4i_backend *backend = dev_get_drvdata(dev);
 
+	/* the crtc is off by now, so nothing scans out of these anymore. */
+	drm_flip_work_commit(&backend->fb_unref_work, system_unbound_wq);
+	flush_workqueue(system_unbound_wq);
+	drm_flip_work_cleanup(&backend->fb_unref_work);
+
 	list_del(&backend->engine.list);
 
 	if (of_device_is_compatible(dev->of_node,
@@ -15,15 +15,40 @@
 #include <linux/regmap.h>
 #include <linux/reset.h>
 
+#include <drm/drm_flip_work.h>
+#include <drm/drm_writeback.h>
+
 #include "sunxi_engine.h"
 
 #define SUN4I_BACKEND_NUM_LAYERS		4
-#define SUN4I_BACKEND_NUM_FRONTEND_LAYERS	1
+#define SUN4I_BACKEND_NUM_FRONTEND_LAYERS	2
 #define SUN4I_BACKEND_NUM_YUV_PLANES		1
 
+/* bucket 0 holds < 1us, bucket n holds [2^(n-1), 2^n) us. */
+#define SUN4I_BACKEND_FLIP_BUCKETS		18
+
+/*
+ * A writeback job is queued by the connector, armed together with the
+ * commit of its composition, running for the frame after the vblank which
+ * loaded it, and done at the vblank after that.
+ */
+enum sun4i_backend_wb_state {
+	SUN4I_BACKEND_WB_IDLE = 0,
+	SUN4I_BACKEND_WB_QUEUED,
+	SUN4I_BACKEND_WB_ARMED,
+	SUN4I_BACKEND_WB_RUNNING,
+};
+
+/* vblanks after which a writeback that never got loaded is given up on. */
+#define SUN4I_BACKEND_WB_TIMEOUT		3
+
 struct sun4i_backend {
 	struct sunxi_engine	engine;
-	struct sun4i_frontend	*frontend;
+	/*
+	 * The first frontend is claimed by this backend, the second one is
+	 * shared with the other backend, and used when it is not.
+	 */
+	struct sun4i_frontend	*frontends[SUN4I_BACKEND_NUM_FRONTEND_LAYERS];
 
 	struct reset_control	*reset;
 
@@ -36,12 +61,44 @@ struct sun4i_backend {
 
 	/* Protects against races in the frontend teardown */
 	spinlock_t		frontend_lock;
-	bool			frontend_teardown;
+	/* mask of frontend ids */
+	unsigned int		frontend_teardown;
 
 	const struct sun4i_backend_quirks	*quirks;
 
 	uint32_t layers_mask;
 	uint32_t sprites_mask;
+
+	/*
+	 * Time from a commit to the vblank that loaded it, as seen by
+	 * userspace when flipping capture buffers straight to a layer.
+	 */
+	spinlock_t		flip_lock;
+	bool			flip_pending;
+	ktime_t			flip_start;
+	u32			flip_latency[SUN4I_BACKEND_FLIP_BUCKETS];
+	u64			flips;
+	/* vblanks which came while a commit was still not loaded. */
+	u64			flips_late;
+	/* async flips which replaced one that was not loaded yet. */
+	u64			flips_replaced;
+
+	/*
+	 * Framebuffers replaced by an async flip, still scanned out until the
+	 * new address gets loaded at vblank.
+	 */
+	struct drm_flip_work	fb_unref_work;
+
+	/* flip statistics, in the debugfs directory of the drm minor. */
+	struct drm_info_list	debugfs_files[1];
+	char			debugfs_name[24];
+
+	/* The composited output, written back to memory. */
+	struct drm_writeback_connector	wb;
+	spinlock_t		wb_lock;
+	enum sun4i_backend_wb_state	wb_state;
+	/* vblanks left for an armed writeback to get loaded. */
+	unsigned int		wb_vblanks;
 };
 
 static inline struct sun4i_backend *
@@ -60,10 +117,14 @@ void sun4i_backend_update_layer_formats(struct sun4i_backend *backend,
 void sun4i_backend_update_layer_buffer(struct sun4i_backend *backend,
 				       int layer, struct drm_plane *plane);
 void sun4i_backend_frontend_set(struct sun4i_backend *backend,
+				struct sun4i_frontend *frontend,
 				int layer, uint32_t format);
 void sun4i_backend_update_layer_zpos(struct sun4i_backend *backend,
 				     int layer, struct drm_plane *plane);
 void sun4i_backend_update_layer_alpha(struct sun4i_backend *backend,
 				      int layer, struct drm_plane *plane);
+void sun4i_backend_layer_flip(struct sun4i_backend *backend,
+			      int layer, struct drm_plane *plane,
+			      struct drm_framebuffer *old_fb);
 
 #endif /* _SUN4I_BACKEND_H_ */
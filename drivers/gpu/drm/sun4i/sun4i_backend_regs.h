@@ -93,10 +93,12 @@
 #define SUN4I_BACKEND_INT_EN_REG		0x8c0
 #define SUN4I_BACKEND_INT_FLAG_REG		0x8c4
 #define SUN4I_BACKEND_REG_LOAD_FINISHED			BIT(1)
+#define SUN4I_BACKEND_WB_FINISHED			BIT(0)
 
 #define SUN4I_BACKEND_HWCCTL_REG		0x8d8
 #define SUN4I_BACKEND_HWCFBCTL_REG		0x8e0
 #define SUN4I_BACKEND_WBCTL_REG			0x8f0
+#define SUN4I_BACKEND_WBCTL_WBEN			BIT(0)
 #define SUN4I_BACKEND_WBADD_REG			0x8f4
 #define SUN4I_BACKEND_WBLINEWIDTH_REG		0x8f8
 #define SUN4I_BACKEND_SPREN_REG			0x900
@@ -30,14 +30,16 @@
 /*
  * While this isn't really working in the DRM theory, in practice we
  * can only ever have one encoder per TCON since we have a mux in our
- * TCON.
+ * TCON. The backend writeback connector comes with a virtual encoder of
+ * its own, which the TCON has nothing to do with.
  */
-static struct drm_encoder *sun4i_crtc_get_encoder(struct drm_crtc *crtc)
+static struct drm_encoder *sun4i_crtc_get_encoder(struct drm_crtc *crtc,
+						  struct drm_crtc_state *state)
 {
 	struct drm_encoder *encoder;
 
-	drm_for_each_encoder(encoder, crtc->dev)
-		if (encoder->crtc == crtc)
+	drm_for_each_encoder_mask(encoder, crtc->dev, state->encoder_mask)
+		if (encoder->encoder_type != DRM_MODE_ENCODER_VIRTUAL)
 			return encoder;
 
 	return NULL;
@@ -50,6 +52,12 @@ static int sun4i_crtc_atomic_check(struct drm_crtc *crtc,
 	struct sunxi_engine *engine = scrtc->engine;
 	int ret = 0;
 
+	/* the TCON needs an output, writeback alone does not drive it. */
+	if (state->active && !sun4i_crtc_get_encoder(crtc, state)) {
+		DRM_DEBUG_DRIVER("No output encoder for the CRTC\n");
+		return -EINVAL;
+	}
+
 	if (engine && engine->ops && engine->ops->atomic_check)
 		ret = engine->ops->atomic_check(engine, state);
 
@@ -104,7 +112,7 @@ static void sun4i_crtc_atomic_flush(struct drm_crtc *crtc,
 static void sun4i_crtc_atomic_disable(struct drm_crtc *crtc,
 				      struct drm_crtc_state *old_state)
 {
-	struct drm_encoder *encoder = sun4i_crtc_get_encoder(crtc);
+	struct drm_encoder *encoder = sun4i_crtc_get_encoder(crtc, old_state);
 	struct sun4i_crtc *scrtc = drm_crtc_to_sun4i_crtc(crtc);
 
 	DRM_DEBUG_DRIVER("Disabling the CRTC\n");
@@ -113,6 +121,9 @@ static void sun4i_crtc_atomic_disable(struct drm_crtc *crtc,
 
 	sun4i_tcon_set_status(scrtc->tcon, encoder, false);
 
+	if (scrtc->engine->ops->disable)
+		scrtc->engine->ops->disable(scrtc->engine);
+
 	if (crtc->state->event && !crtc->state->active) {
 		spin_lock_irq(&crtc->dev->event_lock);
 		drm_crtc_send_vblank_event(crtc, crtc->state->event);
@@ -125,7 +136,8 @@ static void sun4i_crtc_atomic_disable(struct drm_crtc *crtc,
 static void sun4i_crtc_atomic_enable(struct drm_crtc *crtc,
 				     struct drm_crtc_state *old_state)
 {
-	struct drm_encoder *encoder = sun4i_crtc_get_encoder(crtc);
+	struct drm_encoder *encoder = sun4i_crtc_get_encoder(crtc,
+							     crtc->state);
 	struct sun4i_crtc *scrtc = drm_crtc_to_sun4i_crtc(crtc);
 
 	DRM_DEBUG_DRIVER("Enabling the CRTC\n");
@@ -138,7 +150,8 @@ static void sun4i_crtc_atomic_enable(struct drm_crtc *crtc,
 static void sun4i_crtc_mode_set_nofb(struct drm_crtc *crtc)
 {
 	struct drm_display_mode *mode = &crtc->state->adjusted_mode;
-	struct drm_encoder *encoder = sun4i_crtc_get_encoder(crtc);
+	struct drm_encoder *encoder = sun4i_crtc_get_encoder(crtc,
+							     crtc->state);
 	struct sun4i_crtc *scrtc = drm_crtc_to_sun4i_crtc(crtc);
 	struct sunxi_engine *engine = scrtc->engine;
 
@@ -265,5 +278,13 @@ struct sun4i_crtc *sun4i_crtc_init(struct drm_device *drm,
 
 	kfree(planes);
 
+	/* a working display is more important than a working writeback */
+	if (engine->ops->writeback_init) {
+		ret = engine->ops->writeback_init(drm, engine, &scrtc->crtc);
+		if (ret)
+			DRM_DEV_ERROR(drm->dev, "%s(): writeback init failed\n",
+				      __func__);
+	}
+
 	return scrtc;
 }
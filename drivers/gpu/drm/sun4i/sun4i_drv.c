@@ -24,6 +24,7 @@
 #include "sun4i_framebuffer.h"
 #include "sun4i_tcon.h"
 #include "sun8i_tcon_top.h"
+#include "sunxi_engine.h"
 
 static int drm_sun4i_gem_dumb_create(struct drm_file *file_priv,
 				     struct drm_device *drm,
@@ -35,6 +36,24 @@ static int drm_sun4i_gem_dumb_create(struct drm_file *file_priv,
 	return drm_gem_cma_dumb_create_internal(file_priv, drm, args);
 }
 
+static int sun4i_drv_debugfs_init(struct drm_minor *minor)
+{
+	struct sun4i_drv *drv = minor->dev->dev_private;
+	struct sunxi_engine *engine;
+	int ret;
+
+	list_for_each_entry(engine, &drv->engine_list, list) {
+		if (!engine->ops->debugfs_init)
+			continue;
+
+		ret = engine->ops->debugfs_init(engine, minor);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 DEFINE_DRM_GEM_CMA_FOPS(sun4i_drv_fops);
 
 static struct drm_driver sun4i_drv_driver = {
@@ -47,6 +66,7 @@ static struct drm_driver sun4i_drv_driver = {
 	.date			= "20150629",
 	.major			= 1,
 	.minor			= 0,
+	.debugfs_init		= sun4i_drv_debugfs_init,
 
 	/* GEM Operations */
 	.dumb_create		= drm_sun4i_gem_dumb_create,
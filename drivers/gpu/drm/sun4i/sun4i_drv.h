@@ -17,6 +17,9 @@ struct sun4i_drv {
 	struct list_head	engine_list;
 	struct list_head	frontend_list;
 	struct list_head	tcon_list;
+
+	/* shared by all backend layers. */
+	struct drm_property	*async_flip_property;
 };
 
 #endif /* _SUN4I_DRV_H_ */
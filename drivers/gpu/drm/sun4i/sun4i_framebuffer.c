@@ -27,7 +27,22 @@ static int sun4i_de_atomic_check(struct drm_device *dev,
 	if (ret)
 		return ret;
 
-	return drm_atomic_helper_check_planes(dev, state);
+	ret = drm_atomic_helper_check_planes(dev, state);
+	if (ret)
+		return ret;
+
+	/*
+	 * Legacy cursor style updates: see whether they can skip vblank, and
+	 * have them wait for it like any other commit when they cannot.
+	 */
+	if (state->legacy_cursor_update) {
+		state->async_update = !drm_atomic_helper_async_check(dev,
+								     state);
+		if (!state->async_update)
+			state->legacy_cursor_update = false;
+	}
+
+	return 0;
 }
 
 static const struct drm_mode_config_funcs sun4i_de_mode_config_funcs = {
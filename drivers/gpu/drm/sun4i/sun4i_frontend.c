@@ -105,12 +105,40 @@ static void sun4i_frontend_scaler_init(struct sun4i_frontend *frontend)
 
 int sun4i_frontend_init(struct sun4i_frontend *frontend, int backend)
 {
+	unsigned long flags;
+	bool was_active;
 	int ret;
 
+	spin_lock_irqsave(&frontend->lock, flags);
+	if (frontend->m2m_users ||
+	    (frontend->drm_active && (frontend->drm_backend != backend))) {
+		spin_unlock_irqrestore(&frontend->lock, flags);
+		return -EBUSY;
+	}
+	was_active = frontend->drm_active;
+	frontend->drm_active = true;
+	frontend->drm_backend = backend;
+	spin_unlock_irqrestore(&frontend->lock, flags);
+
+	/* every update of the layer comes through here, exit comes once. */
+	if (!was_active) {
+		ret = pm_runtime_get_sync(frontend->dev);
+		if (ret < 0) {
+			pm_runtime_put_noidle(frontend->dev);
+
+			/* or nobody would ever get the frontend again. */
+			spin_lock_irqsave(&frontend->lock, flags);
+			frontend->drm_active = false;
+			spin_unlock_irqrestore(&frontend->lock, flags);
+
+			return ret;
+		}
+	}
 
-	ret = pm_runtime_get_sync(frontend->dev);
-	if (ret)
-		return ret;
+	/* feed the backend again, should the mem2mem device have had us. */
+	regmap_write_bits(frontend->regs, SUN4I_FRONTEND_FRM_CTRL_REG,
+			  SUN4I_FRONTEND_FRM_CTRL_WB_EN |
+			  SUN4I_FRONTEND_FRM_CTRL_OUT_CTRL, 0);
 
 	if (backend == 1)
 		regmap_write_bits(frontend->regs, SUN4I_FRONTEND_FRM_CTRL_REG,
@@ -125,13 +153,82 @@ EXPORT_SYMBOL(sun4i_frontend_init);
 
 void sun4i_frontend_exit(struct sun4i_frontend *frontend)
 {
+	unsigned long flags;
+
 	regmap_write_bits(frontend->regs, SUN4I_FRONTEND_FRM_CTRL_REG,
 			  SUN4I_FRONTEND_FRM_CTRL_FRM_START, 0);
 
 	pm_runtime_put(frontend->dev);
+
+	spin_lock_irqsave(&frontend->lock, flags);
+	frontend->drm_active = false;
+	spin_unlock_irqrestore(&frontend->lock, flags);
 }
 EXPORT_SYMBOL(sun4i_frontend_exit);
 
+/*
+ * Called from plane atomic_check, so that a plane which passed its check
+ * cannot lose the frontend to the mem2mem device or to the other backend
+ * before it gets committed.
+ */
+int sun4i_frontend_claim(struct sun4i_frontend *frontend, int backend)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&frontend->lock, flags);
+	if (frontend->m2m_users ||
+	    ((frontend->drm_claims || frontend->drm_active) &&
+	     (frontend->drm_backend != backend))) {
+		ret = -EBUSY;
+	} else {
+		frontend->drm_claims++;
+		frontend->drm_backend = backend;
+	}
+	spin_unlock_irqrestore(&frontend->lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL(sun4i_frontend_claim);
+
+/* Called when a plane state holding a claim gets destroyed. */
+void sun4i_frontend_unclaim(struct sun4i_frontend *frontend)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&frontend->lock, flags);
+	if (!WARN_ON(!frontend->drm_claims))
+		frontend->drm_claims--;
+	spin_unlock_irqrestore(&frontend->lock, flags);
+}
+EXPORT_SYMBOL(sun4i_frontend_unclaim);
+
+/* Called by the mem2mem device for every queue that starts streaming. */
+int sun4i_frontend_m2m_get(struct sun4i_frontend *frontend)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&frontend->lock, flags);
+	if (frontend->drm_claims || frontend->drm_active)
+		ret = -EBUSY;
+	else
+		frontend->m2m_users++;
+	spin_unlock_irqrestore(&frontend->lock, flags);
+
+	return ret;
+}
+
+void sun4i_frontend_m2m_put(struct sun4i_frontend *frontend)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&frontend->lock, flags);
+	if (!WARN_ON(!frontend->m2m_users))
+		frontend->m2m_users--;
+	spin_unlock_irqrestore(&frontend->lock, flags);
+}
+
 static bool sun4i_frontend_format_supports_tiling(uint32_t fmt)
 {
 	switch (fmt) {
@@ -641,6 +738,7 @@ static int sun4i_frontend_bind(struct device *dev, struct device *master,
 	struct sun4i_drv *drv = drm->dev_private;
 	struct resource *res;
 	void __iomem *regs;
+	int ret;
 
 	frontend = devm_kzalloc(dev, sizeof(*frontend), GFP_KERNEL);
 	if (!frontend)
@@ -649,6 +747,7 @@ static int sun4i_frontend_bind(struct device *dev, struct device *master,
 	dev_set_drvdata(dev, frontend);
 	frontend->dev = dev;
 	frontend->node = dev->of_node;
+	spin_lock_init(&frontend->lock);
 
 	frontend->data = of_device_get_match_data(dev);
 	if (!frontend->data)
@@ -704,6 +803,12 @@ static int sun4i_frontend_bind(struct device *dev, struct device *master,
 	list_add_tail(&frontend->list, &drv->frontend_list);
 	pm_runtime_enable(dev);
 
+	/* the display keeps working without it. */
+	ret = sun4i_frontend_m2m_register(frontend);
+	if (ret)
+		dev_warn(dev, "Couldn't register the mem2mem device: %d\n",
+			 ret);
+
 	return 0;
 }
 
@@ -712,6 +817,7 @@ static void sun4i_frontend_unbind(struct device *dev, struct device *master,
 {
 	struct sun4i_frontend *frontend = dev_get_drvdata(dev);
 
+	sun4i_frontend_m2m_unregister(frontend);
 	list_del(&frontend->list);
 	pm_runtime_force_suspend(dev);
 }
@@ -8,6 +8,7 @@
 #define _SUN4I_FRONTEND_H_
 
 #include <linux/list.h>
+#include <linux/spinlock.h>
 
 #define SUN4I_FRONTEND_EN_REG			0x000
 #define SUN4I_FRONTEND_EN_EN				BIT(0)
@@ -15,6 +16,8 @@
 #define SUN4I_FRONTEND_FRM_CTRL_REG		0x004
 #define SUN4I_FRONTEND_FRM_CTRL_COEF_ACCESS_CTRL	BIT(23)
 #define SUN4I_FRONTEND_FRM_CTRL_FRM_START		BIT(16)
+#define SUN4I_FRONTEND_FRM_CTRL_OUT_CTRL		BIT(11)
+#define SUN4I_FRONTEND_FRM_CTRL_WB_EN			BIT(2)
 #define SUN4I_FRONTEND_FRM_CTRL_COEF_RDY		BIT(1)
 #define SUN4I_FRONTEND_FRM_CTRL_REG_RDY			BIT(0)
 
@@ -68,12 +71,29 @@
 #define SUN4I_FRONTEND_INPUT_FMT_DATA_PS_BGRX		0
 #define SUN4I_FRONTEND_INPUT_FMT_DATA_PS_XRGB		1
 
+#define SUN4I_FRONTEND_WB_ADDR0_REG		0x050
+#define SUN4I_FRONTEND_WB_ADDR1_REG		0x054
+#define SUN4I_FRONTEND_WB_ADDR2_REG		0x058
+
 #define SUN4I_FRONTEND_OUTPUT_FMT_REG		0x05c
+#define SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_YUV444	0
 #define SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_BGRX8888	1
 #define SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_XRGB8888	2
+#define SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_YUV420	4
+#define SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_YUV422	5
+
+#define SUN4I_FRONTEND_INT_EN_REG		0x060
+#define SUN4I_FRONTEND_INT_STATUS_REG		0x064
+#define SUN4I_FRONTEND_INT_WB_END			BIT(7)
 
 #define SUN4I_FRONTEND_CSC_COEF_REG(c)		(0x070 + (0x4 * (c)))
 
+#define SUN4I_FRONTEND_WB_LINESTRD_EN_REG	0x0d0
+#define SUN4I_FRONTEND_WB_LINESTRD_EN_EN		BIT(0)
+#define SUN4I_FRONTEND_WB_LINESTRD0_REG		0x0d4
+#define SUN4I_FRONTEND_WB_LINESTRD1_REG		0x0d8
+#define SUN4I_FRONTEND_WB_LINESTRD2_REG		0x0dc
+
 #define SUN4I_FRONTEND_CH0_INSIZE_REG		0x100
 #define SUN4I_FRONTEND_INSIZE(h, w)			((((h) - 1) << 16) | (((w) - 1)))
 
@@ -111,6 +131,7 @@ struct device_node;
 struct drm_plane;
 struct regmap;
 struct reset_control;
+struct sun4i_frontend_m2m;
 
 struct sun4i_frontend_data {
 	bool	has_coef_access_ctrl;
@@ -137,6 +158,20 @@ struct sun4i_frontend {
 
 	int id;
 	bool claimed;
+
+	/*
+	 * The frontend either feeds a layer of one backend, or writes back
+	 * to memory for the mem2mem device, never more than one at once.
+	 * Every plane state which needs it holds a claim, from its
+	 * atomic_check until it gets destroyed.
+	 */
+	spinlock_t		lock;
+	bool			drm_active;
+	int			drm_backend;
+	unsigned int		drm_claims;
+	unsigned int		m2m_users;
+
+	struct sun4i_frontend_m2m	*m2m;
 };
 
 extern const struct of_device_id sun4i_frontend_of_table[];
@@ -154,4 +189,24 @@ int sun4i_frontend_format_set(struct sun4i_frontend *frontend,
 			      struct drm_plane *plane, uint32_t out_fmt);
 bool sun4i_frontend_format_is_supported(uint32_t fmt, uint64_t modifier);
 
+int sun4i_frontend_claim(struct sun4i_frontend *frontend, int backend);
+void sun4i_frontend_unclaim(struct sun4i_frontend *frontend);
+int sun4i_frontend_m2m_get(struct sun4i_frontend *frontend);
+void sun4i_frontend_m2m_put(struct sun4i_frontend *frontend);
+
+#if IS_ENABLED(CONFIG_DRM_SUN4I_FRONTEND_M2M)
+int sun4i_frontend_m2m_register(struct sun4i_frontend *frontend);
+void sun4i_frontend_m2m_unregister(struct sun4i_frontend *frontend);
+#else
+static inline int sun4i_frontend_m2m_register(struct sun4i_frontend *frontend)
+{
+	return 0;
+}
+
+static inline void
+sun4i_frontend_m2m_unregister(struct sun4i_frontend *frontend)
+{
+}
+#endif
+
 #endif /* _SUN4I_FRONTEND_H_ */
@@ -0,0 +1,993 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Allwinner A10/A20 Display Engine Frontend - V4L2 mem2mem scaler
+ *
+ * Next to feeding a backend layer, the frontend can write its output back
+ * to memory. This exposes that path as a mem2mem device: planar or
+ * semi-planar YCbCr, or planar RGB, go in on the OUTPUT queue, and planar
+ * YCbCr of any size comes out on the CAPTURE queue. Scaling and colour
+ * conversion then happen in hardware, straight between dma-bufs.
+ *
+ * The frontend is shared with the display. Whoever starts using it first
+ * keeps it: STREAMON fails while a plane is scaled through it, and planes
+ * that need it fail their atomic_check while the mem2mem device streams.
+ *
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ */
+
+#include <linux/interrupt.h>
+#include <linux/module.h>
+#include <linux/of_device.h>
+#include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/regmap.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include <media/v4l2-device.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-mem2mem.h>
+#include <media/videobuf2-dma-contig.h>
+
+#include "sun4i_frontend.h"
+
+#define SUN4I_FRONTEND_M2M_NAME		"sun4i-frontend-m2m"
+
+#define SUN4I_FRONTEND_M2M_SIZE_MIN	8
+#define SUN4I_FRONTEND_M2M_SIZE_MAX	2048
+
+/* even 2048x2048 takes a few ms only. */
+#define SUN4I_FRONTEND_M2M_TIMEOUT_MS	500
+
+/*
+ * The reverse of sunxi_bt601_yuv2rgb_coef, RGB[0:255] to Y[16:235]
+ * UV[16:240], in the same fixed point notation. The frontend takes its
+ * RGB input in G, R, B channel order:
+ * Y = 0.504 * G + 0.257 * R + 0.098 * B + 16
+ * U = -0.291 * G - 0.148 * R + 0.439 * B + 128
+ * V = -0.368 * G + 0.439 * R - 0.071 * B + 128
+ */
+static const u32 sunxi_bt601_rgb2yuv_coef[12] = {
+	0x00000204, 0x00000107, 0x00000064, 0x00000100,
+	0x00001ed6, 0x00001f68, 0x000001c2, 0x00000800,
+	0x00001e87, 0x000001c2, 0x00001fb7, 0x00000800,
+};
+
+struct sun4i_frontend_m2m_format {
+	u32 pixelformat;
+	unsigned int planes;
+	/* chroma subsampling divisors. */
+	unsigned int hsub;
+	unsigned int vsub;
+	/* INPUT_FMT for the OUTPUT queue, OUTPUT_FMT for the CAPTURE queue. */
+	u32 hw_format;
+};
+
+/*
+ * There is no fourcc for planar RGB, so YUV444M with the sRGB colorspace
+ * stands in for it: planes R, G and B, as produced by sun4i-csi1 from a
+ * 24bit RGB source.
+ */
+static const struct sun4i_frontend_m2m_format sun4i_frontend_m2m_formats_in[] = {
+	{
+		.pixelformat = V4L2_PIX_FMT_YUV444M,
+		.planes = 3,
+		.hsub = 1,
+		.vsub = 1,
+		.hw_format = SUN4I_FRONTEND_INPUT_FMT_DATA_MOD_PLANAR |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_FMT_YUV444,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV422M,
+		.planes = 3,
+		.hsub = 2,
+		.vsub = 1,
+		.hw_format = SUN4I_FRONTEND_INPUT_FMT_DATA_MOD_PLANAR |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_FMT_YUV422,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV420M,
+		.planes = 3,
+		.hsub = 2,
+		.vsub = 2,
+		.hw_format = SUN4I_FRONTEND_INPUT_FMT_DATA_MOD_PLANAR |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_FMT_YUV420,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV16M,
+		.planes = 2,
+		.hsub = 2,
+		.vsub = 1,
+		.hw_format = SUN4I_FRONTEND_INPUT_FMT_DATA_MOD_SEMIPLANAR |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_FMT_YUV422 |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_PS_UV,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV12M,
+		.planes = 2,
+		.hsub = 2,
+		.vsub = 2,
+		.hw_format = SUN4I_FRONTEND_INPUT_FMT_DATA_MOD_SEMIPLANAR |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_FMT_YUV420 |
+			SUN4I_FRONTEND_INPUT_FMT_DATA_PS_UV,
+	},
+};
+
+/* write back is planar only. */
+static const struct sun4i_frontend_m2m_format sun4i_frontend_m2m_formats_out[] = {
+	{
+		.pixelformat = V4L2_PIX_FMT_YUV420M,
+		.planes = 3,
+		.hsub = 2,
+		.vsub = 2,
+		.hw_format = SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_YUV420,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV422M,
+		.planes = 3,
+		.hsub = 2,
+		.vsub = 1,
+		.hw_format = SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_YUV422,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV444M,
+		.planes = 3,
+		.hsub = 1,
+		.vsub = 1,
+		.hw_format = SUN4I_FRONTEND_OUTPUT_FMT_DATA_FMT_YUV444,
+	},
+};
+
+struct sun4i_frontend_m2m {
+	/* cleared once the frontend goes away, under lock and job_lock. */
+	struct sun4i_frontend *frontend;
+
+	struct v4l2_device v4l2_dev;
+	struct video_device vdev;
+	struct v4l2_m2m_dev *m2m_dev;
+	/* serialises the ioctls. */
+	struct mutex lock;
+
+	/* whether a job is on the hardware, as the isr and watchdog race. */
+	spinlock_t job_lock;
+	bool running;
+	unsigned long deadline;
+	struct delayed_work watchdog;
+
+	int irq;
+};
+
+struct sun4i_frontend_m2m_ctx {
+	struct v4l2_fh fh;
+	struct sun4i_frontend_m2m *m2m;
+
+	struct v4l2_pix_format_mplane pix_in;
+	struct v4l2_pix_format_mplane pix_out;
+	const struct sun4i_frontend_m2m_format *format_in;
+	const struct sun4i_frontend_m2m_format *format_out;
+};
+
+static struct sun4i_frontend_m2m_ctx *
+sun4i_frontend_m2m_ctx_from_file(struct file *file)
+{
+	return container_of(file->private_data, struct sun4i_frontend_m2m_ctx,
+			    fh);
+}
+
+static bool sun4i_frontend_m2m_rgb(struct sun4i_frontend_m2m_ctx *ctx)
+{
+	return (ctx->format_in->pixelformat == V4L2_PIX_FMT_YUV444M) &&
+		(ctx->pix_in.colorspace == V4L2_COLORSPACE_SRGB);
+}
+
+static const struct sun4i_frontend_m2m_format *
+sun4i_frontend_m2m_format_find(bool output, u32 pixelformat)
+{
+	const struct sun4i_frontend_m2m_format *formats;
+	int count, i;
+
+	if (output) {
+		formats = sun4i_frontend_m2m_formats_in;
+		count = ARRAY_SIZE(sun4i_frontend_m2m_formats_in);
+	} else {
+		formats = sun4i_frontend_m2m_formats_out;
+		count = ARRAY_SIZE(sun4i_frontend_m2m_formats_out);
+	}
+
+	for (i = 0; i < count; i++)
+		if (formats[i].pixelformat == pixelformat)
+			return &formats[i];
+
+	return NULL;
+}
+
+/* Clamps the size, and fills in the plane layout. */
+static const struct sun4i_frontend_m2m_format *
+sun4i_frontend_m2m_format_fill(bool output,
+			       struct v4l2_pix_format_mplane *pix)
+{
+	const struct sun4i_frontend_m2m_format *format;
+	unsigned int stride;
+	int i;
+
+	format = sun4i_frontend_m2m_format_find(output, pix->pixelformat);
+	if (!format) {
+		if (output)
+			format = &sun4i_frontend_m2m_formats_in[0];
+		else
+			format = &sun4i_frontend_m2m_formats_out[0];
+		pix->pixelformat = format->pixelformat;
+	}
+
+	v4l_bound_align_image(&pix->width, SUN4I_FRONTEND_M2M_SIZE_MIN,
+			      SUN4I_FRONTEND_M2M_SIZE_MAX, 1,
+			      &pix->height, SUN4I_FRONTEND_M2M_SIZE_MIN,
+			      SUN4I_FRONTEND_M2M_SIZE_MAX, 1, 0);
+
+	pix->field = V4L2_FIELD_NONE;
+	pix->num_planes = format->planes;
+
+	/* only the input can be rgb, the write back is always yuv. */
+	if (!output || (pix->colorspace != V4L2_COLORSPACE_SRGB) ||
+	    (format->pixelformat != V4L2_PIX_FMT_YUV444M))
+		pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+	pix->ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+	pix->quantization = V4L2_QUANTIZATION_DEFAULT;
+	pix->xfer_func = V4L2_XFER_FUNC_DEFAULT;
+
+	stride = ALIGN(pix->width, 8);
+	pix->plane_fmt[0].bytesperline = stride;
+	pix->plane_fmt[0].sizeimage = stride * pix->height;
+
+	for (i = 1; i < format->planes; i++) {
+		if (format->planes == 2)
+			/* cb and cr interleaved. */
+			pix->plane_fmt[i].bytesperline =
+				2 * stride / format->hsub;
+		else
+			pix->plane_fmt[i].bytesperline = stride / format->hsub;
+
+		pix->plane_fmt[i].sizeimage = pix->plane_fmt[i].bytesperline *
+			DIV_ROUND_UP(pix->height, format->vsub);
+	}
+
+	for (i = 0; i < format->planes; i++)
+		memset(pix->plane_fmt[i].reserved, 0,
+		       sizeof(pix->plane_fmt[i].reserved));
+
+	return format;
+}
+
+static void sun4i_frontend_m2m_input_set(struct regmap *regs, int channel,
+					 dma_addr_t paddr, unsigned int stride)
+{
+	regmap_write(regs, SUN4I_FRONTEND_BUF_ADDR0_REG + 4 * channel, paddr);
+	regmap_write(regs, SUN4I_FRONTEND_TB_OFF0_REG + 4 * channel, 0);
+	regmap_write(regs, SUN4I_FRONTEND_LINESTRD0_REG + 4 * channel, stride);
+}
+
+static void sun4i_frontend_m2m_output_set(struct regmap *regs, int channel,
+					  dma_addr_t paddr, unsigned int stride)
+{
+	regmap_write(regs, SUN4I_FRONTEND_WB_ADDR0_REG + 4 * channel, paddr);
+	regmap_write(regs, SUN4I_FRONTEND_WB_LINESTRD0_REG + 4 * channel,
+		     stride);
+}
+
+static void sun4i_frontend_m2m_frame_start(struct sun4i_frontend_m2m_ctx *ctx)
+{
+	struct sun4i_frontend *frontend = ctx->m2m->frontend;
+	const struct sun4i_frontend_m2m_format *in = ctx->format_in;
+	const struct sun4i_frontend_m2m_format *out = ctx->format_out;
+	struct v4l2_pix_format_mplane *pix_in = &ctx->pix_in;
+	struct v4l2_pix_format_mplane *pix_out = &ctx->pix_out;
+	struct regmap *regs = frontend->regs;
+	struct vb2_v4l2_buffer *src, *dst;
+	unsigned int in_chroma_width, in_chroma_height;
+	unsigned int out_chroma_width, out_chroma_height;
+	dma_addr_t paddr;
+	bool rgb = sun4i_frontend_m2m_rgb(ctx);
+	int i;
+
+	src = v4l2_m2m_next_src_buf(ctx->fh.m2m_ctx);
+	dst = v4l2_m2m_next_dst_buf(ctx->fh.m2m_ctx);
+
+	regmap_write_bits(regs, SUN4I_FRONTEND_FRM_CTRL_REG,
+			  SUN4I_FRONTEND_FRM_CTRL_WB_EN |
+			  SUN4I_FRONTEND_FRM_CTRL_OUT_CTRL,
+			  SUN4I_FRONTEND_FRM_CTRL_WB_EN |
+			  SUN4I_FRONTEND_FRM_CTRL_OUT_CTRL);
+
+	regmap_write(regs, SUN4I_FRONTEND_CH0_HORZPHASE_REG,
+		     frontend->data->ch_phase[0].horzphase);
+	regmap_write(regs, SUN4I_FRONTEND_CH1_HORZPHASE_REG,
+		     frontend->data->ch_phase[1].horzphase);
+	regmap_write(regs, SUN4I_FRONTEND_CH0_VERTPHASE0_REG,
+		     frontend->data->ch_phase[0].vertphase[0]);
+	regmap_write(regs, SUN4I_FRONTEND_CH1_VERTPHASE0_REG,
+		     frontend->data->ch_phase[1].vertphase[0]);
+	regmap_write(regs, SUN4I_FRONTEND_CH0_VERTPHASE1_REG,
+		     frontend->data->ch_phase[0].vertphase[1]);
+	regmap_write(regs, SUN4I_FRONTEND_CH1_VERTPHASE1_REG,
+		     frontend->data->ch_phase[1].vertphase[1]);
+
+	/* yuv in and yuv out needs no conversion. */
+	if (rgb) {
+		for (i = 0; i < ARRAY_SIZE(sunxi_bt601_rgb2yuv_coef); i++)
+			regmap_write(regs, SUN4I_FRONTEND_CSC_COEF_REG(i),
+				     sunxi_bt601_rgb2yuv_coef[i]);
+		regmap_update_bits(regs, SUN4I_FRONTEND_BYPASS_REG,
+				   SUN4I_FRONTEND_BYPASS_CSC_EN, 0);
+		regmap_write(regs, SUN4I_FRONTEND_INPUT_FMT_REG,
+			     SUN4I_FRONTEND_INPUT_FMT_DATA_MOD_PLANAR |
+			     SUN4I_FRONTEND_INPUT_FMT_DATA_FMT_RGB);
+	} else {
+		regmap_update_bits(regs, SUN4I_FRONTEND_BYPASS_REG,
+				   SUN4I_FRONTEND_BYPASS_CSC_EN,
+				   SUN4I_FRONTEND_BYPASS_CSC_EN);
+		regmap_write(regs, SUN4I_FRONTEND_INPUT_FMT_REG,
+			     in->hw_format);
+	}
+
+	regmap_write(regs, SUN4I_FRONTEND_OUTPUT_FMT_REG, out->hw_format);
+
+	/* channel 0 is G for rgb. */
+	for (i = 0; i < 3; i++) {
+		int plane = i;
+
+		if (rgb && (i < 2))
+			plane = !i;
+
+		if (plane < in->planes) {
+			paddr = vb2_dma_contig_plane_dma_addr(&src->vb2_buf,
+							      plane);
+			sun4i_frontend_m2m_input_set(regs, i,
+				paddr - PHYS_OFFSET,
+				pix_in->plane_fmt[plane].bytesperline);
+		} else {
+			sun4i_frontend_m2m_input_set(regs, i, 0, 0);
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		paddr = vb2_dma_contig_plane_dma_addr(&dst->vb2_buf, i);
+		sun4i_frontend_m2m_output_set(regs, i, paddr - PHYS_OFFSET,
+			pix_out->plane_fmt[i].bytesperline);
+	}
+	regmap_write(regs, SUN4I_FRONTEND_WB_LINESTRD_EN_REG,
+		     SUN4I_FRONTEND_WB_LINESTRD_EN_EN);
+
+	if (rgb) {
+		in_chroma_width = pix_in->width;
+		in_chroma_height = pix_in->height;
+	} else {
+		in_chroma_width = DIV_ROUND_UP(pix_in->width, in->hsub);
+		in_chroma_height = DIV_ROUND_UP(pix_in->height, in->vsub);
+	}
+	out_chroma_width = DIV_ROUND_UP(pix_out->width, out->hsub);
+	out_chroma_height = DIV_ROUND_UP(pix_out->height, out->vsub);
+
+	regmap_write(regs, SUN4I_FRONTEND_CH0_INSIZE_REG,
+		     SUN4I_FRONTEND_INSIZE(pix_in->height, pix_in->width));
+	regmap_write(regs, SUN4I_FRONTEND_CH1_INSIZE_REG,
+		     SUN4I_FRONTEND_INSIZE(in_chroma_height, in_chroma_width));
+
+	regmap_write(regs, SUN4I_FRONTEND_CH0_OUTSIZE_REG,
+		     SUN4I_FRONTEND_OUTSIZE(pix_out->height, pix_out->width));
+	regmap_write(regs, SUN4I_FRONTEND_CH1_OUTSIZE_REG,
+		     SUN4I_FRONTEND_OUTSIZE(out_chroma_height,
+					    out_chroma_width));
+
+	regmap_write(regs, SUN4I_FRONTEND_CH0_HORZFACT_REG,
+		     (pix_in->width << 16) / pix_out->width);
+	regmap_write(regs, SUN4I_FRONTEND_CH1_HORZFACT_REG,
+		     (in_chroma_width << 16) / out_chroma_width);
+	regmap_write(regs, SUN4I_FRONTEND_CH0_VERTFACT_REG,
+		     (pix_in->height << 16) / pix_out->height);
+	regmap_write(regs, SUN4I_FRONTEND_CH1_VERTFACT_REG,
+		     (in_chroma_height << 16) / out_chroma_height);
+
+	regmap_write(regs, SUN4I_FRONTEND_INT_STATUS_REG,
+		     SUN4I_FRONTEND_INT_WB_END);
+	regmap_write(regs, SUN4I_FRONTEND_INT_EN_REG,
+		     SUN4I_FRONTEND_INT_WB_END);
+
+	regmap_write_bits(regs, SUN4I_FRONTEND_FRM_CTRL_REG,
+			  SUN4I_FRONTEND_FRM_CTRL_REG_RDY,
+			  SUN4I_FRONTEND_FRM_CTRL_REG_RDY);
+	regmap_write_bits(regs, SUN4I_FRONTEND_FRM_CTRL_REG,
+			  SUN4I_FRONTEND_FRM_CTRL_FRM_START,
+			  SUN4I_FRONTEND_FRM_CTRL_FRM_START);
+}
+
+static void sun4i_frontend_m2m_frame_stop(struct regmap *regs)
+{
+	regmap_write(regs, SUN4I_FRONTEND_INT_STATUS_REG,
+		     SUN4I_FRONTEND_INT_WB_END);
+	regmap_write(regs, SUN4I_FRONTEND_INT_EN_REG, 0);
+	regmap_write_bits(regs, SUN4I_FRONTEND_FRM_CTRL_REG,
+			  SUN4I_FRONTEND_FRM_CTRL_FRM_START, 0);
+}
+
+/*
+ * m2m device_run, which in this kernel can get called from the isr, through
+ * v4l2_m2m_job_finish(), so this only touches registers. The frontend got
+ * powered up on STREAMON already.
+ */
+static void sun4i_frontend_m2m_device_run(void *priv)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = priv;
+	struct sun4i_frontend_m2m *m2m = ctx->m2m;
+	unsigned long timeout = msecs_to_jiffies(SUN4I_FRONTEND_M2M_TIMEOUT_MS);
+	unsigned long flags;
+
+	spin_lock_irqsave(&m2m->job_lock, flags);
+
+	m2m->running = true;
+	m2m->deadline = jiffies + timeout;
+
+	/* without the frontend, the watchdog hands the buffers back. */
+	if (m2m->frontend)
+		sun4i_frontend_m2m_frame_start(ctx);
+	else
+		timeout = 0;
+
+	mod_delayed_work(system_wq, &m2m->watchdog, timeout);
+
+	spin_unlock_irqrestore(&m2m->job_lock, flags);
+}
+
+static void sun4i_frontend_m2m_job_done(struct sun4i_frontend_m2m *m2m,
+					enum vb2_buffer_state state)
+{
+	struct sun4i_frontend_m2m_ctx *ctx;
+	struct vb2_v4l2_buffer *src, *dst;
+
+	ctx = v4l2_m2m_get_curr_priv(m2m->m2m_dev);
+	if (WARN_ON(!ctx))
+		return;
+
+	src = v4l2_m2m_src_buf_remove(ctx->fh.m2m_ctx);
+	dst = v4l2_m2m_dst_buf_remove(ctx->fh.m2m_ctx);
+
+	v4l2_m2m_buf_copy_metadata(src, dst, true);
+
+	v4l2_m2m_buf_done(src, state);
+	v4l2_m2m_buf_done(dst, state);
+
+	v4l2_m2m_job_finish(m2m->m2m_dev, ctx->fh.m2m_ctx);
+}
+
+static irqreturn_t sun4i_frontend_m2m_isr(int irq, void *data)
+{
+	struct sun4i_frontend_m2m *m2m = data;
+	struct regmap *regs = m2m->frontend->regs;
+	unsigned int status;
+	bool running;
+
+	regmap_read(regs, SUN4I_FRONTEND_INT_STATUS_REG, &status);
+	if (!(status & SUN4I_FRONTEND_INT_WB_END))
+		return IRQ_NONE;
+
+	spin_lock(&m2m->job_lock);
+	sun4i_frontend_m2m_frame_stop(regs);
+	running = m2m->running;
+	m2m->running = false;
+	spin_unlock(&m2m->job_lock);
+
+	/* the watchdog got there first. */
+	if (!running)
+		return IRQ_HANDLED;
+
+	cancel_delayed_work(&m2m->watchdog);
+
+	sun4i_frontend_m2m_job_done(m2m, VB2_BUF_STATE_DONE);
+
+	return IRQ_HANDLED;
+}
+
+/* When WB_END never shows up, the job would otherwise never finish. */
+static void sun4i_frontend_m2m_watchdog(struct work_struct *work)
+{
+	struct sun4i_frontend_m2m *m2m =
+		container_of(to_delayed_work(work), struct sun4i_frontend_m2m,
+			     watchdog);
+	unsigned long flags;
+
+	spin_lock_irqsave(&m2m->job_lock, flags);
+
+	/* the isr finished it, and perhaps started the next one already. */
+	if (!m2m->running ||
+	    (m2m->frontend && time_before(jiffies, m2m->deadline))) {
+		spin_unlock_irqrestore(&m2m->job_lock, flags);
+		return;
+	}
+
+	m2m->running = false;
+
+	if (m2m->frontend) {
+		dev_err(m2m->frontend->dev, "%s(): write back timed out.\n",
+			__func__);
+		sun4i_frontend_m2m_frame_stop(m2m->frontend->regs);
+	}
+
+	spin_unlock_irqrestore(&m2m->job_lock, flags);
+
+	sun4i_frontend_m2m_job_done(m2m, VB2_BUF_STATE_ERROR);
+}
+
+static const struct v4l2_m2m_ops sun4i_frontend_m2m_ops = {
+	.device_run = sun4i_frontend_m2m_device_run,
+};
+
+static int sun4i_frontend_m2m_queue_setup(struct vb2_queue *queue,
+					  unsigned int *buffer_count,
+					  unsigned int *plane_count,
+					  unsigned int sizes[],
+					  struct device *alloc_devs[])
+{
+	struct sun4i_frontend_m2m_ctx *ctx = vb2_get_drv_priv(queue);
+	struct v4l2_pix_format_mplane *pix;
+	int i;
+
+	if (V4L2_TYPE_IS_OUTPUT(queue->type))
+		pix = &ctx->pix_in;
+	else
+		pix = &ctx->pix_out;
+
+	if (*plane_count) {
+		if (*plane_count != pix->num_planes)
+			return -EINVAL;
+
+		for (i = 0; i < pix->num_planes; i++)
+			if (sizes[i] < pix->plane_fmt[i].sizeimage)
+				return -EINVAL;
+
+		return 0;
+	}
+
+	*plane_count = pix->num_planes;
+	for (i = 0; i < pix->num_planes; i++)
+		sizes[i] = pix->plane_fmt[i].sizeimage;
+
+	return 0;
+}
+
+static int sun4i_frontend_m2m_buffer_prepare(struct vb2_buffer *vb)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+	struct v4l2_pix_format_mplane *pix;
+	int i;
+
+	if (V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type))
+		pix = &ctx->pix_in;
+	else
+		pix = &ctx->pix_out;
+
+	for (i = 0; i < pix->num_planes; i++) {
+		if (vb2_plane_size(vb, i) < pix->plane_fmt[i].sizeimage)
+			return -EINVAL;
+
+		if (!V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type))
+			vb2_set_plane_payload(vb, i,
+					      pix->plane_fmt[i].sizeimage);
+	}
+
+	return 0;
+}
+
+static void sun4i_frontend_m2m_buffer_queue(struct vb2_buffer *vb)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+
+	v4l2_m2m_buf_queue(ctx->fh.m2m_ctx, to_vb2_v4l2_buffer(vb));
+}
+
+static void sun4i_frontend_m2m_buffers_return(struct vb2_queue *queue,
+					      enum vb2_buffer_state state)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = vb2_get_drv_priv(queue);
+	struct vb2_v4l2_buffer *buffer;
+
+	for (;;) {
+		if (V4L2_TYPE_IS_OUTPUT(queue->type))
+			buffer = v4l2_m2m_src_buf_remove(ctx->fh.m2m_ctx);
+		else
+			buffer = v4l2_m2m_dst_buf_remove(ctx->fh.m2m_ctx);
+		if (!buffer)
+			return;
+
+		v4l2_m2m_buf_done(buffer, state);
+	}
+}
+
+/* Every streaming queue holds the frontend, and keeps it powered. */
+static int sun4i_frontend_m2m_streaming_start(struct vb2_queue *queue,
+					      unsigned int count)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = vb2_get_drv_priv(queue);
+	struct sun4i_frontend *frontend = ctx->m2m->frontend;
+	int ret;
+
+	if (!frontend) {
+		ret = -ENODEV;
+		goto error;
+	}
+
+	ret = sun4i_frontend_m2m_get(frontend);
+	if (ret) {
+		dev_err(frontend->dev, "%s(): frontend is in use by the "
+			"display.\n", __func__);
+		goto error;
+	}
+
+	ret = pm_runtime_get_sync(frontend->dev);
+	if (ret < 0) {
+		pm_runtime_put_noidle(frontend->dev);
+		sun4i_frontend_m2m_put(frontend);
+		goto error;
+	}
+
+	return 0;
+
+ error:
+	sun4i_frontend_m2m_buffers_return(queue, VB2_BUF_STATE_QUEUED);
+	return ret;
+}
+
+static void sun4i_frontend_m2m_streaming_stop(struct vb2_queue *queue)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = vb2_get_drv_priv(queue);
+	struct sun4i_frontend *frontend = ctx->m2m->frontend;
+
+	sun4i_frontend_m2m_buffers_return(queue, VB2_BUF_STATE_ERROR);
+
+	/* the frontend went away underneath us. */
+	if (!frontend)
+		return;
+
+	pm_runtime_put(frontend->dev);
+	sun4i_frontend_m2m_put(frontend);
+}
+
+static const struct vb2_ops sun4i_frontend_m2m_vb2_ops = {
+	.queue_setup = sun4i_frontend_m2m_queue_setup,
+	.buf_prepare = sun4i_frontend_m2m_buffer_prepare,
+	.buf_queue = sun4i_frontend_m2m_buffer_queue,
+	.start_streaming = sun4i_frontend_m2m_streaming_start,
+	.stop_streaming = sun4i_frontend_m2m_streaming_stop,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+};
+
+static int sun4i_frontend_m2m_queue_init(void *priv, struct vb2_queue *src,
+					 struct vb2_queue *dst)
+{
+	struct sun4i_frontend_m2m_ctx *ctx = priv;
+	int ret;
+
+	src->type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	src->io_modes = VB2_MMAP | VB2_DMABUF;
+	src->drv_priv = ctx;
+	src->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+	src->ops = &sun4i_frontend_m2m_vb2_ops;
+	src->mem_ops = &vb2_dma_contig_memops;
+	src->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	src->lock = &ctx->m2m->lock;
+	src->dev = ctx->m2m->v4l2_dev.dev;
+
+	ret = vb2_queue_init(src);
+	if (ret)
+		return ret;
+
+	dst->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	dst->io_modes = VB2_MMAP | VB2_DMABUF;
+	dst->drv_priv = ctx;
+	dst->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+	dst->ops = &sun4i_frontend_m2m_vb2_ops;
+	dst->mem_ops = &vb2_dma_contig_memops;
+	dst->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	dst->lock = &ctx->m2m->lock;
+	dst->dev = ctx->m2m->v4l2_dev.dev;
+
+	return vb2_queue_init(dst);
+}
+
+static int sun4i_frontend_m2m_open(struct file *file)
+{
+	struct sun4i_frontend_m2m *m2m = video_drvdata(file);
+	struct sun4i_frontend_m2m_ctx *ctx;
+	int ret;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->m2m = m2m;
+
+	ctx->pix_in.width = 1920;
+	ctx->pix_in.height = 1080;
+	ctx->format_in = sun4i_frontend_m2m_format_fill(true, &ctx->pix_in);
+
+	ctx->pix_out = ctx->pix_in;
+	ctx->pix_out.pixelformat = 0;
+	ctx->format_out = sun4i_frontend_m2m_format_fill(false,
+							 &ctx->pix_out);
+
+	v4l2_fh_init(&ctx->fh, &m2m->vdev);
+	file->private_data = &ctx->fh;
+
+	ctx->fh.m2m_ctx = v4l2_m2m_ctx_init(m2m->m2m_dev, ctx,
+					    sun4i_frontend_m2m_queue_init);
+	if (IS_ERR(ctx->fh.m2m_ctx)) {
+		ret = PTR_ERR(ctx->fh.m2m_ctx);
+		v4l2_fh_exit(&ctx->fh);
+		kfree(ctx);
+		return ret;
+	}
+
+	v4l2_fh_add(&ctx->fh);
+
+	return 0;
+}
+
+static int sun4i_frontend_m2m_release(struct file *file)
+{
+	struct sun4i_frontend_m2m_ctx *ctx =
+		sun4i_frontend_m2m_ctx_from_file(file);
+	struct sun4i_frontend_m2m *m2m = ctx->m2m;
+
+	v4l2_fh_del(&ctx->fh);
+
+	mutex_lock(&m2m->lock);
+	v4l2_m2m_ctx_release(ctx->fh.m2m_ctx);
+	mutex_unlock(&m2m->lock);
+
+	v4l2_fh_exit(&ctx->fh);
+	kfree(ctx);
+
+	return 0;
+}
+
+static const struct v4l2_file_operations sun4i_frontend_m2m_fops = {
+	.owner = THIS_MODULE,
+	.open = sun4i_frontend_m2m_open,
+	.release = sun4i_frontend_m2m_release,
+	.poll = v4l2_m2m_fop_poll,
+	.unlocked_ioctl = video_ioctl2,
+	.mmap = v4l2_m2m_fop_mmap,
+};
+
+static int sun4i_frontend_m2m_querycap(struct file *file, void *handle,
+				       struct v4l2_capability *cap)
+{
+	struct sun4i_frontend_m2m *m2m = video_drvdata(file);
+
+	strscpy(cap->driver, SUN4I_FRONTEND_M2M_NAME, sizeof(cap->driver));
+	strscpy(cap->card, "Allwinner A10 Display Frontend",
+		sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%s",
+		 dev_name(m2m->v4l2_dev.dev));
+
+	return 0;
+}
+
+static int sun4i_frontend_m2m_enum_fmt(bool output, struct v4l2_fmtdesc *desc)
+{
+	const struct sun4i_frontend_m2m_format *formats;
+	unsigned int count;
+
+	if (output) {
+		formats = sun4i_frontend_m2m_formats_in;
+		count = ARRAY_SIZE(sun4i_frontend_m2m_formats_in);
+	} else {
+		formats = sun4i_frontend_m2m_formats_out;
+		count = ARRAY_SIZE(sun4i_frontend_m2m_formats_out);
+	}
+
+	if (desc->index >= count)
+		return -EINVAL;
+
+	desc->pixelformat = formats[desc->index].pixelformat;
+
+	return 0;
+}
+
+static int sun4i_frontend_m2m_enum_fmt_out(struct file *file, void *handle,
+					   struct v4l2_fmtdesc *desc)
+{
+	return sun4i_frontend_m2m_enum_fmt(true, desc);
+}
+
+static int sun4i_frontend_m2m_enum_fmt_cap(struct file *file, void *handle,
+					   struct v4l2_fmtdesc *desc)
+{
+	return sun4i_frontend_m2m_enum_fmt(false, desc);
+}
+
+static int sun4i_frontend_m2m_g_fmt(struct file *file, void *handle,
+				    struct v4l2_format *format)
+{
+	struct sun4i_frontend_m2m_ctx *ctx =
+		sun4i_frontend_m2m_ctx_from_file(file);
+
+	if (V4L2_TYPE_IS_OUTPUT(format->type))
+		format->fmt.pix_mp = ctx->pix_in;
+	else
+		format->fmt.pix_mp = ctx->pix_out;
+
+	return 0;
+}
+
+static int sun4i_frontend_m2m_try_fmt(struct file *file, void *handle,
+				      struct v4l2_format *format)
+{
+	sun4i_frontend_m2m_format_fill(V4L2_TYPE_IS_OUTPUT(format->type),
+				       &format->fmt.pix_mp);
+
+	return 0;
+}
+
+static int sun4i_frontend_m2m_s_fmt(struct file *file, void *handle,
+				    struct v4l2_format *format)
+{
+	struct sun4i_frontend_m2m_ctx *ctx =
+		sun4i_frontend_m2m_ctx_from_file(file);
+	bool output = V4L2_TYPE_IS_OUTPUT(format->type);
+	const struct sun4i_frontend_m2m_format *found;
+	struct vb2_queue *queue;
+
+	queue = v4l2_m2m_get_vq(ctx->fh.m2m_ctx, format->type);
+	if (vb2_is_busy(queue))
+		return -EBUSY;
+
+	found = sun4i_frontend_m2m_format_fill(output, &format->fmt.pix_mp);
+
+	if (output) {
+		ctx->pix_in = format->fmt.pix_mp;
+		ctx->format_in = found;
+	} else {
+		ctx->pix_out = format->fmt.pix_mp;
+		ctx->format_out = found;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ioctl_ops sun4i_frontend_m2m_ioctl_ops = {
+	.vidioc_querycap = sun4i_frontend_m2m_querycap,
+
+	.vidioc_enum_fmt_vid_out_mplane = sun4i_frontend_m2m_enum_fmt_out,
+	.vidioc_g_fmt_vid_out_mplane = sun4i_frontend_m2m_g_fmt,
+	.vidioc_try_fmt_vid_out_mplane = sun4i_frontend_m2m_try_fmt,
+	.vidioc_s_fmt_vid_out_mplane = sun4i_frontend_m2m_s_fmt,
+
+	.vidioc_enum_fmt_vid_cap_mplane = sun4i_frontend_m2m_enum_fmt_cap,
+	.vidioc_g_fmt_vid_cap_mplane = sun4i_frontend_m2m_g_fmt,
+	.vidioc_try_fmt_vid_cap_mplane = sun4i_frontend_m2m_try_fmt,
+	.vidioc_s_fmt_vid_cap_mplane = sun4i_frontend_m2m_s_fmt,
+
+	.vidioc_reqbufs = v4l2_m2m_ioctl_reqbufs,
+	.vidioc_querybuf = v4l2_m2m_ioctl_querybuf,
+	.vidioc_qbuf = v4l2_m2m_ioctl_qbuf,
+	.vidioc_dqbuf = v4l2_m2m_ioctl_dqbuf,
+	.vidioc_prepare_buf = v4l2_m2m_ioctl_prepare_buf,
+	.vidioc_create_bufs = v4l2_m2m_ioctl_create_bufs,
+	.vidioc_expbuf = v4l2_m2m_ioctl_expbuf,
+
+	.vidioc_streamon = v4l2_m2m_ioctl_streamon,
+	.vidioc_streamoff = v4l2_m2m_ioctl_streamoff,
+};
+
+/* Only once the last file handle is gone. */
+static void sun4i_frontend_m2m_vdev_release(struct video_device *vdev)
+{
+	struct sun4i_frontend_m2m *m2m =
+		container_of(vdev, struct sun4i_frontend_m2m, vdev);
+
+	cancel_delayed_work_sync(&m2m->watchdog);
+	v4l2_m2m_release(m2m->m2m_dev);
+	v4l2_device_unregister(&m2m->v4l2_dev);
+	mutex_destroy(&m2m->lock);
+	kfree(m2m);
+}
+
+int sun4i_frontend_m2m_register(struct sun4i_frontend *frontend)
+{
+	struct platform_device *pdev = to_platform_device(frontend->dev);
+	struct sun4i_frontend_m2m *m2m;
+	struct video_device *vdev;
+	int ret;
+
+	m2m = kzalloc(sizeof(*m2m), GFP_KERNEL);
+	if (!m2m)
+		return -ENOMEM;
+
+	m2m->frontend = frontend;
+	mutex_init(&m2m->lock);
+	spin_lock_init(&m2m->job_lock);
+	INIT_DELAYED_WORK(&m2m->watchdog, sun4i_frontend_m2m_watchdog);
+
+	/* older device trees do not list the frontend interrupt. */
+	m2m->irq = platform_get_irq(pdev, 0);
+	if (m2m->irq < 0) {
+		ret = m2m->irq;
+		goto error_free;
+	}
+
+	ret = request_irq(m2m->irq, sun4i_frontend_m2m_isr, 0,
+			  SUN4I_FRONTEND_M2M_NAME, m2m);
+	if (ret)
+		goto error_free;
+
+	ret = v4l2_device_register(frontend->dev, &m2m->v4l2_dev);
+	if (ret)
+		goto error_irq;
+
+	m2m->m2m_dev = v4l2_m2m_init(&sun4i_frontend_m2m_ops);
+	if (IS_ERR(m2m->m2m_dev)) {
+		ret = PTR_ERR(m2m->m2m_dev);
+		goto error_v4l2;
+	}
+
+	vdev = &m2m->vdev;
+	strscpy(vdev->name, SUN4I_FRONTEND_M2M_NAME, sizeof(vdev->name));
+	vdev->fops = &sun4i_frontend_m2m_fops;
+	vdev->ioctl_ops = &sun4i_frontend_m2m_ioctl_ops;
+	vdev->release = video_device_release_empty;
+	vdev->lock = &m2m->lock;
+	vdev->v4l2_dev = &m2m->v4l2_dev;
+	vdev->vfl_dir = VFL_DIR_M2M;
+	vdev->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+	video_set_drvdata(vdev, m2m);
+
+	ret = video_register_device(vdev, VFL_TYPE_GRABBER, -1);
+	if (ret)
+		goto error_m2m;
+
+	/* from here on, the last file handle frees m2m. */
+	vdev->release = sun4i_frontend_m2m_vdev_release;
+	frontend->m2m = m2m;
+
+	dev_info(frontend->dev, "mem2mem device registered as %s.\n",
+		 video_device_node_name(vdev));
+
+	return 0;
+
+ error_m2m:
+	v4l2_m2m_release(m2m->m2m_dev);
+ error_v4l2:
+	v4l2_device_unregister(&m2m->v4l2_dev);
+ error_irq:
+	free_irq(m2m->irq, m2m);
+ error_free:
+	kfree(m2m);
+	return ret;
+}
+
+void sun4i_frontend_m2m_unregister(struct sun4i_frontend *frontend)
+{
+	struct sun4i_frontend_m2m *m2m = frontend->m2m;
+	unsigned long flags;
+
+	if (!m2m)
+		return;
+
+	/*
+	 * Open file handles keep m2m around until the release callback,
+	 * but the frontend is gone once we return. Hand the job on the
+	 * hardware, and all later ones, back through the watchdog.
+	 */
+	get_device(&m2m->vdev.dev);
+	video_unregister_device(&m2m->vdev);
+
+	mutex_lock(&m2m->lock);
+	free_irq(m2m->irq, m2m);
+
+	spin_lock_irqsave(&m2m->job_lock, flags);
+	if (m2m->running) {
+		sun4i_frontend_m2m_frame_stop(frontend->regs);
+		mod_delayed_work(system_wq, &m2m->watchdog, 0);
+	}
+	m2m->frontend = NULL;
+	spin_unlock_irqrestore(&m2m->job_lock, flags);
+	mutex_unlock(&m2m->lock);
+
+	put_device(&m2m->vdev.dev);
+
+	frontend->m2m = NULL;
+}
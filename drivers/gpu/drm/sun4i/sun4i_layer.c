@@ -8,12 +8,19 @@
  * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
  */
 
+#include <drm/drm_atomic.h>
 #include <drm/drm_atomic_helper.h>
+#include <drm/drm_atomic_uapi.h>
 #include <drm/drm_plane_helper.h>
+#include <drm/drm_gem.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drmP.h>
 
+#include <linux/dma-fence.h>
+#include <linux/reservation.h>
+
 #include "sun4i_backend.h"
+#include "sun4i_drv.h"
 #include "sun4i_frontend.h"
 #include "sun4i_layer.h"
 #include "sun4i_sprite.h"
@@ -71,6 +78,38 @@ static const uint32_t sun4i_layer_formats_all[] = {
 	SUN4I_LAYER_FORMATS_ALL,
 };
 
+/*
+ * Claims the frontend for this state, when it does not hold it already.
+ * The claim is dropped only when the state gets destroyed, so that both
+ * a state which failed its check and one that got replaced let go of it.
+ */
+int sun4i_layer_claim_frontend(struct drm_plane_state *state)
+{
+	struct sun4i_layer *layer = plane_to_sun4i_layer(state->plane);
+	struct sun4i_layer_state *layer_state =
+		state_to_sun4i_layer_state(state);
+	int ret;
+
+	if (layer_state->frontend_claimed)
+		return 0;
+
+	ret = sun4i_frontend_claim(layer->frontend,
+				   layer->backend->engine.id);
+	if (ret)
+		return ret;
+
+	layer_state->frontend_claimed = true;
+
+	return 0;
+}
+
+static void sun4i_layer_unclaim_frontend(struct sun4i_layer *layer,
+					 struct sun4i_layer_state *state)
+{
+	if (state->frontend_claimed)
+		sun4i_frontend_unclaim(layer->frontend);
+}
+
 static void sun4i_backend_layer_reset(struct drm_plane *plane)
 {
 	struct sun4i_layer *layer = plane_to_sun4i_layer(plane);
@@ -79,6 +118,7 @@ static void sun4i_backend_layer_reset(struct drm_plane *plane)
 	if (plane->state) {
 		state = state_to_sun4i_layer_state(plane->state);
 
+		sun4i_layer_unclaim_frontend(layer, state);
 		__drm_atomic_helper_plane_destroy_state(&state->state);
 
 		kfree(state);
@@ -89,6 +129,8 @@ static void sun4i_backend_layer_reset(struct drm_plane *plane)
 	if (state) {
 		__drm_atomic_helper_plane_reset(plane, &state->state);
 		plane->state->zpos = layer->id;
+		/* what the hardware does, see sun4i_layer_has_pixel_alpha(). */
+		plane->state->pixel_blend_mode = DRM_MODE_BLEND_COVERAGE;
 	}
 }
 
@@ -104,6 +146,8 @@ sun4i_backend_layer_duplicate_state(struct drm_plane *plane)
 
 	__drm_atomic_helper_plane_duplicate_state(plane, &copy->state);
 	copy->uses_frontend = orig->uses_frontend;
+	copy->pipe = orig->pipe;
+	copy->async_flip = orig->async_flip;
 
 	return &copy->state;
 }
@@ -113,6 +157,7 @@ static void sun4i_backend_layer_destroy_state(struct drm_plane *plane,
 {
 	struct sun4i_layer_state *s_state = state_to_sun4i_layer_state(state);
 
+	sun4i_layer_unclaim_frontend(plane_to_sun4i_layer(plane), s_state);
 	__drm_atomic_helper_plane_destroy_state(state);
 
 	kfree(s_state);
@@ -131,34 +176,94 @@ static void sun4i_backend_layer_atomic_disable(struct drm_plane *plane,
 		unsigned long flags;
 
 		spin_lock_irqsave(&backend->frontend_lock, flags);
-		backend->frontend_teardown = true;
+		backend->frontend_teardown |= BIT(layer->frontend->id);
 		spin_unlock_irqrestore(&backend->frontend_lock, flags);
 	}
 }
 
+/*
+ * Whether only the framebuffer changed, and it kept its format and
+ * pitches. This is what flipping through a set of buffers looks like.
+ */
+static bool sun4i_layer_is_flip(struct drm_plane_state *state,
+				struct drm_plane_state *old_state)
+{
+	struct sun4i_layer_state *layer_state =
+		state_to_sun4i_layer_state(state);
+	struct sun4i_layer_state *old_layer_state =
+		state_to_sun4i_layer_state(old_state);
+	struct drm_framebuffer *fb = state->fb;
+	struct drm_framebuffer *old_fb = old_state->fb;
+	int i;
+
+	if (!fb || !old_fb || !old_state->crtc ||
+	    (state->crtc != old_state->crtc))
+		return false;
+
+	if (layer_state->uses_frontend || old_layer_state->uses_frontend)
+		return false;
+
+	if ((fb->format != old_fb->format) ||
+	    (fb->modifier != old_fb->modifier))
+		return false;
+
+	for (i = 0; i < fb->format->num_planes; i++)
+		if (fb->pitches[i] != old_fb->pitches[i])
+			return false;
+
+	return (state->crtc_x == old_state->crtc_x) &&
+		(state->crtc_y == old_state->crtc_y) &&
+		(state->crtc_w == old_state->crtc_w) &&
+		(state->crtc_h == old_state->crtc_h) &&
+		(state->src_x == old_state->src_x) &&
+		(state->src_y == old_state->src_y) &&
+		(state->src_w == old_state->src_w) &&
+		(state->src_h == old_state->src_h) &&
+		(state->normalized_zpos == old_state->normalized_zpos) &&
+		(state->alpha == old_state->alpha) &&
+		(state->pixel_blend_mode == old_state->pixel_blend_mode) &&
+		(layer_state->pipe == old_layer_state->pipe);
+}
+
 static void sun4i_backend_layer_atomic_update(struct drm_plane *plane,
 					      struct drm_plane_state *old_state)
 {
 	struct sun4i_layer_state *layer_state = state_to_sun4i_layer_state(plane->state);
 	struct sun4i_layer *layer = plane_to_sun4i_layer(plane);
 	struct sun4i_backend *backend = layer->backend;
-	struct sun4i_frontend *frontend = backend->frontend;
+	struct sun4i_frontend *frontend = layer->frontend;
+
+	/* just point the layer at the new buffer. */
+	if (sun4i_layer_is_flip(plane->state, old_state)) {
+		sun4i_backend_update_layer_buffer(backend, layer->id, plane);
+		return;
+	}
 
 	if (layer_state->uses_frontend) {
-		const struct drm_format_info *format =
-			plane->state->fb->format;
 		uint32_t format_backend;
+		unsigned long flags;
 
-		if (format->has_alpha)
+		if (sun4i_layer_has_pixel_alpha(plane->state))
 			format_backend = DRM_FORMAT_ARGB8888;
 		else
 			format_backend = DRM_FORMAT_XRGB8888;
 
-		sun4i_frontend_init(frontend, backend->engine.id);
+		/* it is in use again, before the vblank could turn it off. */
+		spin_lock_irqsave(&backend->frontend_lock, flags);
+		backend->frontend_teardown &= ~BIT(frontend->id);
+		spin_unlock_irqrestore(&backend->frontend_lock, flags);
+
+		/* our claim keeps everyone else out, so it failed to power up. */
+		if (sun4i_frontend_init(frontend, backend->engine.id) < 0) {
+			DRM_ERROR("%s(%d.%d): frontend failed to start.\n",
+				  __func__, backend->engine.id, layer->id);
+			return;
+		}
 		sun4i_frontend_update_coord(frontend, plane);
 		sun4i_frontend_update_buffer(frontend, plane);
 		sun4i_frontend_format_set(frontend, plane, format_backend);
-		sun4i_backend_frontend_set(backend, layer->id, format_backend);
+		sun4i_backend_frontend_set(backend, frontend, layer->id,
+					   format_backend);
 		sun4i_frontend_enable(frontend);
 	} else {
 		sun4i_backend_update_layer_formats(backend, layer->id, plane);
@@ -178,7 +283,7 @@ static bool sun4i_layer_format_mod_supported(struct drm_plane *plane,
 	bool supported;
 
 	supported = sun4i_backend_format_is_supported(format, modifier);
-	if (!supported && !IS_ERR_OR_NULL(layer->backend->frontend))
+	if (!supported && layer->frontend)
 		supported =
 			sun4i_frontend_format_is_supported(format, modifier);
 
@@ -224,38 +329,223 @@ static int sun4i_backend_layer_atomic_check(struct drm_plane *plane,
 			const struct drm_format_info *format =
 				state->fb->format;
 
-			if (format->is_yuv || (format->num_planes > 1))
+			/*
+			 * Planar rgb is read by the backend directly, so that
+			 * capture buffers can be flipped without copies. So
+			 * is packed yuv on the yuv layer.
+			 */
+			if ((format->is_yuv && !layer->yuv) ||
+			    !sun4i_backend_format_is_supported(format->format,
+							       state->fb->modifier))
 				layer_state->uses_frontend = true;
 		}
 	}
 
+	/*
+	 * The frontend might be converting frames for v4l2 instead, or
+	 * feeding the other backend.
+	 */
+	if (layer_state->uses_frontend && sun4i_layer_claim_frontend(state)) {
+		DRM_DEBUG_DRIVER("%s(%d.%d): frontend is busy.\n", __func__,
+				 layer->backend->engine.id, layer->id);
+		return -EBUSY;
+	}
+
+	/* the backend cannot undo the pre-multiplication. */
+	if (state->fb && state->fb->format->has_alpha &&
+	    (state->pixel_blend_mode == DRM_MODE_BLEND_PREMULTI)) {
+		DRM_DEBUG_DRIVER("%s(%d.%d): cannot blend pre-multiplied "
+				 "alpha.\n", __func__,
+				 layer->backend->engine.id, layer->id);
+		return -EINVAL;
+	}
+
+	/* only the 32bpp formats come with an alpha-less twin. */
+	if (state->fb && !layer_state->uses_frontend &&
+	    state->fb->format->has_alpha &&
+	    !sun4i_layer_has_pixel_alpha(state) &&
+	    (state->fb->format->cpp[0] != 4)) {
+		DRM_DEBUG_DRIVER("%s(%d.%d): cannot ignore the alpha of "
+				 "this format.\n", __func__,
+				 layer->backend->engine.id, layer->id);
+		return -EINVAL;
+	}
+
 	/* todo: test physical limits */
 
 	return 0;
 }
 
+/*
+ * Whether the new framebuffer is still being written to. The async path
+ * never waits for fences, and prepare_fb only picks up the implicit one
+ * after this check, so we look at the buffers ourselves.
+ */
+static bool sun4i_layer_fb_busy(struct drm_plane_state *state)
+{
+	struct drm_gem_object *obj;
+	int i;
+
+	if (state->fence && !dma_fence_is_signaled(state->fence))
+		return true;
+
+	for (i = 0; i < state->fb->format->num_planes; i++) {
+		obj = drm_gem_fb_get_obj(state->fb, i);
+		if (obj && !reservation_object_test_signaled_rcu(obj->resv,
+								 false))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Only buffer flips are done asynchronously, and only when asked for. A
+ * flip to a buffer that is not ready yet goes through the vblank path,
+ * which waits for it.
+ */
+static int sun4i_backend_layer_atomic_async_check(struct drm_plane *plane,
+						  struct drm_plane_state *state)
+{
+	if (!state_to_sun4i_layer_state(state)->async_flip ||
+	    !sun4i_layer_is_flip(state, plane->state))
+		return -EINVAL;
+
+	if (sun4i_layer_fb_busy(state))
+		return -EBUSY;
+
+	return 0;
+}
+
+static void
+sun4i_backend_layer_atomic_async_update(struct drm_plane *plane,
+					struct drm_plane_state *new_state)
+{
+	struct sun4i_layer *layer = plane_to_sun4i_layer(plane);
+	struct drm_framebuffer *old_fb = plane->state->fb;
+
+	/* the helpers clean up the new state, so it gets the old fb. */
+	swap(plane->state->fb, new_state->fb);
+
+	sun4i_backend_layer_flip(layer->backend, layer->id, plane, old_fb);
+}
+
 static const struct drm_plane_helper_funcs sun4i_backend_layer_helper_funcs = {
 	.prepare_fb	= drm_gem_fb_prepare_fb,
 	.atomic_check = sun4i_backend_layer_atomic_check,
 	.atomic_disable	= sun4i_backend_layer_atomic_disable,
 	.atomic_update	= sun4i_backend_layer_atomic_update,
+	.atomic_async_check = sun4i_backend_layer_atomic_async_check,
+	.atomic_async_update = sun4i_backend_layer_atomic_async_update,
 };
 
+/*
+ * drm_atomic_helper_update_plane(), but with the "async flip" property
+ * set, a SETPLANE which only changes the buffer is treated like a cursor
+ * update: it gets applied right away through atomic_async_update, and
+ * does not wait for vblank. This way, a preview can always show the newest
+ * frame, and never blocks. The previous buffer is scanned out until the
+ * next vblank, so userspace has to wait for that before reusing it.
+ */
+static int sun4i_backend_layer_update_plane(struct drm_plane *plane,
+					    struct drm_crtc *crtc,
+					    struct drm_framebuffer *fb,
+					    int crtc_x, int crtc_y,
+					    unsigned int crtc_w,
+					    unsigned int crtc_h,
+					    uint32_t src_x, uint32_t src_y,
+					    uint32_t src_w, uint32_t src_h,
+					    struct drm_modeset_acquire_ctx *ctx)
+{
+	struct drm_atomic_state *state;
+	struct drm_plane_state *plane_state;
+	int ret;
+
+	state = drm_atomic_state_alloc(plane->dev);
+	if (!state)
+		return -ENOMEM;
+
+	state->acquire_ctx = ctx;
+	plane_state = drm_atomic_get_plane_state(state, plane);
+	if (IS_ERR(plane_state)) {
+		ret = PTR_ERR(plane_state);
+		goto out;
+	}
+
+	ret = drm_atomic_set_crtc_for_plane(plane_state, crtc);
+	if (ret)
+		goto out;
+	drm_atomic_set_fb_for_plane(plane_state, fb);
+	plane_state->crtc_x = crtc_x;
+	plane_state->crtc_y = crtc_y;
+	plane_state->crtc_w = crtc_w;
+	plane_state->crtc_h = crtc_h;
+	plane_state->src_x = src_x;
+	plane_state->src_y = src_y;
+	plane_state->src_w = src_w;
+	plane_state->src_h = src_h;
+
+	state->legacy_cursor_update =
+		state_to_sun4i_layer_state(plane_state)->async_flip;
+
+	ret = drm_atomic_commit(state);
+ out:
+	drm_atomic_state_put(state);
+	return ret;
+}
+
+static int sun4i_backend_layer_atomic_set_property(struct drm_plane *plane,
+						    struct drm_plane_state *state,
+						    struct drm_property *property,
+						    uint64_t val)
+{
+	struct sun4i_drv *drv = plane->dev->dev_private;
+
+	if (property != drv->async_flip_property)
+		return -EINVAL;
+
+	state_to_sun4i_layer_state(state)->async_flip = val;
+
+	return 0;
+}
+
+static int
+sun4i_backend_layer_atomic_get_property(struct drm_plane *plane,
+					const struct drm_plane_state *state,
+					struct drm_property *property,
+					uint64_t *val)
+{
+	struct sun4i_drv *drv = plane->dev->dev_private;
+	const struct sun4i_layer_state *layer_state =
+		container_of(state, struct sun4i_layer_state, state);
+
+	if (property != drv->async_flip_property)
+		return -EINVAL;
+
+	*val = layer_state->async_flip;
+
+	return 0;
+}
+
 static const struct drm_plane_funcs sun4i_backend_layer_funcs = {
 	.atomic_destroy_state	= sun4i_backend_layer_destroy_state,
 	.atomic_duplicate_state	= sun4i_backend_layer_duplicate_state,
+	.atomic_get_property	= sun4i_backend_layer_atomic_get_property,
+	.atomic_set_property	= sun4i_backend_layer_atomic_set_property,
 	.destroy		= drm_plane_cleanup,
 	.disable_plane		= drm_atomic_helper_disable_plane,
 	.reset			= sun4i_backend_layer_reset,
-	.update_plane		= drm_atomic_helper_update_plane,
+	.update_plane		= sun4i_backend_layer_update_plane,
 	.format_mod_supported	= sun4i_layer_format_mod_supported,
 };
 
 static struct drm_plane *sun4i_layer_init(struct drm_device *drm,
 					  struct sun4i_backend *backend,
 					  enum drm_plane_type type,
-					  int id, bool frontend, bool yuv)
+					  int id, struct sun4i_frontend *frontend,
+					  bool yuv)
 {
+	struct sun4i_drv *drv = drm->dev_private;
 	struct sun4i_layer *layer;
 	const uint64_t *modifiers;
 	const uint32_t *formats;
@@ -300,9 +590,20 @@ static struct drm_plane *sun4i_layer_init(struct drm_device *drm,
 			     &sun4i_backend_layer_helper_funcs);
 
 	drm_plane_create_alpha_property(&layer->plane);
+	drm_plane_create_blend_mode_property(&layer->plane,
+					     BIT(DRM_MODE_BLEND_PIXEL_NONE) |
+					     BIT(DRM_MODE_BLEND_PREMULTI) |
+					     BIT(DRM_MODE_BLEND_COVERAGE));
 	drm_plane_create_zpos_property(&layer->plane, id, 0,
 				       SUN4I_BACKEND_NUM_LAYERS - 1);
 
+	if (!drv->async_flip_property)
+		drv->async_flip_property =
+			drm_property_create_bool(drm, 0, "async flip");
+	if (drv->async_flip_property)
+		drm_object_attach_property(&layer->plane.base,
+					   drv->async_flip_property, 0);
+
 	backend->layers_mask |= 1 << layer->plane.index;
 
 	return &layer->plane;
@@ -336,7 +637,7 @@ sun4i_layers_init(struct drm_device *drm, struct sunxi_engine *engine,
 	 * This one is critical for kms, error out if it fails
 	 */
 	plane = sun4i_layer_init(drm, backend, DRM_PLANE_TYPE_PRIMARY,
-				 0, false, false);
+				 0, NULL, false);
 	if (IS_ERR(plane)) {
 		DRM_DEV_ERROR(drm->dev, "%s(): primary layer init failed.\n",
 			      __func__);
@@ -351,12 +652,8 @@ sun4i_layers_init(struct drm_device *drm, struct sunxi_engine *engine,
 	 */
 
 	/* Our second layer, try to use the scaler */
-	if (IS_ERR_OR_NULL(backend->frontend))
-		plane = sun4i_layer_init(drm, backend, DRM_PLANE_TYPE_OVERLAY,
-					 1, false, false);
-	else
-		plane = sun4i_layer_init(drm, backend, DRM_PLANE_TYPE_OVERLAY,
-					 1, true, false);
+	plane = sun4i_layer_init(drm, backend, DRM_PLANE_TYPE_OVERLAY,
+				 1, backend->frontends[0], false);
 	if (IS_ERR(plane)) {
 		DRM_DEV_ERROR(drm->dev, "%s() layer 1 init failed.\n",
 			      __func__);
@@ -366,9 +663,12 @@ sun4i_layers_init(struct drm_device *drm, struct sunxi_engine *engine,
 		j++;
 	}
 
-	/* Our third layer, use yuv */
+	/*
+	 * Our third layer, use yuv, and the scaler that we share with the
+	 * other backend, so that two scaled windows can be shown at once.
+	 */
 	plane = sun4i_layer_init(drm, backend, DRM_PLANE_TYPE_OVERLAY,
-				 2, false, true);
+				 2, backend->frontends[1], true);
 	if (IS_ERR(plane)) {
 		DRM_DEV_ERROR(drm->dev, "%s() layer 2 init failed.\n",
 			      __func__);
@@ -379,7 +679,7 @@ sun4i_layers_init(struct drm_device *drm, struct sunxi_engine *engine,
 
 	/* final layer, rgb only */
 	plane = sun4i_layer_init(drm, backend, DRM_PLANE_TYPE_OVERLAY,
-				 1, false, false);
+				 3, NULL, false);
 	if (IS_ERR(plane)) {
 		DRM_DEV_ERROR(drm->dev, "%s() layer 3 init failed.\n",
 			      __func__);
@@ -9,6 +9,7 @@
 #ifndef _SUN4I_LAYER_H_
 #define _SUN4I_LAYER_H_
 
+struct sun4i_frontend;
 struct sunxi_engine;
 
 struct sun4i_layer {
@@ -16,7 +17,7 @@ struct sun4i_layer {
 	struct sun4i_drv	*drv;
 	struct sun4i_backend	*backend;
 	int			id;
-	bool frontend;
+	struct sun4i_frontend	*frontend;
 	bool yuv;
 };
 
@@ -24,6 +25,9 @@ struct sun4i_layer_state {
 	struct drm_plane_state	state;
 	unsigned int		pipe;
 	bool			uses_frontend;
+	/* holds a claim on the frontend, dropped with the state. */
+	bool			frontend_claimed;
+	bool			async_flip;
 };
 
 static inline struct sun4i_layer *
@@ -38,6 +42,26 @@ state_to_sun4i_layer_state(struct drm_plane_state *state)
 	return container_of(state, struct sun4i_layer_state, state);
 }
 
+/*
+ * The backend only blends non pre-multiplied, so layers start out with the
+ * "Coverage" blend mode, and "Pre-multiplied", which drm requires us to
+ * list, is refused for formats with alpha.
+ */
+static inline bool
+sun4i_layer_has_pixel_alpha(const struct drm_plane_state *state)
+{
+	return state->fb->format->has_alpha &&
+		(state->pixel_blend_mode != DRM_MODE_BLEND_PIXEL_NONE);
+}
+
+static inline bool sun4i_layer_has_alpha(const struct drm_plane_state *state)
+{
+	return sun4i_layer_has_pixel_alpha(state) ||
+		(state->alpha != DRM_BLEND_ALPHA_OPAQUE);
+}
+
+int sun4i_layer_claim_frontend(struct drm_plane_state *state);
+
 struct drm_plane **sun4i_layers_init(struct drm_device *drm,
 				     struct sunxi_engine *engine,
 				     int *plane_count);
@@ -9,6 +9,7 @@
 struct drm_crtc;
 struct drm_plane;
 struct drm_device;
+struct drm_minor;
 struct drm_crtc_state;
 struct drm_display_mode;
 
@@ -113,6 +114,40 @@ struct sunxi_engine_ops {
 	 */
 	void (*vblank_quirk)(struct sunxi_engine *engine);
 
+	/**
+	 * @disable:
+	 *
+	 * This callback is run when the CRTC that the engine feeds is
+	 * disabled, after its vblanks have been turned off, so that the
+	 * engine can finish off work that waits for a vblank.
+	 *
+	 * This function is optional.
+	 */
+	void (*disable)(struct sunxi_engine *engine);
+
+	/**
+	 * @writeback_init:
+	 *
+	 * This callback creates a writeback connector for the output
+	 * of the engine, once the CRTC it feeds is known.
+	 *
+	 * This function is optional.
+	 */
+	int (*writeback_init)(struct drm_device *drm,
+			      struct sunxi_engine *engine,
+			      struct drm_crtc *crtc);
+
+	/**
+	 * @debugfs_init:
+	 *
+	 * This callback adds the debugfs files of the engine to those of
+	 * the DRM minor, once it is registered.
+	 *
+	 * This function is optional.
+	 */
+	int (*debugfs_init)(struct sunxi_engine *engine,
+			    struct drm_minor *minor);
+
 	/*
 	 * Sets amongst others, CRTC dimensions, and interlacing.
 	 */
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * vb2-stats.c - per queue buffer latency statistics for videobuf2
+ *
+ * Hooks into the vb2 tracepoints and keeps, for every queue that asked for
+ * it, histograms of how long buffers spent between qbuf and being handed to
+ * the driver, between the driver getting and finishing them, and between
+ * being finished and dequeued, plus how many buffers the driver and
+ * userspace held along the way. This tells at a glance whether a dropped
+ * frame was down to the hardware, the driver or the userspace pipeline.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+
+#include <media/videobuf2-core.h>
+#include <trace/events/vb2.h>
+
+/* bucket 0 holds < 1us, bucket n holds [2^(n-1), 2^n) us. */
+#define VB2_STATS_BUCKETS	24
+
+struct vb2_stats {
+	struct dentry *dentry;
+
+	spinlock_t lock;
+
+	/* per buffer index, in ns. 0 when not seen yet. */
+	u64 qbuf[VB2_MAX_FRAME];
+	u64 buf_queue[VB2_MAX_FRAME];
+	u64 buf_done[VB2_MAX_FRAME];
+
+	u32 queue_to_driver[VB2_STATS_BUCKETS];
+	u32 driver_to_done[VB2_STATS_BUCKETS];
+	u32 done_to_dqbuf[VB2_STATS_BUCKETS];
+
+	/* sampled on buf_done and on dqbuf respectively. */
+	u32 owned_by_driver[VB2_MAX_FRAME + 1];
+	u32 owned_by_user[VB2_MAX_FRAME + 1];
+};
+
+/* the tracepoint probes are shared by all queues with statistics. */
+static DEFINE_MUTEX(vb2_stats_lock);
+static unsigned int vb2_stats_users;
+
+static void vb2_stats_latency(u32 *histogram, u64 start, u64 end)
+{
+	u64 us;
+
+	if (!start || end < start)
+		return;
+
+	us = div_u64(end - start, NSEC_PER_USEC);
+	histogram[min_t(unsigned int, fls64(us), VB2_STATS_BUCKETS - 1)]++;
+}
+
+static void vb2_stats_count(u32 *histogram, int count)
+{
+	histogram[clamp(count, 0, VB2_MAX_FRAME)]++;
+}
+
+static void vb2_stats_qbuf(void *data, struct vb2_queue *q,
+			   struct vb2_buffer *vb)
+{
+	struct vb2_stats *stats = READ_ONCE(q->stats);
+	unsigned long flags;
+
+	if (!stats)
+		return;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->qbuf[vb->index] = ktime_get_ns();
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static void vb2_stats_buf_queue(void *data, struct vb2_queue *q,
+				struct vb2_buffer *vb)
+{
+	struct vb2_stats *stats = READ_ONCE(q->stats);
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+
+	if (!stats)
+		return;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->buf_queue[vb->index] = now;
+	vb2_stats_latency(stats->queue_to_driver, stats->qbuf[vb->index], now);
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static void vb2_stats_buf_done(void *data, struct vb2_queue *q,
+			       struct vb2_buffer *vb)
+{
+	struct vb2_stats *stats = READ_ONCE(q->stats);
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+
+	if (!stats)
+		return;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->buf_done[vb->index] = now;
+	vb2_stats_latency(stats->driver_to_done,
+			  stats->buf_queue[vb->index], now);
+	vb2_stats_count(stats->owned_by_driver,
+			atomic_read(&q->owned_by_drv_count));
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static void vb2_stats_dqbuf(void *data, struct vb2_queue *q,
+			    struct vb2_buffer *vb)
+{
+	struct vb2_stats *stats = READ_ONCE(q->stats);
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+
+	if (!stats)
+		return;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	vb2_stats_latency(stats->done_to_dqbuf,
+			  stats->buf_done[vb->index], now);
+	vb2_stats_count(stats->owned_by_user,
+			q->num_buffers - q->queued_count);
+	stats->qbuf[vb->index] = 0;
+	stats->buf_queue[vb->index] = 0;
+	stats->buf_done[vb->index] = 0;
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static int vb2_stats_probes_register(void)
+{
+	int ret;
+
+	ret = register_trace_vb2_qbuf(vb2_stats_qbuf, NULL);
+	if (ret)
+		return ret;
+
+	ret = register_trace_vb2_buf_queue(vb2_stats_buf_queue, NULL);
+	if (ret)
+		goto error_qbuf;
+
+	ret = register_trace_vb2_buf_done(vb2_stats_buf_done, NULL);
+	if (ret)
+		goto error_buf_queue;
+
+	ret = register_trace_vb2_dqbuf(vb2_stats_dqbuf, NULL);
+	if (ret)
+		goto error_buf_done;
+
+	return 0;
+
+ error_buf_done:
+	unregister_trace_vb2_buf_done(vb2_stats_buf_done, NULL);
+ error_buf_queue:
+	unregister_trace_vb2_buf_queue(vb2_stats_buf_queue, NULL);
+ error_qbuf:
+	unregister_trace_vb2_qbuf(vb2_stats_qbuf, NULL);
+	return ret;
+}
+
+static void vb2_stats_probes_unregister(void)
+{
+	unregister_trace_vb2_dqbuf(vb2_stats_dqbuf, NULL);
+	unregister_trace_vb2_buf_done(vb2_stats_buf_done, NULL);
+	unregister_trace_vb2_buf_queue(vb2_stats_buf_queue, NULL);
+	unregister_trace_vb2_qbuf(vb2_stats_qbuf, NULL);
+}
+
+static void vb2_stats_latency_show(struct seq_file *file, const char *name,
+				   const u32 *histogram)
+{
+	unsigned int i;
+
+	seq_printf(file, "%s:\n", name);
+	for (i = 0; i < VB2_STATS_BUCKETS; i++) {
+		if (!histogram[i])
+			continue;
+
+		if (!i)
+			seq_printf(file, "  %10s < %8uus: %u\n", "",
+				   1, histogram[i]);
+		else if (i == VB2_STATS_BUCKETS - 1)
+			seq_printf(file, "  %8uus < %10s: %u\n",
+				   1 << (i - 1), "", histogram[i]);
+		else
+			seq_printf(file, "  %8uus - %8uus: %u\n",
+				   1 << (i - 1), 1 << i, histogram[i]);
+	}
+}
+
+static void vb2_stats_count_show(struct seq_file *file, const char *name,
+				 const u32 *histogram)
+{
+	unsigned int i;
+
+	seq_printf(file, "%s:\n", name);
+	for (i = 0; i <= VB2_MAX_FRAME; i++)
+		if (histogram[i])
+			seq_printf(file, "  %2u: %u\n", i, histogram[i]);
+}
+
+static int vb2_stats_show(struct seq_file *file, void *data)
+{
+	struct vb2_queue *q = file->private;
+	struct vb2_stats *stats = q->stats;
+	struct vb2_stats *copy;
+	unsigned long flags;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	*copy = *stats;
+	spin_unlock_irqrestore(&stats->lock, flags);
+
+	vb2_stats_latency_show(file, "qbuf to buf_queue",
+			       copy->queue_to_driver);
+	vb2_stats_latency_show(file, "buf_queue to buf_done",
+			       copy->driver_to_done);
+	vb2_stats_latency_show(file, "buf_done to dqbuf",
+			       copy->done_to_dqbuf);
+	vb2_stats_count_show(file, "buffers owned by the driver, at buf_done",
+			     copy->owned_by_driver);
+	vb2_stats_count_show(file, "buffers owned by userspace, at dqbuf",
+			     copy->owned_by_user);
+
+	kfree(copy);
+	return 0;
+}
+
+static int vb2_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vb2_stats_show, inode->i_private);
+}
+
+/* any write clears the histograms. */
+static ssize_t vb2_stats_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct vb2_queue *q = ((struct seq_file *) file->private_data)->private;
+	struct vb2_stats *stats = q->stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	memset(stats->queue_to_driver, 0, sizeof(stats->queue_to_driver));
+	memset(stats->driver_to_done, 0, sizeof(stats->driver_to_done));
+	memset(stats->done_to_dqbuf, 0, sizeof(stats->done_to_dqbuf));
+	memset(stats->owned_by_driver, 0, sizeof(stats->owned_by_driver));
+	memset(stats->owned_by_user, 0, sizeof(stats->owned_by_user));
+	spin_unlock_irqrestore(&stats->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations vb2_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = vb2_stats_open,
+	.read = seq_read,
+	.write = vb2_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int vb2_queue_stats_create(struct vb2_queue *q, const char *name,
+			   struct dentry *parent)
+{
+	struct vb2_stats *stats;
+	int ret;
+
+	if (WARN_ON(q->stats))
+		return -EBUSY;
+
+	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	spin_lock_init(&stats->lock);
+
+	mutex_lock(&vb2_stats_lock);
+	if (!vb2_stats_users) {
+		ret = vb2_stats_probes_register();
+		if (ret) {
+			mutex_unlock(&vb2_stats_lock);
+			kfree(stats);
+			return ret;
+		}
+	}
+	vb2_stats_users++;
+	mutex_unlock(&vb2_stats_lock);
+
+	WRITE_ONCE(q->stats, stats);
+
+	/* debugfs failures are not fatal, the statistics are just hidden. */
+	stats->dentry = debugfs_create_file(name, 0644, parent, q,
+					    &vb2_stats_fops);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(vb2_queue_stats_create);
+
+void vb2_queue_stats_remove(struct vb2_queue *q)
+{
+	struct vb2_stats *stats = q->stats;
+
+	if (!stats)
+		return;
+
+	debugfs_remove(stats->dentry);
+
+	WRITE_ONCE(q->stats, NULL);
+
+	mutex_lock(&vb2_stats_lock);
+	vb2_stats_users--;
+	if (!vb2_stats_users)
+		vb2_stats_probes_unregister();
+	mutex_unlock(&vb2_stats_lock);
+
+	/* wait for the probes that might still be looking at it. */
+	tracepoint_synchronize_unregister();
+
+	kfree(stats);
+}
+EXPORT_SYMBOL_GPL(vb2_queue_stats_remove);
@@ -17,6 +17,7 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/err.h>
+#include <linux/file.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mm.h>
@@ -25,6 +26,8 @@
 #include <linux/sched.h>
 #include <linux/freezer.h>
 #include <linux/kthread.h>
+#include <linux/reservation.h>
+#include <linux/sync_file.h>
 
 #include <media/videobuf2-core.h>
 #include <media/v4l2-mc.h>
@@ -239,6 +242,10 @@ static void __vb2_buf_mem_free(struct vb2_buffer *vb)
 	unsigned int plane;
 
 	for (plane = 0; plane < vb->num_planes; ++plane) {
+		if (vb->planes[plane].dbuf_exported) {
+			dma_buf_put(vb->planes[plane].dbuf_exported);
+			vb->planes[plane].dbuf_exported = NULL;
+		}
 		call_void_memop(vb, put, vb->planes[plane].mem_priv);
 		vb->planes[plane].mem_priv = NULL;
 		dprintk(3, "freed plane %d of buffer %d\n", plane, vb->index);
@@ -352,6 +359,8 @@ static int __vb2_queue_alloc(struct vb2_queue *q, enum vb2_memory memory,
 		vb->index = q->num_buffers + buffer;
 		vb->type = q->type;
 		vb->memory = memory;
+		vb->out_fence_fd = -1;
+		vb->out_fence_context = dma_fence_context_alloc(1);
 		for (plane = 0; plane < num_planes; ++plane) {
 			vb->planes[plane].length = plane_sizes[plane];
 			vb->planes[plane].min_length = plane_sizes[plane];
@@ -913,10 +922,211 @@ void *vb2_plane_cookie(struct vb2_buffer *vb, unsigned int plane_no)
 }
 EXPORT_SYMBOL_GPL(vb2_plane_cookie);
 
+/*
+ * Out-fences.
+ *
+ * A buffer gets an out-fence when it is queued, and it is signalled when
+ * the driver is done with the buffer. Userspace can ask for a sync_file fd
+ * of it, and on capture queues, it also gets attached to the reservation
+ * objects of the dma-bufs behind the buffer, so that importers can schedule
+ * their work on it before the buffer is even dequeued.
+ *
+ * We do not wait for whoever is still reading a capture buffer when it gets
+ * queued again, userspace has to take care of that, as before.
+ */
+struct vb2_fence {
+	struct dma_fence base;
+	/* our own, as the sync_file may well outlive the queue. */
+	spinlock_t lock;
+};
+
+static const char *vb2_fence_get_driver_name(struct dma_fence *fence)
+{
+	return "vb2";
+}
+
+static const char *vb2_fence_get_timeline_name(struct dma_fence *fence)
+{
+	return "vb2-out-fence";
+}
+
+static const struct dma_fence_ops vb2_fence_ops = {
+	.get_driver_name = vb2_fence_get_driver_name,
+	.get_timeline_name = vb2_fence_get_timeline_name,
+};
+
+/*
+ * __vb2_plane_resv() - the reservation object that importers of this plane
+ * look at, if it has been shared as a dma-buf at all.
+ */
+static struct reservation_object *__vb2_plane_resv(struct vb2_buffer *vb,
+						   unsigned int plane)
+{
+	struct vb2_plane *p = &vb->planes[plane];
+
+	if (vb->memory == VB2_MEMORY_DMABUF && p->dbuf)
+		return p->dbuf->resv;
+	if (vb->memory == VB2_MEMORY_MMAP && p->dbuf_exported)
+		return p->dbuf_exported->resv;
+	return NULL;
+}
+
+static bool __vb2_buf_implicit_fence(struct vb2_buffer *vb)
+{
+	unsigned int plane;
+
+	/* only capture buffers get written to. */
+	if (!vb->vb2_queue->supports_out_fences || vb->vb2_queue->is_output)
+		return false;
+
+	for (plane = 0; plane < vb->num_planes; ++plane)
+		if (__vb2_plane_resv(vb, plane))
+			return true;
+	return false;
+}
+
+/*
+ * __vb2_out_fence_create() - create the out-fence of a buffer that is being
+ * queued, when userspace asked for it, or when it can be attached implicitly.
+ *
+ * The fd only gets reserved here. The sync_file is returned in @file, and
+ * the caller installs it with fd_install() once qbuf can no longer fail,
+ * or drops both with __vb2_out_fence_fd_discard().
+ */
+static int __vb2_out_fence_create(struct vb2_buffer *vb, bool requested,
+				  struct file **file)
+{
+	struct vb2_queue *q = vb->vb2_queue;
+	struct reservation_object *resv;
+	struct sync_file *sync_file;
+	struct vb2_fence *fence;
+	unsigned int plane;
+	int fd = -1;
+
+	*file = NULL;
+
+	if (WARN_ON(vb->out_fence))
+		return -EINVAL;
+
+	if (!requested && !__vb2_buf_implicit_fence(vb))
+		return 0;
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (!fence)
+		return -ENOMEM;
+
+	spin_lock_init(&fence->lock);
+	dma_fence_init(&fence->base, &vb2_fence_ops, &fence->lock,
+		       vb->out_fence_context, ++vb->out_fence_seqno);
+
+	if (requested) {
+		fd = get_unused_fd_flags(O_CLOEXEC);
+		if (fd < 0) {
+			dma_fence_put(&fence->base);
+			return fd;
+		}
+
+		sync_file = sync_file_create(&fence->base);
+		if (!sync_file) {
+			put_unused_fd(fd);
+			dma_fence_put(&fence->base);
+			return -ENOMEM;
+		}
+
+		*file = sync_file->file;
+	}
+
+	vb->out_fence = &fence->base;
+	vb->out_fence_fd = fd;
+
+	if (q->is_output)
+		return 0;
+
+	for (plane = 0; plane < vb->num_planes; ++plane) {
+		resv = __vb2_plane_resv(vb, plane);
+		if (!resv)
+			continue;
+
+		reservation_object_lock(resv, NULL);
+		reservation_object_add_excl_fence(resv, vb->out_fence);
+		reservation_object_unlock(resv);
+	}
+
+	dprintk(3, "out-fence %u of buffer %d created, fd %d\n",
+		vb->out_fence_seqno, vb->index, fd);
+
+	return 0;
+}
+
+/*
+ * __vb2_out_fence_fd_discard() - drop an out-fence fd that was reserved but
+ * never installed, the buffer keeps its own reference to the fence.
+ */
+static void __vb2_out_fence_fd_discard(int fd, struct file *file)
+{
+	put_unused_fd(fd);
+	fput(file);
+}
+
+/*
+ * __vb2_out_fence_signal() - signal and drop the out-fence of a buffer,
+ * may be called from interrupt context.
+ */
+static void __vb2_out_fence_signal(struct vb2_buffer *vb, int error)
+{
+	if (!vb->out_fence)
+		return;
+
+	if (error)
+		dma_fence_set_error(vb->out_fence, error);
+	dma_fence_signal(vb->out_fence);
+	dma_fence_put(vb->out_fence);
+	vb->out_fence = NULL;
+}
+
+/*
+ * __vb2_done_wake() - tell waiters about a finished buffer
+ *
+ * Without a wake batch, every buffer wakes up the waiters, as it always did.
+ * Otherwise they are woken once per done_wake_batch buffers, or when the
+ * first buffer of an incomplete batch has waited done_wake_delay_us.
+ */
+static void __vb2_done_wake(struct vb2_queue *q)
+{
+	int pending;
+
+	if (q->done_wake_batch <= 1) {
+		wake_up(&q->done_wq);
+		return;
+	}
+
+	pending = atomic_inc_return(&q->done_wake_pending);
+	if (pending >= q->done_wake_batch) {
+		atomic_set(&q->done_wake_pending, 0);
+		hrtimer_try_to_cancel(&q->done_wake_timer);
+		wake_up(&q->done_wq);
+	} else if (pending == 1) {
+		hrtimer_start(&q->done_wake_timer,
+			      ns_to_ktime((u64)q->done_wake_delay_us *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+}
+
+static enum hrtimer_restart __vb2_done_wake_timer(struct hrtimer *timer)
+{
+	struct vb2_queue *q = container_of(timer, struct vb2_queue,
+					   done_wake_timer);
+
+	atomic_set(&q->done_wake_pending, 0);
+	wake_up(&q->done_wq);
+
+	return HRTIMER_NORESTART;
+}
+
 void vb2_buffer_done(struct vb2_buffer *vb, enum vb2_buffer_state state)
 {
 	struct vb2_queue *q = vb->vb2_queue;
-	unsigned long flags;
 	unsigned int plane;
 
 	if (WARN_ON(vb->state != VB2_BUF_STATE_ACTIVE))
@@ -938,28 +1148,32 @@ void vb2_buffer_done(struct vb2_buffer *vb, enum vb2_buffer_state state)
 			vb->index, state);
 
 	if (state != VB2_BUF_STATE_QUEUED) {
-		/* sync buffers */
-		for (plane = 0; plane < vb->num_planes; ++plane)
-			call_void_memop(vb, finish, vb->planes[plane].mem_priv);
+		/* sync buffers, unless userspace told us the cpu won't look */
+		if (!vb->skip_cache_sync_on_finish)
+			for (plane = 0; plane < vb->num_planes; ++plane)
+				call_void_memop(vb, finish,
+						vb->planes[plane].mem_priv);
 		vb->synced = 0;
-	}
 
-	spin_lock_irqsave(&q->done_lock, flags);
-	if (state == VB2_BUF_STATE_QUEUED) {
-		vb->state = VB2_BUF_STATE_QUEUED;
-	} else {
-		/* Add the buffer to the done buffers list */
-		list_add_tail(&vb->done_entry, &q->done_list);
-		vb->state = state;
+		/* the data is there now, for whoever waits on it. */
+		__vb2_out_fence_signal(vb, state == VB2_BUF_STATE_ERROR ?
+				       -EIO : 0);
 	}
-	atomic_dec(&q->owned_by_drv_count);
 
 	if (state != VB2_BUF_STATE_QUEUED && vb->req_obj.req) {
 		media_request_object_unbind(&vb->req_obj);
 		media_request_object_put(&vb->req_obj);
 	}
 
-	spin_unlock_irqrestore(&q->done_lock, flags);
+	/*
+	 * Finished buffers go on the lock-free list, readers move them over
+	 * to done_list. llist_add() orders the state store before the buffer
+	 * becomes visible there.
+	 */
+	vb->state = state;
+	if (state != VB2_BUF_STATE_QUEUED)
+		llist_add(&vb->done_llnode, &q->done_llist);
+	atomic_dec(&q->owned_by_drv_count);
 
 	trace_vb2_buf_done(q, vb);
 
@@ -968,18 +1182,55 @@ void vb2_buffer_done(struct vb2_buffer *vb, enum vb2_buffer_state state)
 		return;
 	default:
 		/* Inform any processes that may be waiting for buffers */
-		wake_up(&q->done_wq);
+		__vb2_done_wake(q);
 		break;
 	}
 }
 EXPORT_SYMBOL_GPL(vb2_buffer_done);
 
+/*
+ * __vb2_done_collect() - move finished buffers over to the done list
+ *
+ * Must be called with done_lock held. Taking the lock also keeps concurrent
+ * collectors from appending their batches out of order.
+ */
+static void __vb2_done_collect(struct vb2_queue *q)
+{
+	struct llist_node *node;
+	struct vb2_buffer *vb;
+
+	node = llist_del_all(&q->done_llist);
+	if (!node)
+		return;
+
+	/* llist is LIFO, put the oldest buffer first again. */
+	node = llist_reverse_order(node);
+	llist_for_each_entry(vb, node, done_llnode)
+		list_add_tail(&vb->done_entry, &q->done_list);
+}
+
+void vb2_done_list_collect(struct vb2_queue *q)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->done_lock, flags);
+	__vb2_done_collect(q);
+	spin_unlock_irqrestore(&q->done_lock, flags);
+}
+EXPORT_SYMBOL_GPL(vb2_done_list_collect);
+
+static bool __vb2_done_pending(struct vb2_queue *q)
+{
+	return !list_empty(&q->done_list) || !llist_empty(&q->done_llist);
+}
+
 void vb2_discard_done(struct vb2_queue *q)
 {
 	struct vb2_buffer *vb;
 	unsigned long flags;
 
 	spin_lock_irqsave(&q->done_lock, flags);
+	__vb2_done_collect(q);
 	list_for_each_entry(vb, &q->done_list, done_entry)
 		vb->state = VB2_BUF_STATE_ERROR;
 	spin_unlock_irqrestore(&q->done_lock, flags);
@@ -1311,9 +1562,11 @@ static int __buf_prepare(struct vb2_buffer *vb)
 		return ret;
 	}
 
-	/* sync buffers */
-	for (plane = 0; plane < vb->num_planes; ++plane)
-		call_void_memop(vb, prepare, vb->planes[plane].mem_priv);
+	/* sync buffers, unless userspace told us the cpu didn't touch them */
+	if (!vb->skip_cache_sync_on_prepare)
+		for (plane = 0; plane < vb->num_planes; ++plane)
+			call_void_memop(vb, prepare,
+					vb->planes[plane].mem_priv);
 
 	vb->synced = 1;
 	vb->prepared = 1;
@@ -1499,7 +1752,7 @@ static int vb2_start_streaming(struct vb2_queue *q)
 	 * vb2_buffer_done(vb, VB2_BUF_STATE_QUEUED) but STATE_ERROR or
 	 * STATE_DONE.
 	 */
-	WARN_ON(!list_empty(&q->done_list));
+	WARN_ON(__vb2_done_pending(q));
 	return ret;
 }
 
@@ -1507,15 +1760,22 @@ int vb2_core_qbuf(struct vb2_queue *q, unsigned int index, void *pb,
 		  struct media_request *req)
 {
 	struct vb2_buffer *vb;
+	struct file *fence_file;
+	bool out_fence;
+	int fence_fd;
 	int ret;
 
+	vb = q->bufs[index];
+
+	/* only ever for this qbuf. */
+	out_fence = vb->out_fence_requested;
+	vb->out_fence_requested = 0;
+
 	if (q->error) {
 		dprintk(1, "fatal error occurred on queue\n");
 		return -EIO;
 	}
 
-	vb = q->bufs[index];
-
 	if (!req && vb->state != VB2_BUF_STATE_IN_REQUEST &&
 	    q->requires_requests) {
 		dprintk(1, "qbuf requires a request\n");
@@ -1602,6 +1862,15 @@ int vb2_core_qbuf(struct vb2_queue *q, unsigned int index, void *pb,
 		return -EINVAL;
 	}
 
+	ret = __vb2_out_fence_create(vb, out_fence, &fence_file);
+	if (ret) {
+		dprintk(1, "failed to create out-fence for buffer %d\n",
+			vb->index);
+		return ret;
+	}
+	/* fill_user_buffer() takes it from vb. */
+	fence_fd = vb->out_fence_fd;
+
 	/*
 	 * Add to the queued buffers list, a buffer will stay on it until
 	 * dequeued in dqbuf.
@@ -1636,10 +1905,20 @@ int vb2_core_qbuf(struct vb2_queue *q, unsigned int index, void *pb,
 	if (q->streaming && !q->start_streaming_called &&
 	    q->queued_count >= q->min_buffers_needed) {
 		ret = vb2_start_streaming(q);
-		if (ret)
+		if (ret) {
+			/* userspace never gets to see this fd. */
+			if (fence_file) {
+				__vb2_out_fence_fd_discard(fence_fd,
+							   fence_file);
+				vb->out_fence_fd = -1;
+			}
 			return ret;
+		}
 	}
 
+	if (fence_file)
+		fd_install(fence_fd, fence_file);
+
 	dprintk(2, "qbuf of buffer %d succeeded\n", vb->index);
 	return 0;
 }
@@ -1659,7 +1938,8 @@ static int __vb2_wait_for_done_vb(struct vb2_queue *q, int nonblocking)
 	 * it and returned to userspace only while holding both driver's
 	 * lock and the done_lock spinlock. Thus we can be sure that as
 	 * long as we hold the driver's lock, the list will remain not
-	 * empty if list_empty() check succeeds.
+	 * empty if list_empty() check succeeds. Buffers on done_llist
+	 * only ever move over to done_list, so the same holds for it.
 	 */
 
 	for (;;) {
@@ -1685,7 +1965,7 @@ static int __vb2_wait_for_done_vb(struct vb2_queue *q, int nonblocking)
 			return -EPIPE;
 		}
 
-		if (!list_empty(&q->done_list)) {
+		if (__vb2_done_pending(q)) {
 			/*
 			 * Found a buffer that we were waiting for.
 			 */
@@ -1710,7 +1990,7 @@ static int __vb2_wait_for_done_vb(struct vb2_queue *q, int nonblocking)
 		 */
 		dprintk(3, "will sleep waiting for buffers\n");
 		ret = wait_event_interruptible(q->done_wq,
-				!list_empty(&q->done_list) || !q->streaming ||
+				__vb2_done_pending(q) || !q->streaming ||
 				q->error);
 
 		/*
@@ -1750,6 +2030,7 @@ static int __vb2_get_done_vb(struct vb2_queue *q, struct vb2_buffer **vb,
 	 * is not empty, so no need for another list_empty(done_list) check.
 	 */
 	spin_lock_irqsave(&q->done_lock, flags);
+	__vb2_done_collect(q);
 	*vb = list_first_entry(&q->done_list, struct vb2_buffer, done_entry);
 	/*
 	 * Only remove the buffer from done_list if all planes can be
@@ -1901,7 +2182,10 @@ static void __vb2_queue_cancel(struct vb2_queue *q)
 	 * has not already dequeued before initiating cancel.
 	 */
 	INIT_LIST_HEAD(&q->done_list);
+	init_llist_head(&q->done_llist);
 	atomic_set(&q->owned_by_drv_count, 0);
+	hrtimer_cancel(&q->done_wake_timer);
+	atomic_set(&q->done_wake_pending, 0);
 	wake_up_all(&q->done_wq);
 
 	/*
@@ -1935,12 +2219,17 @@ static void __vb2_queue_cancel(struct vb2_queue *q)
 				call_void_vb_qop(vb, buf_request_complete, vb);
 		}
 
+		/* queued buffers that never made it to the driver. */
+		__vb2_out_fence_signal(vb, -ECANCELED);
+		vb->out_fence_fd = -1;
+
 		if (vb->synced) {
 			unsigned int plane;
 
-			for (plane = 0; plane < vb->num_planes; ++plane)
-				call_void_memop(vb, finish,
-						vb->planes[plane].mem_priv);
+			if (!vb->skip_cache_sync_on_finish)
+				for (plane = 0; plane < vb->num_planes; ++plane)
+					call_void_memop(vb, finish,
+							vb->planes[plane].mem_priv);
 			vb->synced = 0;
 		}
 
@@ -2115,12 +2404,29 @@ int vb2_core_expbuf(struct vb2_queue *q, int *fd, unsigned int type,
 
 	vb_plane = &vb->planes[plane];
 
-	dbuf = call_ptr_memop(vb, get_dmabuf, vb_plane->mem_priv,
-				flags & O_ACCMODE);
-	if (IS_ERR_OR_NULL(dbuf)) {
-		dprintk(1, "failed to export buffer %d, plane %d\n",
-			index, plane);
-		return -EINVAL;
+	/*
+	 * Hand out the same dma_buf again, so that all importers share the
+	 * reservation object that our out-fences get attached to. The queue
+	 * then holds a reference to it until the buffer is freed.
+	 */
+	if (q->supports_out_fences && vb_plane->dbuf_exported &&
+	    vb_plane->dbuf_exported_flags == (flags & O_ACCMODE)) {
+		dbuf = vb_plane->dbuf_exported;
+		get_dma_buf(dbuf);
+	} else {
+		dbuf = call_ptr_memop(vb, get_dmabuf, vb_plane->mem_priv,
+				      flags & O_ACCMODE);
+		if (IS_ERR_OR_NULL(dbuf)) {
+			dprintk(1, "failed to export buffer %d, plane %d\n",
+				index, plane);
+			return -EINVAL;
+		}
+
+		if (q->supports_out_fences && !vb_plane->dbuf_exported) {
+			get_dma_buf(dbuf);
+			vb_plane->dbuf_exported = dbuf;
+			vb_plane->dbuf_exported_flags = flags & O_ACCMODE;
+		}
 	}
 
 	ret = dma_buf_fd(dbuf, flags & ~O_ACCMODE);
@@ -2270,11 +2576,19 @@ int vb2_core_queue_init(struct vb2_queue *q)
 	if (WARN_ON(q->requires_requests && !q->supports_requests))
 		return -EINVAL;
 
+	/* a partial batch must not wait forever. */
+	if (WARN_ON(q->done_wake_batch > 1 && !q->done_wake_delay_us))
+		return -EINVAL;
+
 	INIT_LIST_HEAD(&q->queued_list);
 	INIT_LIST_HEAD(&q->done_list);
 	spin_lock_init(&q->done_lock);
+	init_llist_head(&q->done_llist);
 	mutex_init(&q->mmap_lock);
 	init_waitqueue_head(&q->done_wq);
+	atomic_set(&q->done_wake_pending, 0);
+	hrtimer_init(&q->done_wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	q->done_wake_timer.function = __vb2_done_wake_timer;
 
 	q->memory = VB2_MEMORY_UNKNOWN;
 
@@ -2360,7 +2674,7 @@ __poll_t vb2_core_poll(struct vb2_queue *q, struct file *file,
 	if (q->is_output && q->fileio && q->queued_count < q->num_buffers)
 		return EPOLLOUT | EPOLLWRNORM;
 
-	if (list_empty(&q->done_list)) {
+	if (!__vb2_done_pending(q)) {
 		/*
 		 * If the last buffer was dequeued from a capture queue,
 		 * return immediately. DQBUF will return -EPIPE.
@@ -2373,6 +2687,7 @@ __poll_t vb2_core_poll(struct vb2_queue *q, struct file *file,
 	 * Take first buffer available for dequeuing.
 	 */
 	spin_lock_irqsave(&q->done_lock, flags);
+	__vb2_done_collect(q);
 	if (!list_empty(&q->done_list))
 		vb = list_first_entry(&q->done_list, struct vb2_buffer,
 					done_entry);
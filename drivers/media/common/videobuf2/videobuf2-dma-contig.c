@@ -16,6 +16,8 @@
 #include <linux/scatterlist.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
 #include <linux/dma-mapping.h>
 
 #include <media/videobuf2-v4l2.h>
@@ -40,8 +42,36 @@ struct vb2_dc_buf {
 
 	/* DMABUF related */
 	struct dma_buf_attachment	*db_attach;
+
+	/* pool related */
+	struct vb2_dc_pool		*pool;
+	struct list_head		pool_entry;
 };
 
+/*
+ * A per-device pool of released MMAP allocations, handed back out to the
+ * next allocation of the same size and attributes. This saves the trip
+ * through the (CMA) allocator on every stream restart, where a large
+ * contiguous allocation can fail once memory has become fragmented.
+ */
+struct vb2_dc_pool {
+	struct list_head		list;
+	struct device			*dev;
+	struct kref			kref;
+
+	spinlock_t			lock;
+	/* released buffers, oldest first. */
+	struct list_head		bufs;
+	unsigned long			size;
+	unsigned long			limit;
+	unsigned long			hits;
+	unsigned long			misses;
+	bool				dead;
+};
+
+static LIST_HEAD(vb2_dc_pools);
+static DEFINE_SPINLOCK(vb2_dc_pools_lock);
+
 /*********************************************/
 /*        scatterlist table functions        */
 /*********************************************/
@@ -115,6 +145,140 @@ static void vb2_dc_finish(void *buf_priv)
 	dma_sync_sg_for_cpu(buf->dev, sgt->sgl, sgt->orig_nents, buf->dma_dir);
 }
 
+/*********************************************/
+/*             buffer pool functions         */
+/*********************************************/
+
+static struct vb2_dc_pool *vb2_dc_pool_get(struct device *dev)
+{
+	struct vb2_dc_pool *pool, *found = NULL;
+
+	spin_lock(&vb2_dc_pools_lock);
+	list_for_each_entry(pool, &vb2_dc_pools, list)
+		if (pool->dev == dev) {
+			kref_get(&pool->kref);
+			found = pool;
+			break;
+		}
+	spin_unlock(&vb2_dc_pools_lock);
+
+	return found;
+}
+
+static void vb2_dc_pool_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct vb2_dc_pool, kref));
+}
+
+static void vb2_dc_pool_put(struct vb2_dc_pool *pool)
+{
+	kref_put(&pool->kref, vb2_dc_pool_release);
+}
+
+static void vb2_dc_free(struct vb2_dc_buf *buf)
+{
+	dma_free_attrs(buf->dev, buf->size, buf->cookie, buf->dma_addr,
+		       buf->attrs);
+	put_device(buf->dev);
+	kfree(buf);
+}
+
+static void vb2_dc_pool_free_list(struct list_head *bufs)
+{
+	struct vb2_dc_buf *buf, *tmp;
+
+	list_for_each_entry_safe(buf, tmp, bufs, pool_entry) {
+		list_del(&buf->pool_entry);
+		vb2_dc_free(buf);
+	}
+}
+
+/*
+ * Move the oldest buffers over to evict, until the pool is within limit.
+ * Called with the pool lock held.
+ */
+static void vb2_dc_pool_trim(struct vb2_dc_pool *pool, unsigned long limit,
+			     struct list_head *evict)
+{
+	struct vb2_dc_buf *buf;
+
+	while (pool->size > limit) {
+		buf = list_first_entry(&pool->bufs, struct vb2_dc_buf,
+				       pool_entry);
+		list_move_tail(&buf->pool_entry, evict);
+		pool->size -= buf->size;
+	}
+}
+
+/*
+ * Returns false when the pool passes up on this buffer, and it needs to be
+ * freed as usual. Only buffers with a kernel mapping are kept, so that
+ * they can be cleared before they are handed out again.
+ */
+static bool vb2_dc_pool_stash(struct vb2_dc_pool *pool, struct vb2_dc_buf *buf)
+{
+	LIST_HEAD(evict);
+
+	if (!buf->vaddr)
+		return false;
+
+	spin_lock(&pool->lock);
+	if (pool->dead || buf->size > pool->limit) {
+		spin_unlock(&pool->lock);
+		return false;
+	}
+
+	list_add_tail(&buf->pool_entry, &pool->bufs);
+	pool->size += buf->size;
+	vb2_dc_pool_trim(pool, pool->limit, &evict);
+	spin_unlock(&pool->lock);
+
+	vb2_dc_pool_free_list(&evict);
+
+	return true;
+}
+
+static struct vb2_dc_buf *vb2_dc_pool_take(struct vb2_dc_pool *pool,
+					   unsigned long size,
+					   unsigned long attrs)
+{
+	struct vb2_dc_buf *buf, *found = NULL;
+
+	spin_lock(&pool->lock);
+	/* most recently released first, its cachelines might still be warm. */
+	list_for_each_entry_reverse(buf, &pool->bufs, pool_entry)
+		if (buf->size == size && buf->attrs == attrs) {
+			list_del(&buf->pool_entry);
+			pool->size -= size;
+			found = buf;
+			break;
+		}
+
+	if (found)
+		pool->hits++;
+	else
+		pool->misses++;
+	spin_unlock(&pool->lock);
+
+	return found;
+}
+
+/* returns whether anything was freed. */
+static bool vb2_dc_pool_drain(struct vb2_dc_pool *pool)
+{
+	LIST_HEAD(evict);
+
+	spin_lock(&pool->lock);
+	vb2_dc_pool_trim(pool, 0, &evict);
+	spin_unlock(&pool->lock);
+
+	if (list_empty(&evict))
+		return false;
+
+	vb2_dc_pool_free_list(&evict);
+	return true;
+}
+
 /*********************************************/
 /*        callbacks for MMAP buffers         */
 /*********************************************/
@@ -122,6 +286,8 @@ static void vb2_dc_finish(void *buf_priv)
 static void vb2_dc_put(void *buf_priv)
 {
 	struct vb2_dc_buf *buf = buf_priv;
+	struct vb2_dc_pool *pool = buf->pool;
+	bool stashed = false;
 
 	if (!refcount_dec_and_test(&buf->refcount))
 		return;
@@ -129,33 +295,60 @@ static void vb2_dc_put(void *buf_priv)
 	if (buf->sgt_base) {
 		sg_free_table(buf->sgt_base);
 		kfree(buf->sgt_base);
+		buf->sgt_base = NULL;
 	}
-	dma_free_attrs(buf->dev, buf->size, buf->cookie, buf->dma_addr,
-		       buf->attrs);
-	put_device(buf->dev);
-	kfree(buf);
+
+	if (pool) {
+		buf->pool = NULL;
+		stashed = vb2_dc_pool_stash(pool, buf);
+		vb2_dc_pool_put(pool);
+	}
+
+	if (!stashed)
+		vb2_dc_free(buf);
 }
 
 static void *vb2_dc_alloc(struct device *dev, unsigned long attrs,
 			  unsigned long size, enum dma_data_direction dma_dir,
 			  gfp_t gfp_flags)
 {
+	struct vb2_dc_pool *pool;
 	struct vb2_dc_buf *buf;
 
 	if (WARN_ON(!dev))
 		return ERR_PTR(-EINVAL);
 
+	pool = vb2_dc_pool_get(dev);
+	if (pool) {
+		buf = vb2_dc_pool_take(pool, size, attrs);
+		if (buf) {
+			/* do not hand out what the previous user left. */
+			memset(buf->vaddr, 0, size);
+			goto reuse;
+		}
+	}
+
 	buf = kzalloc(sizeof *buf, GFP_KERNEL);
-	if (!buf)
+	if (!buf) {
+		if (pool)
+			vb2_dc_pool_put(pool);
 		return ERR_PTR(-ENOMEM);
+	}
 
 	if (attrs)
 		buf->attrs = attrs;
 	buf->cookie = dma_alloc_attrs(dev, size, &buf->dma_addr,
 					GFP_KERNEL | gfp_flags, buf->attrs);
+	/* what the pool holds might just be what we are short of. */
+	if (!buf->cookie && pool && vb2_dc_pool_drain(pool))
+		buf->cookie = dma_alloc_attrs(dev, size, &buf->dma_addr,
+					      GFP_KERNEL | gfp_flags,
+					      buf->attrs);
 	if (!buf->cookie) {
 		dev_err(dev, "dma_alloc_coherent of size %ld failed\n", size);
 		kfree(buf);
+		if (pool)
+			vb2_dc_pool_put(pool);
 		return ERR_PTR(-ENOMEM);
 	}
 
@@ -165,7 +358,10 @@ static void *vb2_dc_alloc(struct device *dev, unsigned long attrs,
 	/* Prevent the device from being released while the buffer is used */
 	buf->dev = get_device(dev);
 	buf->size = size;
+
+ reuse:
 	buf->dma_dir = dma_dir;
+	buf->pool = pool;
 
 	buf->handler.refcount = &buf->refcount;
 	buf->handler.put = vb2_dc_put;
@@ -752,6 +948,178 @@ void vb2_dma_contig_clear_max_seg_size(struct device *dev)
 }
 EXPORT_SYMBOL_GPL(vb2_dma_contig_clear_max_seg_size);
 
+/*********************************************/
+/*          buffer pool sysfs interface      */
+/*********************************************/
+
+static ssize_t vb2_dc_pool_show(struct device *dev, char *buf,
+				unsigned long (*value)(struct vb2_dc_pool *pool))
+{
+	struct vb2_dc_pool *pool = vb2_dc_pool_get(dev);
+	unsigned long val;
+
+	if (!pool)
+		return -ENODEV;
+
+	spin_lock(&pool->lock);
+	val = value(pool);
+	spin_unlock(&pool->lock);
+
+	vb2_dc_pool_put(pool);
+
+	return sprintf(buf, "%lu\n", val);
+}
+
+#define VB2_DC_POOL_SHOW(_name)						\
+static unsigned long vb2_dc_pool_##_name(struct vb2_dc_pool *pool)	\
+{									\
+	return pool->_name;						\
+}									\
+									\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return vb2_dc_pool_show(dev, buf, vb2_dc_pool_##_name);		\
+}
+
+VB2_DC_POOL_SHOW(limit)
+VB2_DC_POOL_SHOW(size)
+VB2_DC_POOL_SHOW(hits)
+VB2_DC_POOL_SHOW(misses)
+
+static ssize_t limit_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct vb2_dc_pool *pool;
+	unsigned long limit;
+	LIST_HEAD(evict);
+	int ret;
+
+	ret = kstrtoul(buf, 0, &limit);
+	if (ret)
+		return ret;
+
+	pool = vb2_dc_pool_get(dev);
+	if (!pool)
+		return -ENODEV;
+
+	spin_lock(&pool->lock);
+	pool->limit = limit;
+	vb2_dc_pool_trim(pool, limit, &evict);
+	spin_unlock(&pool->lock);
+
+	vb2_dc_pool_free_list(&evict);
+	vb2_dc_pool_put(pool);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(limit);
+static DEVICE_ATTR_RO(size);
+static DEVICE_ATTR_RO(hits);
+static DEVICE_ATTR_RO(misses);
+
+static struct attribute *vb2_dc_pool_attrs[] = {
+	&dev_attr_limit.attr,
+	&dev_attr_size.attr,
+	&dev_attr_hits.attr,
+	&dev_attr_misses.attr,
+	NULL,
+};
+
+static const struct attribute_group vb2_dc_pool_group = {
+	.name = "vb2_dc_pool",
+	.attrs = vb2_dc_pool_attrs,
+};
+
+/**
+ * vb2_dma_contig_pool_init() - keep released buffers around for reuse
+ * @dev:	device the buffers are allocated for
+ * @limit:	the most memory, in bytes, the pool may hold on to
+ *
+ * Released MMAP buffers of @dev are then kept, up to @limit bytes, and
+ * handed back out to the next allocation of the same size, instead of going
+ * back to the allocator. Limit, size and hit and miss counts of the pool are
+ * exposed in the vb2_dc_pool directory of the device in sysfs, where the
+ * limit can be changed as well.
+ *
+ * Should be called before the first buffer is allocated, and balanced with
+ * vb2_dma_contig_pool_cleanup() on driver remove.
+ */
+int vb2_dma_contig_pool_init(struct device *dev, unsigned long limit)
+{
+	struct vb2_dc_pool *pool, *tmp;
+	int ret;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+
+	pool->dev = dev;
+	kref_init(&pool->kref);
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->bufs);
+	pool->limit = limit;
+
+	spin_lock(&vb2_dc_pools_lock);
+	list_for_each_entry(tmp, &vb2_dc_pools, list)
+		if (tmp->dev == dev) {
+			spin_unlock(&vb2_dc_pools_lock);
+			kfree(pool);
+			return -EBUSY;
+		}
+	list_add_tail(&pool->list, &vb2_dc_pools);
+	spin_unlock(&vb2_dc_pools_lock);
+
+	ret = sysfs_create_group(&dev->kobj, &vb2_dc_pool_group);
+	if (ret) {
+		spin_lock(&vb2_dc_pools_lock);
+		list_del(&pool->list);
+		spin_unlock(&vb2_dc_pools_lock);
+		vb2_dc_pool_put(pool);
+		return ret;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(vb2_dma_contig_pool_init);
+
+/**
+ * vb2_dma_contig_pool_cleanup() - release the buffer pool of a device
+ * @dev:	device passed to vb2_dma_contig_pool_init()
+ *
+ * Frees all buffers held by the pool. Buffers which are still in use are
+ * freed as usual when they are released.
+ */
+void vb2_dma_contig_pool_cleanup(struct device *dev)
+{
+	struct vb2_dc_pool *pool, *found = NULL;
+	LIST_HEAD(evict);
+
+	spin_lock(&vb2_dc_pools_lock);
+	list_for_each_entry(pool, &vb2_dc_pools, list)
+		if (pool->dev == dev) {
+			list_del(&pool->list);
+			found = pool;
+			break;
+		}
+	spin_unlock(&vb2_dc_pools_lock);
+
+	if (!found)
+		return;
+
+	sysfs_remove_group(&dev->kobj, &vb2_dc_pool_group);
+
+	spin_lock(&found->lock);
+	found->dead = true;
+	vb2_dc_pool_trim(found, 0, &evict);
+	spin_unlock(&found->lock);
+
+	vb2_dc_pool_free_list(&evict);
+	vb2_dc_pool_put(found);
+}
+EXPORT_SYMBOL_GPL(vb2_dma_contig_pool_cleanup);
+
 MODULE_DESCRIPTION("DMA-contig memory handling routines for videobuf2");
 MODULE_AUTHOR("Pawel Osciak <pawel@osciak.com>");
 MODULE_LICENSE("GPL");
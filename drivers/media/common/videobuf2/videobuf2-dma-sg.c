@@ -96,6 +96,39 @@ static int vb2_dma_sg_alloc_compacted(struct vb2_dma_sg_buf *buf,
 	return 0;
 }
 
+/*
+ * For devices which need each plane in one piece, but without the need to
+ * take it from CMA: a single high order block, with its tail handed back.
+ * Such blocks are hard to find on a fragmented system, so we let the page
+ * allocator try hard, through compaction and reclaim, before giving up.
+ */
+static int vb2_dma_sg_alloc_contiguous(struct vb2_dma_sg_buf *buf,
+		gfp_t gfp_flags)
+{
+	int order = get_order(buf->size);
+	struct page *pages;
+	int i;
+
+	if (buf->size > VB2_DMA_SG_CONTIGUOUS_MAX) {
+		dprintk(1, "%s: %zu bytes cannot be allocated in one piece\n",
+			__func__, buf->size);
+		return -ENOMEM;
+	}
+
+	pages = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN |
+			    __GFP_RETRY_MAYFAIL | gfp_flags, order);
+	if (!pages)
+		return -ENOMEM;
+
+	split_page(pages, order);
+	for (i = 0; i < buf->num_pages; i++)
+		buf->pages[i] = &pages[i];
+	for (; i < (1 << order); i++)
+		__free_page(&pages[i]);
+
+	return 0;
+}
+
 static void *vb2_dma_sg_alloc(struct device *dev, unsigned long dma_attrs,
 			      unsigned long size, enum dma_data_direction dma_dir,
 			      gfp_t gfp_flags)
@@ -125,7 +158,10 @@ static void *vb2_dma_sg_alloc(struct device *dev, unsigned long dma_attrs,
 	if (!buf->pages)
 		goto fail_pages_array_alloc;
 
-	ret = vb2_dma_sg_alloc_compacted(buf, gfp_flags);
+	if (dma_attrs & VB2_DMA_SG_ATTR_CONTIGUOUS)
+		ret = vb2_dma_sg_alloc_contiguous(buf, gfp_flags);
+	else
+		ret = vb2_dma_sg_alloc_compacted(buf, gfp_flags);
 	if (ret)
 		goto fail_pages_alloc;
 
@@ -47,6 +47,7 @@ module_param(debug, int, 0644);
 				 V4L2_BUF_FLAG_PREPARED | \
 				 V4L2_BUF_FLAG_IN_REQUEST | \
 				 V4L2_BUF_FLAG_REQUEST_FD | \
+				 V4L2_BUF_FLAG_OUT_FENCE | \
 				 V4L2_BUF_FLAG_TIMESTAMP_MASK)
 /* Output buffer flags that should be passed on to the driver */
 #define V4L2_BUFFER_OUT_FLAGS	(V4L2_BUF_FLAG_PFRAME | V4L2_BUF_FLAG_BFRAME | \
@@ -331,6 +332,33 @@ static int vb2_fill_vb2_v4l2_buffer(struct vb2_buffer *vb, struct v4l2_buffer *b
 	return 0;
 }
 
+/*
+ * set_buffer_cache_hints() - when userspace promises that the cpu does not
+ * touch the buffer, skip the cache maintenance for this round trip. These
+ * are only looked at when the buffer gets prepared. Queues that did not
+ * opt in drop the hints, so that userspace can tell that they were ignored.
+ */
+static void set_buffer_cache_hints(struct vb2_queue *q, struct vb2_buffer *vb,
+				   struct v4l2_buffer *b)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+
+	if (!q->allow_cache_hints) {
+		vbuf->flags &= ~(V4L2_BUF_FLAG_NO_CACHE_CLEAN |
+				 V4L2_BUF_FLAG_NO_CACHE_INVALIDATE);
+		b->flags &= ~(V4L2_BUF_FLAG_NO_CACHE_CLEAN |
+			      V4L2_BUF_FLAG_NO_CACHE_INVALIDATE);
+		vb->skip_cache_sync_on_prepare = 0;
+		vb->skip_cache_sync_on_finish = 0;
+		return;
+	}
+
+	vb->skip_cache_sync_on_prepare =
+		!!(b->flags & V4L2_BUF_FLAG_NO_CACHE_CLEAN);
+	vb->skip_cache_sync_on_finish =
+		!!(b->flags & V4L2_BUF_FLAG_NO_CACHE_INVALIDATE);
+}
+
 static int vb2_queue_or_prepare_buf(struct vb2_queue *q, struct media_device *mdev,
 				    struct v4l2_buffer *b, bool is_prepare,
 				    struct media_request **p_req)
@@ -374,6 +402,18 @@ static int vb2_queue_or_prepare_buf(struct vb2_queue *q, struct media_device *md
 		return -EINVAL;
 	}
 
+	if ((b->flags & V4L2_BUF_FLAG_OUT_FENCE) && !q->supports_out_fences) {
+		dprintk(1, "%s: queue does not support out-fences\n", opname);
+		return -EINVAL;
+	}
+
+	if ((b->flags & V4L2_BUF_FLAG_OUT_FENCE) &&
+	    (is_prepare || (b->flags & V4L2_BUF_FLAG_REQUEST_FD))) {
+		dprintk(1, "%s: out-fences only work with plain qbuf\n",
+			opname);
+		return -EINVAL;
+	}
+
 	if (!vb->prepared) {
 		/* Copy relevant information provided by the userspace */
 		memset(vbuf->planes, 0,
@@ -381,6 +421,7 @@ static int vb2_queue_or_prepare_buf(struct vb2_queue *q, struct media_device *md
 		ret = vb2_fill_vb2_v4l2_buffer(vb, b);
 		if (ret)
 			return ret;
+		set_buffer_cache_hints(q, vb, b);
 	}
 
 	if (is_prepare)
@@ -395,6 +436,7 @@ static int vb2_queue_or_prepare_buf(struct vb2_queue *q, struct media_device *md
 			dprintk(1, "%s: queue uses requests\n", opname);
 			return -EBUSY;
 		}
+		vb->out_fence_requested = !!(b->flags & V4L2_BUF_FLAG_OUT_FENCE);
 		return 0;
 	} else if (!q->supports_requests) {
 		dprintk(1, "%s: queue does not support requests\n", opname);
@@ -479,7 +521,7 @@ static void __fill_v4l2_buffer(struct vb2_buffer *vb, void *pb)
 	b->timestamp = ns_to_timeval(vb->timestamp);
 	b->timecode = vbuf->timecode;
 	b->sequence = vbuf->sequence;
-	b->reserved2 = 0;
+	b->fence_fd = 0;
 	b->request_fd = 0;
 
 	if (q->is_multiplanar) {
@@ -564,6 +606,13 @@ static void __fill_v4l2_buffer(struct vb2_buffer *vb, void *pb)
 		b->request_fd = vbuf->request_fd;
 	}
 
+	/* the out-fence fd is only handed out once, by qbuf. */
+	if (vb->out_fence_fd >= 0) {
+		b->flags |= V4L2_BUF_FLAG_OUT_FENCE;
+		b->fence_fd = vb->out_fence_fd;
+		vb->out_fence_fd = -1;
+	}
+
 	if (!q->is_output &&
 		b->flags & V4L2_BUF_FLAG_DONE &&
 		b->flags & V4L2_BUF_FLAG_LAST)
@@ -659,6 +708,10 @@ static void fill_buf_caps(struct vb2_queue *q, u32 *caps)
 		*caps |= V4L2_BUF_CAP_SUPPORTS_USERPTR;
 	if (q->io_modes & VB2_DMABUF)
 		*caps |= V4L2_BUF_CAP_SUPPORTS_DMABUF;
+	if (q->supports_out_fences)
+		*caps |= V4L2_BUF_CAP_SUPPORTS_OUT_FENCES;
+	if (q->allow_cache_hints)
+		*caps |= V4L2_BUF_CAP_SUPPORTS_CACHE_HINTS;
 #ifdef CONFIG_MEDIA_CONTROLLER_REQUEST_API
 	if (q->supports_requests)
 		*caps |= V4L2_BUF_CAP_SUPPORTS_REQUESTS;
@@ -796,6 +849,65 @@ int vb2_dqbuf(struct vb2_queue *q, struct v4l2_buffer *b, bool nonblocking)
 }
 EXPORT_SYMBOL_GPL(vb2_dqbuf);
 
+int vb2_dqbuf_batch(struct vb2_queue *q, struct v4l2_dqbuf_batch *batch,
+		    bool nonblocking)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	unsigned int count = min_t(u32, batch->count, VIDEO_MAX_FRAME);
+	unsigned int i, plane;
+	int ret = 0;
+
+	if (vb2_fileio_is_active(q)) {
+		dprintk(1, "file io in progress\n");
+		return -EBUSY;
+	}
+
+	if (batch->type != q->type) {
+		dprintk(1, "invalid buffer type\n");
+		return -EINVAL;
+	}
+
+	if (!count) {
+		dprintk(1, "no room for buffers\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct v4l2_dqbuf_batch_entry *entry = &batch->entries[i];
+		struct v4l2_buffer b = {
+			.type = q->type,
+			.memory = q->memory,
+		};
+
+		if (q->is_multiplanar) {
+			b.m.planes = planes;
+			b.length = VIDEO_MAX_PLANES;
+		}
+
+		/* only the first buffer is waited for. */
+		ret = vb2_core_dqbuf(q, NULL, &b, nonblocking || i);
+		if (ret)
+			break;
+
+		memset(entry, 0, sizeof(*entry));
+		entry->index = b.index;
+		entry->flags = b.flags & ~V4L2_BUF_FLAG_DONE;
+		entry->field = b.field;
+		entry->sequence = b.sequence;
+		entry->timestamp = q->bufs[b.index]->timestamp;
+		if (q->is_multiplanar)
+			for (plane = 0; plane < b.length; plane++)
+				entry->bytesused[plane] = planes[plane].bytesused;
+		else
+			entry->bytesused[0] = b.bytesused;
+	}
+
+	batch->count = i;
+
+	return i ? 0 : ret;
+}
+EXPORT_SYMBOL_GPL(vb2_dqbuf_batch);
+
 int vb2_streamon(struct vb2_queue *q, enum v4l2_buf_type type)
 {
 	if (vb2_fileio_is_active(q)) {
@@ -989,6 +1101,17 @@ int vb2_ioctl_dqbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 }
 EXPORT_SYMBOL_GPL(vb2_ioctl_dqbuf);
 
+int vb2_ioctl_dqbuf_batch(struct file *file, void *priv,
+			  struct v4l2_dqbuf_batch *p)
+{
+	struct video_device *vdev = video_devdata(file);
+
+	if (vb2_queue_is_busy(vdev, file))
+		return -EBUSY;
+	return vb2_dqbuf_batch(vdev->queue, p, file->f_flags & O_NONBLOCK);
+}
+EXPORT_SYMBOL_GPL(vb2_ioctl_dqbuf_batch);
+
 int vb2_ioctl_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
 {
 	struct video_device *vdev = video_devdata(file);
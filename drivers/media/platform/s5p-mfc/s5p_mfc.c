@@ -1017,6 +1017,8 @@ static __poll_t s5p_mfc_poll(struct file *file,
 	mutex_lock(&dev->mfc_mutex);
 	if (v4l2_event_pending(&ctx->fh))
 		rc |= EPOLLPRI;
+	vb2_done_list_collect(src_q);
+	vb2_done_list_collect(dst_q);
 	spin_lock_irqsave(&src_q->done_lock, flags);
 	if (!list_empty(&src_q->done_list))
 		src_vb = list_first_entry(&src_q->done_list, struct vb2_buffer,
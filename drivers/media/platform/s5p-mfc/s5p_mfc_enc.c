@@ -1641,9 +1641,11 @@ static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *buf)
 		ret = vb2_dqbuf(&ctx->vq_src, buf, file->f_flags & O_NONBLOCK);
 	} else if (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
 		ret = vb2_dqbuf(&ctx->vq_dst, buf, file->f_flags & O_NONBLOCK);
-		if (ret == 0 && ctx->state == MFCINST_FINISHED
-					&& list_empty(&ctx->vq_dst.done_list))
-			v4l2_event_queue_fh(&ctx->fh, &ev);
+		if (ret == 0 && ctx->state == MFCINST_FINISHED) {
+			vb2_done_list_collect(&ctx->vq_dst);
+			if (list_empty(&ctx->vq_dst.done_list))
+				v4l2_event_queue_fh(&ctx->fh, &ev);
+		}
 	} else {
 		ret = -EINVAL;
 	}
@@ -21,6 +21,12 @@
  * to a format that our h264 encoder accepts. Therefore, we will currently
  * claim to be planar YUV444, and later on have the adv7611 do colour space
  * conversion (from RGB to YUV) for us.
+ *
+ * When the device tree gives us an endpoint, we bind the subdev at the other
+ * end, which then is the adv7611. It is told to hand us YCbCr 4:2:2 over a
+ * 16bit bus, so that the colour space conversion is done in its hardware,
+ * and it also tells us the timings, sync polarities and porches. Without an
+ * endpoint, we still assume a tfp401.
  */
 #include <linux/module.h>
 #include <linux/of_device.h>
@@ -30,20 +36,122 @@
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/mutex.h>
-
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/kfifo.h>
+#include <linux/hrtimer.h>
+#include <linux/poll.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-fence.h>
+#include <linux/reservation.h>
+#include <linux/sun4i-csi1.h>
+#include <linux/v4l2-dv-timings.h>
+
+#include <media/media-device.h>
 #include <media/v4l2-device.h>
+#include <media/v4l2-subdev.h>
 #include <media/v4l2-ctrls.h>
 #include <media/videobuf2-v4l2.h>
 #include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-event.h>
+#include <media/v4l2-dv-timings.h>
+#include <media/v4l2-rect.h>
+#include <media/v4l2-async.h>
+#include <media/v4l2-fwnode.h>
 
 #define MODULE_NAME	"sun4i-csi1"
 
 struct sun4i_csi1_buffer {
 	struct vb2_v4l2_buffer v4l2_buffer;
-	struct list_head list;
 	dma_addr_t dma_addr[3];
+
+	/*
+	 * Under readers_lock: how many readers still hold this frame, and
+	 * whether it got queued again in the meantime.
+	 */
+	int readers;
+	bool deferred;
+
+	/*
+	 * The read-only dma-bufs that readers get, and the fence they get
+	 * whenever this buffer goes back to the engine, so that importers
+	 * wait for the next frame, instead of reading it as it gets written.
+	 * The fence is only touched when the buffer is pushed into the ring,
+	 * and when it comes back out again.
+	 */
+	struct dma_buf *reader_dbuf[VIDEO_MAX_PLANES];
+	u64 reader_fence_context;
+	unsigned int reader_fence_seqno;
+	struct dma_fence *reader_fence;
+
+	/*
+	 * When queued with a request: the display start the request asked
+	 * for, which the isr programs just before this buffer gets filled.
+	 */
+	bool display_start_set;
+	int hdisplay_start;
+	int vdisplay_start;
+};
+
+/*
+ * A file handle which gets handed every captured frame as well, see
+ * include/uapi/linux/sun4i-csi1.h. Everything in here is protected by
+ * readers_lock, as the isr hands over the frames.
+ */
+struct sun4i_csi1_reader {
+	struct list_head head;
+	wait_queue_head_t wait;
+	unsigned int depth;
+
+	/* frames not dequeued yet, oldest first. */
+	struct sun4i_csi1_reader_frame pending[SUN4I_CSI1_READER_DEPTH_MAX];
+	unsigned int pending_first;
+	unsigned int pending_count;
+
+	/* dequeued, but not released yet. */
+	DECLARE_BITMAP(held, VB2_MAX_FRAME);
+	unsigned int held_count;
+
+	uint32_t dropped;
+};
+
+struct sun4i_csi1_fh {
+	/* has to come first, v4l2_fh_release() kfree()s it. */
+	struct v4l2_fh fh[1];
+
+	bool reading;
+	struct sun4i_csi1_reader reader[1];
+};
+
+/*
+ * Single producer, single consumer ring of queued buffers.
+ *
+ * The producer always runs with the vb2 queue lock held, either from
+ * buf_queue, or when readers hand back a buffer which was queued while they
+ * held it. It only ever touches head. The frame done interrupt is the only
+ * consumer, and only ever touches tail. This means that neither side needs to
+ * take a lock to hand over a buffer, and the isr never has to wait for
+ * userspace.
+ *
+ * vb2 never hands us more than VB2_MAX_FRAME buffers, so the ring can never
+ * overflow.
+ */
+#define SUN4I_CSI1_RING_SIZE	VB2_MAX_FRAME
+
+struct sun4i_csi1_ring {
+	struct sun4i_csi1_ring_entry {
+		struct sun4i_csi1_buffer *buffer;
+		/* resolved at queue time, so the isr just writes these out. */
+		dma_addr_t dma_addr[3];
+	} entries[SUN4I_CSI1_RING_SIZE];
+
+	unsigned int head;
+	unsigned int tail;
 };
 
 struct sun4i_csi1 {
@@ -55,6 +163,7 @@ struct sun4i_csi1 {
 	struct reset_control *reset;
 
 	void __iomem *mmio;
+	int irq;
 
 	bool powered;
 
@@ -62,49 +171,337 @@ struct sun4i_csi1 {
 	struct v4l2_format v4l2_format[1];
 	struct vb2_queue vb2_queue[1];
 	struct mutex vb2_queue_lock[1];
+	/*
+	 * Buffers come from CMA, through vb2-dma-contig, or from the page
+	 * allocator, through vb2-dma-sg, see the sg_buffers parameter.
+	 */
+	bool buffers_sg;
 	struct video_device slashdev[1];
+
+	/*
+	 * Media controller graph: [adv7611] -> csi entity -> video node.
+	 */
+	struct media_device media_dev[1];
+	struct media_pipeline pipeline[1];
+	struct v4l2_subdev entity[1];
+	struct media_pad entity_pads[2];
+	struct media_pad slashdev_pad[1];
 	struct v4l2_ctrl_handler v4l2_ctrl_handler[1];
+	struct v4l2_ctrl *ctrl_hdisplay_start;
+	struct v4l2_ctrl *ctrl_vdisplay_start;
+
+	/* What we have been told the incoming signal looks like. */
+	struct v4l2_dv_timings dv_timings[1];
+
+	/*
+	 * The adv7611, when there is one. When this is NULL, we are being fed
+	 * directly by a tfp401.
+	 */
+	struct v4l2_async_notifier notifier[1];
+	struct v4l2_subdev *subdev;
+	int subdev_pad;
+	/* sync polarities from our endpoint, if any. */
+	unsigned int bus_flags;
+
+	/* What comes in over the bus, and what we can turn that into. */
+	uint32_t input_mode;
+	const struct sun4i_csi1_format *formats;
+	int format_count;
 
 	/* Ease our format suffering by tracking these separately. */
+	const struct sun4i_csi1_format *format;
 	int plane_count;
-	size_t plane_size;
+	size_t plane_size[3];
+	int plane_stride[3];
+	/*
+	 * The planes of the vb2 buffers. For contiguous formats, there is a
+	 * single one, holding all of the above, each at its offset.
+	 */
+	int buffer_plane_count;
+	size_t buffer_plane_size[3];
+	size_t plane_offset[3];
 	int width;
 	int height;
+	/*
+	 * For interlaced input, the engine hands us one field per frame done
+	 * interrupt. Either each field goes into a buffer of its own
+	 * (ALTERNATE), or both register pairs get a field of the same buffer
+	 * (INTERLACED, SEQ_TB).
+	 */
+	enum v4l2_field field;
+
+	/*
+	 * The part of the incoming frame that we capture, and how much of
+	 * that the engine then drops. Both are reset by new timings.
+	 */
+	struct v4l2_rect crop[1];
+	int hdecimate;
+	int vdecimate;
 
 	/*
 	 * We need these values as allwinners CSI does not take in DE, and
 	 * needs to be told the distance between h/vsync and the start of
 	 * pixel data.
-	 * When we have the adv7611 running, we should read this information
-	 * from the ADV7611 registers
+	 * When we have the adv7611 running, this is taken from the porches
+	 * that it measured.
 	 */
 	int hdisplay_start;
 	int vdisplay_start;
 
 	/*
-	 * This too needs to be preset, and will be read from the adv7611
-	 * in future.
+	 * This too needs to be preset for the tfp401, with the adv7611 it
+	 * comes from the endpoint or from the timings it measured.
 	 */
 	bool hsync_polarity;
 	bool vsync_polarity;
 
 	/*
-	 * This is both a lock on the buffer list, and on the registers,
-	 * as playing with buffers invariably means updating at least
-	 * buffer addresses in the registers.
+	 * This is a lock on the registers only, to protect the read-modify-write
+	 * cycles of the setup code against each other and against the isr.
+	 * Buffers are handed to the isr through the lockless ring.
 	 */
 	struct spinlock buffer_lock[1];
-	struct list_head buffer_list[1];
+	struct sun4i_csi1_ring ring[1];
 
+	/*
+	 * Only touched by the isr, or when the engine is stopped.
+	 * A NULL entry means that this register pair points to the dummy.
+	 */
 	struct sun4i_csi1_buffer *buffers[2];
 	uint64_t sequence;
 
+	/* File handles which get every frame as well. */
+	struct spinlock readers_lock[1];
+	struct list_head readers[1];
+	/* puts buffers that readers let go of from the isr back in the ring. */
+	struct work_struct readers_work[1];
+
+	/*
+	 * Requests whose buffer is done, but whose controls still need to be
+	 * completed, which needs the control handler mutex.
+	 */
+	struct spinlock requests_lock[1];
+	DECLARE_KFIFO(requests_done, struct media_request *, VB2_MAX_FRAME);
+	struct work_struct requests_work[1];
+
+	/*
+	 * When we run out of buffers, either keep the engine running and
+	 * dump frames into the dummy buffer until userspace catches up, or
+	 * disable the engine until the next STREAMON.
+	 */
+	bool starvation_keep_running;
+	uint64_t frames_dropped;
+	/* frames before this one went into the dummy on purpose. */
+	uint64_t sequence_start;
+
+	/*
+	 * Frames that we never got a frame done interrupt for, which the
+	 * sequence numbers skip over.
+	 */
+	uint64_t frames_missed;
+
+	/*
+	 * Timestamps are taken at the top of the isr. Either the vsync at the
+	 * start of the frame is used, or the frame done interrupt at its end.
+	 */
+	bool timestamp_soe;
+	uint64_t vsync_last;
+	/* the start of a frame, for when we pair fields into one buffer. */
+	uint64_t timestamp_top;
+	/* register pair A already points at the next buffer. */
+	bool field_top_done;
+	/* the current buffer took a field of another frame. */
+	bool field_broken;
+
+	/*
+	 * Signal measurement. The frame period is kept up to date by the isr,
+	 * the display start is found by capturing a few frames into the dummy
+	 * with zero offsets, and then looking for the first non-blank column
+	 * and row.
+	 */
+	struct measure {
+		uint64_t frame_last;
+		uint64_t frame_period;
+
+		bool display_start_auto;
+		int calibration;
+		bool display_start_valid;
+		int hdisplay_start;
+		int vdisplay_start;
+	} measure[1];
+	struct work_struct calibrate_work[1];
+
+	/* Time spent in the isr, in ns, only written from the isr. */
+	struct isr_stats {
+		uint64_t count;
+		uint64_t last;
+		uint64_t max;
+		uint64_t total;
+	} isr_stats[1];
+
+	struct dentry *debugfs;
+
 	struct dummy_buffer {
 		void *virtual[3];
 		dma_addr_t dma_addr[3];
+		size_t size[3];
 	} dummy_buffer[1];
+
+	/* Only set when there is no real hardware behind us. */
+	struct sun4i_csi1_emulation *emulation;
+};
+
+/*
+ * With 24bit input, the CSI1 can only take in YUV444, but it can still
+ * subsample and write out the chroma in a few different layouts. With the
+ * adv7611, we get YUV422 over 16 bits, and the output mode values of the
+ * CONFIG register then mean something else entirely.
+ */
+#define SUN4I_CSI1_INPUT_YUV444		0x04
+#define SUN4I_CSI1_INPUT_YUV422_16BIT	0x05
+
+struct sun4i_csi1_format {
+	uint32_t pixelformat;
+	uint32_t output_mode;
+	int plane_count;
+	/* chroma subsampling divisors. */
+	int horizontal;
+	int vertical;
+	/* cb and cr are interleaved in the second plane. */
+	bool uv_combined;
+	/*
+	 * All planes live in a single buffer, back to back, and the engine
+	 * gets pointed at each of them at its offset. One allocation, one
+	 * mapping and one dma-buf per frame, instead of one per plane.
+	 */
+	bool contiguous;
+};
+
+static const struct sun4i_csi1_format sun4i_csi1_formats_yuv444[] = {
+	{
+		.pixelformat = V4L2_PIX_FMT_YUV444M,
+		.output_mode = 0x0C, /* field planar yuv444 */
+		.plane_count = 3,
+		.horizontal = 1,
+		.vertical = 1,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV422M,
+		.output_mode = 0x0D, /* field planar yuv422 */
+		.plane_count = 3,
+		.horizontal = 2,
+		.vertical = 1,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV16M,
+		.output_mode = 0x0E, /* field uv combined yuv422 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 1,
+		.uv_combined = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV12M,
+		.output_mode = 0x0F, /* field uv combined yuv420 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 2,
+		.uv_combined = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV422P,
+		.output_mode = 0x0D, /* field planar yuv422 */
+		.plane_count = 3,
+		.horizontal = 2,
+		.vertical = 1,
+		.contiguous = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV16,
+		.output_mode = 0x0E, /* field uv combined yuv422 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 1,
+		.uv_combined = true,
+		.contiguous = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV12,
+		.output_mode = 0x0F, /* field uv combined yuv420 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 2,
+		.uv_combined = true,
+		.contiguous = true,
+	},
 };
 
+static const struct sun4i_csi1_format sun4i_csi1_formats_yuv422[] = {
+	{
+		.pixelformat = V4L2_PIX_FMT_YUV422M,
+		.output_mode = 0x00, /* field planar yuv422 */
+		.plane_count = 3,
+		.horizontal = 2,
+		.vertical = 1,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV420M,
+		.output_mode = 0x01, /* field planar yuv420 */
+		.plane_count = 3,
+		.horizontal = 2,
+		.vertical = 2,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV16M,
+		.output_mode = 0x04, /* field uv combined yuv422 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 1,
+		.uv_combined = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV12M,
+		.output_mode = 0x05, /* field uv combined yuv420 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 2,
+		.uv_combined = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV422P,
+		.output_mode = 0x00, /* field planar yuv422 */
+		.plane_count = 3,
+		.horizontal = 2,
+		.vertical = 1,
+		.contiguous = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_YUV420,
+		.output_mode = 0x01, /* field planar yuv420 */
+		.plane_count = 3,
+		.horizontal = 2,
+		.vertical = 2,
+		.contiguous = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV16,
+		.output_mode = 0x04, /* field uv combined yuv422 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 1,
+		.uv_combined = true,
+		.contiguous = true,
+	}, {
+		.pixelformat = V4L2_PIX_FMT_NV12,
+		.output_mode = 0x05, /* field uv combined yuv420 */
+		.plane_count = 2,
+		.horizontal = 2,
+		.vertical = 2,
+		.uv_combined = true,
+		.contiguous = true,
+	},
+};
+
+static const struct sun4i_csi1_format *
+sun4i_csi1_format_find(struct sun4i_csi1 *csi, uint32_t pixelformat)
+{
+	int i;
+
+	for (i = 0; i < csi->format_count; i++)
+		if (csi->formats[i].pixelformat == pixelformat)
+			return &csi->formats[i];
+
+	return NULL;
+}
+
 #define SUN4I_CSI1_ENABLE		0X000
 #define SUN4I_CSI1_CONFIG		0X004
 #define SUN4I_CSI1_CAPTURE		0X008
@@ -123,6 +520,18 @@ struct sun4i_csi1 {
 #define SUN4I_CSI1_VSIZE		0X044
 #define SUN4I_CSI1_STRIDE		0X048
 
+/*
+ * SCALE: the horizontal mask is a pattern over 16 pixels, the vertical
+ * one over 4 lines, and only samples with their bit set are kept.
+ */
+#define SUN4I_CSI1_SCALE_HORIZONTAL(mask)	((mask) & 0xFFFF)
+#define SUN4I_CSI1_SCALE_VERTICAL(mask)		(((mask) & 0x0F) << 24)
+#define SUN4I_CSI1_DECIMATE_MAX		4
+
+/* INT_ENABLE and INT_STATUS */
+#define SUN4I_CSI1_INT_FRAME_DONE	0x02
+#define SUN4I_CSI1_INT_VSYNC		0x80
+
 static void __maybe_unused sun4i_csi1_write(struct sun4i_csi1 *csi,
 					    int address, uint32_t value)
 {
@@ -306,973 +715,3984 @@ static int sun4i_csi1_poweroff(struct sun4i_csi1 *csi)
 }
 
 /*
- * Called from ISR.
+ * Called with the vb2 queue lock held, which serializes us.
  */
-static void sun4i_csi1_frame_done(struct sun4i_csi1 *csi)
+static int sun4i_csi1_ring_push(struct sun4i_csi1 *csi,
+				struct sun4i_csi1_buffer *buffer)
 {
-	struct sun4i_csi1_buffer *old;
-	uint64_t sequence;
-	dma_addr_t *dma_addr;
-	int index;
-	bool disabled;
+	struct sun4i_csi1_ring *ring = csi->ring;
+	struct sun4i_csi1_ring_entry *entry;
+	unsigned int head = ring->head;
+	int i;
 
-	spin_lock(csi->buffer_lock);
+	/* pairs with the smp_store_release() in sun4i_csi1_ring_pop() */
+	if ((head - smp_load_acquire(&ring->tail)) >= SUN4I_CSI1_RING_SIZE)
+		return -ENOSPC;
 
-	sequence = csi->sequence;
-	csi->sequence++;
+	entry = &ring->entries[head & (SUN4I_CSI1_RING_SIZE - 1)];
 
-	index = sequence & 0x01;
+	entry->buffer = buffer;
+	for (i = 0; i < 3; i++)
+		entry->dma_addr[i] = buffer->dma_addr[i];
 
-	old = csi->buffers[index];
+	/* publish the entry before the isr can see the new head. */
+	smp_store_release(&ring->head, head + 1);
 
-	if (list_empty(csi->buffer_list)) {
-		/* disable module */
-		sun4i_csi1_mask(csi, SUN4I_CSI1_ENABLE, 0, 0x01);
-		disabled = true;
-		dma_addr = csi->dummy_buffer->dma_addr;
-		csi->buffers[index] = NULL;
-	} else {
-		struct sun4i_csi1_buffer *new =
-			list_first_entry(csi->buffer_list,
-					 struct sun4i_csi1_buffer, list);
-		list_del_init(&new->list);
+	return 0;
+}
 
-		dma_addr = new->dma_addr;
-		csi->buffers[index] = new;
+/*
+ * Called from the isr, or when the engine is stopped.
+ */
+static struct sun4i_csi1_buffer *
+sun4i_csi1_ring_pop(struct sun4i_csi1 *csi, dma_addr_t *dma_addr)
+{
+	struct sun4i_csi1_ring *ring = csi->ring;
+	struct sun4i_csi1_ring_entry *entry;
+	struct sun4i_csi1_buffer *buffer;
+	unsigned int tail = ring->tail;
+	int i;
 
-		disabled = false;
-	}
+	/* pairs with the smp_store_release() in sun4i_csi1_ring_push() */
+	if (tail == smp_load_acquire(&ring->head))
+		return NULL;
 
-	if (!index) {
-		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO0_BUFFER_A, dma_addr[0]);
-		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO1_BUFFER_A, dma_addr[1]);
-		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO2_BUFFER_A, dma_addr[2]);
-	} else {
-		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO0_BUFFER_B, dma_addr[0]);
-		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO1_BUFFER_B, dma_addr[1]);
-		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO2_BUFFER_B, dma_addr[2]);
-	}
+	entry = &ring->entries[tail & (SUN4I_CSI1_RING_SIZE - 1)];
 
-	spin_unlock(csi->buffer_lock);
+	buffer = entry->buffer;
+	if (dma_addr)
+		for (i = 0; i < 3; i++)
+			dma_addr[i] = entry->dma_addr[i];
 
-	if (disabled)
-		dev_info(csi->dev, "%s(): engine disabled (%lluframes).\n",
-			 __func__, csi->sequence);
+	/* only hand the slot back once we are done reading it. */
+	smp_store_release(&ring->tail, tail + 1);
 
-	old->v4l2_buffer.vb2_buf.timestamp = ktime_get_ns();
-	old->v4l2_buffer.sequence = sequence;
-	vb2_buffer_done(&old->v4l2_buffer.vb2_buf, VB2_BUF_STATE_DONE);
+	return buffer;
 }
 
-static irqreturn_t sun4i_csi1_isr(int irq, void *dev_id)
+static struct sun4i_csi1_buffer *
+sun4i_csi1_buffer_from_index(struct sun4i_csi1 *csi, unsigned int index)
 {
-	struct sun4i_csi1 *csi = (struct sun4i_csi1 *) dev_id;
-	uint32_t value;
-
-	spin_lock(csi->buffer_lock);
-
-	value = sun4i_csi1_read(csi, SUN4I_CSI1_INT_STATUS);
+	struct vb2_queue *queue = csi->vb2_queue;
 
-	/* ack. */
-	sun4i_csi1_write(csi, SUN4I_CSI1_INT_STATUS, value);
+	if (index >= queue->num_buffers)
+		return NULL;
 
-	spin_unlock(csi->buffer_lock);
+	return container_of(to_vb2_v4l2_buffer(queue->bufs[index]),
+			    struct sun4i_csi1_buffer, v4l2_buffer);
+}
 
-	if (value & 0x02)
-		sun4i_csi1_frame_done(csi);
+struct sun4i_csi1_fence {
+	struct dma_fence base;
+	/* our own, as the dma-bufs may well outlive the buffer. */
+	spinlock_t lock;
+};
 
-	return IRQ_HANDLED;
+static const char *sun4i_csi1_fence_get_driver_name(struct dma_fence *fence)
+{
+	return MODULE_NAME;
 }
 
-static int sun4i_csi1_resources_get(struct sun4i_csi1 *csi,
-				    struct platform_device *platform_dev)
+static const char *
+sun4i_csi1_fence_get_timeline_name(struct dma_fence *fence)
 {
-	struct device *dev = csi->dev;
-	struct resource *resource;
-	int irq, ret;
+	return "reader";
+}
 
-	csi->clk_bus = devm_clk_get(dev, "bus");
-	if (IS_ERR(csi->clk_bus)) {
-		dev_err(dev, "%s(): devm_clk_get(bus) failed: %ld.\n",
-			__func__, PTR_ERR(csi->clk_bus));
-		return PTR_ERR(csi->clk_bus);
-	}
+static const struct dma_fence_ops sun4i_csi1_fence_ops = {
+	.get_driver_name = sun4i_csi1_fence_get_driver_name,
+	.get_timeline_name = sun4i_csi1_fence_get_timeline_name,
+};
 
-	csi->clk_module = devm_clk_get(dev, "mod");
-	if (IS_ERR(csi->clk_module)) {
-		dev_err(dev, "%s(): devm_clk_get(module) failed: %ld.\n",
-			__func__, PTR_ERR(csi->clk_module));
-		return PTR_ERR(csi->clk_module);
-	}
+/*
+ * With the vb2 queue lock held, right before the buffer goes back to the
+ * engine. Readers might still have this frame mapped after they released
+ * it, and we cannot take their dma-bufs away, so we fence them instead.
+ */
+static void sun4i_csi1_reader_fence_attach(struct sun4i_csi1 *csi,
+					   struct sun4i_csi1_buffer *buffer)
+{
+	struct reservation_object *resv;
+	struct sun4i_csi1_fence *fence;
+	int i;
 
-	csi->clk_ram = devm_clk_get(dev, "ram");
-	if (IS_ERR(csi->clk_ram)) {
-		dev_err(dev, "%s(): devm_clk_get(ram) failed: %ld.\n",
-			__func__, PTR_ERR(csi->clk_ram));
-		return PTR_ERR(csi->clk_ram);
-	}
+	for (i = 0; i < VIDEO_MAX_PLANES; i++)
+		if (buffer->reader_dbuf[i])
+			break;
+	if (i == VIDEO_MAX_PLANES)
+		return;
 
-	csi->reset = devm_reset_control_get(dev, NULL);
-	if (IS_ERR(csi->reset)) {
-		dev_err(dev, "%s(): devm_reset_control_get() failed: %ld.\n",
-			__func__, PTR_ERR(csi->reset));
-		return PTR_ERR(csi->reset);
-	}
+	if (WARN_ON(buffer->reader_fence))
+		return;
 
-	resource = platform_get_resource(platform_dev, IORESOURCE_MEM, 0);
-	if (!resource) {
-		dev_err(dev, "%s(): platform_get_resource() failed.\n",
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (!fence) {
+		dev_err(csi->dev, "%s(): failed to allocate fence.\n",
 			__func__);
-		return EINVAL;
+		return;
 	}
 
-	csi->mmio = devm_ioremap_resource(dev, resource);
-	if (IS_ERR(csi->mmio)) {
-		dev_err(dev, "%s(): devm_ioremap_resource() failed: %ld.\n",
-			__func__, PTR_ERR(csi->mmio));
-		return PTR_ERR(csi->mmio);
-	}
+	/* buffers do not come back in order, so each has its own context. */
+	spin_lock_init(&fence->lock);
+	dma_fence_init(&fence->base, &sun4i_csi1_fence_ops, &fence->lock,
+		       buffer->reader_fence_context,
+		       ++buffer->reader_fence_seqno);
 
-	irq = platform_get_irq(platform_dev, 0);
-	if (irq < 0) {
-		dev_err(dev, "%s(): platform_get_irq() failed: %d.\n",
-			__func__, -irq);
-		return -irq;
-	}
+	for (i = 0; i < VIDEO_MAX_PLANES; i++) {
+		if (!buffer->reader_dbuf[i])
+			continue;
 
-	ret = devm_request_irq(dev, irq, sun4i_csi1_isr, 0, MODULE_NAME, csi);
-	if (ret) {
-		dev_err(dev, "%s(): devm_request_irq() failed: %d.\n",
-			__func__, ret);
-		return ret;
+		resv = buffer->reader_dbuf[i]->resv;
+		reservation_object_lock(resv, NULL);
+		reservation_object_add_excl_fence(resv, &fence->base);
+		reservation_object_unlock(resv);
 	}
 
-	return 0;
+	buffer->reader_fence = &fence->base;
 }
 
 /*
- * We might want to power up/down depending on actual usage though.
+ * Called from the isr, or when the engine is stopped.
  */
-static int sun4i_csi1_resume(struct device *dev)
+static void sun4i_csi1_reader_fence_signal(struct sun4i_csi1_buffer *buffer,
+					   enum vb2_buffer_state state)
 {
-	struct sun4i_csi1 *csi = dev_get_drvdata(dev);
+	struct dma_fence *fence = buffer->reader_fence;
 
-	dev_info(dev, "%s();\n", __func__);
-
-	if (!csi->powered)
-		return 0;
+	if (!fence)
+		return;
 
-	return sun4i_csi1_poweron(csi);
+	if (state == VB2_BUF_STATE_ERROR)
+		dma_fence_set_error(fence, -EIO);
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+	buffer->reader_fence = NULL;
 }
 
-static int sun4i_csi1_suspend(struct device *dev)
+/*
+ * With readers_lock held. Returns true when the buffer has been queued
+ * again meanwhile, and now has to go back into the ring.
+ */
+static bool sun4i_csi1_reader_put(struct sun4i_csi1 *csi, unsigned int index)
 {
-	struct sun4i_csi1 *csi = dev_get_drvdata(dev);
+	struct sun4i_csi1_buffer *buffer =
+		sun4i_csi1_buffer_from_index(csi, index);
 
-	dev_info(dev, "%s();\n", __func__);
+	if (WARN_ON(!buffer || !buffer->readers))
+		return false;
 
-	if (!csi->powered)
-		return 0;
+	buffer->readers--;
 
-	return sun4i_csi1_poweroff(csi);
+	return !buffer->readers && buffer->deferred;
 }
 
-static const struct dev_pm_ops sun4i_csi1_pm_ops = {
-	SET_RUNTIME_PM_OPS(sun4i_csi1_suspend, sun4i_csi1_resume, NULL)
-};
+/*
+ * May be called from the isr. The controls of a request can only be
+ * completed with the control handler mutex held, so that is left to
+ * requests_work. vb2 only completes the request once both are done.
+ */
+static void sun4i_csi1_buffer_done(struct sun4i_csi1 *csi,
+				   struct vb2_buffer *vb2_buffer,
+				   enum vb2_buffer_state state)
+{
+	struct media_request *request = vb2_buffer->req_obj.req;
+	struct sun4i_csi1_buffer *buffer =
+		container_of(to_vb2_v4l2_buffer(vb2_buffer),
+			     struct sun4i_csi1_buffer, v4l2_buffer);
+	unsigned long flags;
 
-#define SUN4I_CSI1_HDISPLAY_START (V4L2_CID_USER_BASE + 0xC000 + 1)
-#define SUN4I_CSI1_VDISPLAY_START (V4L2_CID_USER_BASE + 0xC000 + 2)
+	sun4i_csi1_reader_fence_signal(buffer, state);
 
-static int sun4i_csi1_ctrl_set(struct v4l2_ctrl *ctrl)
-{
-	struct sun4i_csi1 *csi = (struct sun4i_csi1 *) ctrl->priv;
+	if (request && (state != VB2_BUF_STATE_QUEUED)) {
+		media_request_get(request);
 
-	dev_info(csi->dev, "%s(%s);\n", __func__, ctrl->name);
+		spin_lock_irqsave(csi->requests_lock, flags);
+		/* there are never more buffers than this in flight. */
+		if (WARN_ON(!kfifo_put(&csi->requests_done, request)))
+			media_request_put(request);
+		spin_unlock_irqrestore(csi->requests_lock, flags);
 
-	switch (ctrl->id) {
-	case SUN4I_CSI1_HDISPLAY_START:
-		csi->hdisplay_start = ctrl->val;
-		if (csi->powered)
-			sun4i_csi1_mask_spin(csi, SUN4I_CSI1_HSIZE,
-					     ctrl->val, 0x1FFF);
-		return 0;
-	case SUN4I_CSI1_VDISPLAY_START:
-		csi->vdisplay_start = ctrl->val;
-		if (csi->powered)
-			sun4i_csi1_mask_spin(csi, SUN4I_CSI1_VSIZE,
-					     ctrl->val, 0x1FFF);
-		return 0;
-	default:
-		return -EINVAL;
+		schedule_work(csi->requests_work);
 	}
+
+	vb2_buffer_done(vb2_buffer, state);
 }
 
-static const struct v4l2_ctrl_ops sun4i_csi1_ctrl_ops = {
-	.s_ctrl = sun4i_csi1_ctrl_set,
-};
+/*
+ * Called from the isr, right before a frame is handed to the queue owner.
+ * A full reader loses its oldest frame that it has not dequeued yet, so
+ * that it never holds on to more than depth buffers.
+ */
+static void sun4i_csi1_readers_deliver(struct sun4i_csi1 *csi,
+				       struct sun4i_csi1_buffer *buffer)
+{
+	struct vb2_v4l2_buffer *v4l2_buffer = &buffer->v4l2_buffer;
+	struct sun4i_csi1_reader_frame *frame;
+	struct sun4i_csi1_reader *reader;
+	bool requeue = false;
 
-static struct v4l2_ctrl_config sun4i_csi1_ctrl_hdisplay_start = {
-	.ops = &sun4i_csi1_ctrl_ops,
-	.id = SUN4I_CSI1_HDISPLAY_START,
-	.name = "HDisplay Start",
-	.type = V4L2_CTRL_TYPE_INTEGER,
-	.flags = V4L2_CTRL_FLAG_SLIDER,
-	.min = 0,
-	.max = 0x1FFF,
-	.step = 1,
-};
+	if (list_empty(csi->readers))
+		return;
 
-static struct v4l2_ctrl_config sun4i_csi1_ctrl_vdisplay_start = {
-	.ops = &sun4i_csi1_ctrl_ops,
-	.id = SUN4I_CSI1_VDISPLAY_START,
-	.name = "VDisplay Start",
-	.type = V4L2_CTRL_TYPE_INTEGER,
-	.flags = V4L2_CTRL_FLAG_SLIDER,
-	.min = 0,
-	.max = 0x1FFF,
-	.step = 1,
+	spin_lock(csi->readers_lock);
+
+	list_for_each_entry(reader, csi->readers, head) {
+		if ((reader->pending_count + reader->held_count) >=
+		    reader->depth) {
+			reader->dropped++;
+
+			/* all of them are in use, so this one is lost. */
+			if (!reader->pending_count)
+				continue;
+
+			frame = &reader->pending[reader->pending_first];
+			requeue |= sun4i_csi1_reader_put(csi, frame->index);
+
+			reader->pending_first = (reader->pending_first + 1) %
+				SUN4I_CSI1_READER_DEPTH_MAX;
+			reader->pending_count--;
+		}
+
+		frame = &reader->pending[(reader->pending_first +
+					  reader->pending_count) %
+					 SUN4I_CSI1_READER_DEPTH_MAX];
+		memset(frame, 0, sizeof(*frame));
+		frame->index = v4l2_buffer->vb2_buf.index;
+		frame->sequence = v4l2_buffer->sequence;
+		frame->field = v4l2_buffer->field;
+		frame->timestamp = v4l2_buffer->vb2_buf.timestamp;
+
+		reader->pending_count++;
+		buffer->readers++;
+
+		wake_up_interruptible(&reader->wait);
+	}
+
+	spin_unlock(csi->readers_lock);
+
+	if (requeue)
+		schedule_work(csi->readers_work);
+}
+
+static void sun4i_csi1_buffer_addresses_set(struct sun4i_csi1 *csi,
+					    int index, dma_addr_t *dma_addr)
+{
+	/* plain writes, these registers are only ever touched from here. */
+	if (!index) {
+		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO0_BUFFER_A, dma_addr[0]);
+		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO1_BUFFER_A, dma_addr[1]);
+		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO2_BUFFER_A, dma_addr[2]);
+	} else {
+		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO0_BUFFER_B, dma_addr[0]);
+		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO1_BUFFER_B, dma_addr[1]);
+		sun4i_csi1_write(csi, SUN4I_CSI1_FIFO2_BUFFER_B, dma_addr[2]);
+	}
+}
+
+static bool sun4i_csi1_field_paired(struct sun4i_csi1 *csi)
+{
+	return (csi->field == V4L2_FIELD_INTERLACED) ||
+		(csi->field == V4L2_FIELD_SEQ_TB);
+}
+
+/*
+ * Both register pairs get a field of the same buffer, A the top one and B
+ * the bottom one: the bottom field starts one line further in, with the
+ * stride doubled, or halfway each plane.
+ */
+static void sun4i_csi1_field_addresses_set(struct sun4i_csi1 *csi,
+					   int index, dma_addr_t *dma_addr)
+{
+	dma_addr_t bottom[3];
+	int i;
+
+	if (!index) {
+		sun4i_csi1_buffer_addresses_set(csi, 0, dma_addr);
+		return;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (i >= csi->plane_count)
+			bottom[i] = bottom[0];
+		else if (csi->field == V4L2_FIELD_INTERLACED)
+			bottom[i] = dma_addr[i] + csi->plane_stride[i];
+		else
+			bottom[i] = dma_addr[i] + csi->plane_size[i] / 2;
+	}
+
+	sun4i_csi1_buffer_addresses_set(csi, 1, bottom);
+}
+
+/*
+ * Where the engine starts taking in data, with the crop offset added to
+ * the display start. The engine counts lines per field.
+ */
+static int sun4i_csi1_hstart(struct sun4i_csi1 *csi, int hdisplay_start)
+{
+	return hdisplay_start + csi->crop->left;
+}
+
+static int sun4i_csi1_vstart(struct sun4i_csi1 *csi, int vdisplay_start)
+{
+	if (csi->field != V4L2_FIELD_NONE)
+		return vdisplay_start + csi->crop->top / 2;
+	else
+		return vdisplay_start + csi->crop->top;
+}
+
+/*
+ * Keep one sample every decimate, out of a pattern of length bits.
+ */
+static uint32_t sun4i_csi1_decimate_mask(int decimate, int length)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < length; i += decimate)
+		mask |= 1 << i;
+
+	return mask;
+}
+
+static bool sun4i_csi1_cropped(struct sun4i_csi1 *csi)
+{
+	return (csi->crop->width != csi->width) ||
+		(csi->crop->height != csi->height) ||
+		(csi->hdecimate != 1) || (csi->vdecimate != 1);
+}
+
+/*
+ * Frames to throw into the dummy before we look at it, the first one might
+ * only be partial.
+ */
+#define SUN4I_CSI1_CALIBRATION_FRAMES	4
+
+enum sun4i_csi1_calibration {
+	SUN4I_CSI1_CALIBRATION_NONE = 0,
+	SUN4I_CSI1_CALIBRATION_RUNNING,
+	SUN4I_CSI1_CALIBRATION_SCANNING,
+	SUN4I_CSI1_CALIBRATION_DONE,
 };
 
-static void sun4i_csi1_ctrl_handler_free(struct sun4i_csi1 *csi)
+/*
+ * The window registers are not double buffered, so the per frame values
+ * of requests go in between frames, for the buffer that the engine fills
+ * next.
+ */
+static void sun4i_csi1_display_start_next(struct sun4i_csi1 *csi,
+					  struct sun4i_csi1_buffer *next)
 {
-	v4l2_ctrl_handler_free(csi->v4l2_ctrl_handler);
+	if (!next || !next->display_start_set)
+		return;
+
+	sun4i_csi1_mask_spin(csi, SUN4I_CSI1_HSIZE,
+			     sun4i_csi1_hstart(csi, next->hdisplay_start),
+			     0x1FFF);
+	sun4i_csi1_mask_spin(csi, SUN4I_CSI1_VSIZE,
+			     sun4i_csi1_vstart(csi, next->vdisplay_start),
+			     0x1FFF);
 }
 
-static int sun4i_csi1_ctrl_handler_initialize(struct sun4i_csi1 *csi,
-					      int hdisplay_start,
-					      int vdisplay_start)
+/*
+ * Called from ISR, for paired fields.
+ *
+ * Each register pair is reprogrammed as soon as the engine has moved on to
+ * the other one: A gets the top field of the next buffer when the top field
+ * is done, B its bottom field when the bottom field is done, which is also
+ * when the current buffer is complete.
+ *
+ * Frame done interrupts that got lost while A already pointed at the next
+ * buffer mean that a bottom field of a later frame went into the current
+ * buffer, which then gets returned as an error. When they got lost while
+ * both pairs still pointed at the current buffer, that one simply takes
+ * the later frame, and the sequence numbers skip the lost ones.
+ */
+static void sun4i_csi1_field_done(struct sun4i_csi1 *csi, uint64_t timestamp,
+				  uint64_t sequence, int missed)
 {
-	struct v4l2_ctrl_handler *handler = csi->v4l2_ctrl_handler;
-	struct v4l2_ctrl *ctrl;
-	int ret;
+	struct sun4i_csi1_buffer *old, *new;
+	dma_addr_t dma_addr[3];
 
-	ret = v4l2_ctrl_handler_init(handler, 2);
-	if (ret) {
-		dev_err(csi->dev, "%s: v4l2_ctrl_handler_init() failed: %d\n",
-			__func__, ret);
-		return ret;
+	if (missed && csi->field_top_done)
+		csi->field_broken = true;
+
+	if (!(sequence & 0x01)) {
+		csi->timestamp_top = timestamp;
+
+		/* A still points at the next buffer, from before the loss. */
+		if (csi->field_top_done)
+			return;
+
+		new = sun4i_csi1_ring_pop(csi, dma_addr);
+		if (!new)
+			memcpy(dma_addr, csi->dummy_buffer->dma_addr,
+			       sizeof(dma_addr));
+
+		csi->buffers[1] = new;
+		sun4i_csi1_field_addresses_set(csi, 0, dma_addr);
+		csi->field_top_done = true;
+		return;
 	}
 
-	sun4i_csi1_ctrl_hdisplay_start.def = hdisplay_start;
-	ctrl = v4l2_ctrl_new_custom(handler, &sun4i_csi1_ctrl_hdisplay_start,
-				    csi);
-	if (!ctrl) {
-		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(hdisplay_start) "
-			"failed: %d\n", __func__, handler->error);
-		ret = handler->error;
-		goto error;
+	/* we lost the top field, the next frame is going in here as well. */
+	if (!csi->field_top_done)
+		return;
+
+	old = csi->buffers[0];
+	new = csi->buffers[1];
+	csi->buffers[0] = new;
+	csi->buffers[1] = NULL;
+	csi->field_top_done = false;
+
+	if (new) {
+		sun4i_csi1_field_addresses_set(csi, 1, new->dma_addr);
+	} else {
+		sun4i_csi1_field_addresses_set(csi, 1,
+					       csi->dummy_buffer->dma_addr);
+
+		if (!csi->starvation_keep_running) {
+			/* disable module */
+			sun4i_csi1_mask_spin(csi, SUN4I_CSI1_ENABLE, 0, 0x01);
+			dev_info(csi->dev, "%s(): engine disabled "
+				 "(%lluframes).\n", __func__, csi->sequence);
+		}
 	}
 
-	sun4i_csi1_ctrl_vdisplay_start.def = vdisplay_start;
-	ctrl = v4l2_ctrl_new_custom(handler, &sun4i_csi1_ctrl_vdisplay_start,
-				    csi);
-	if (!ctrl) {
-		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(vdisplay_start) "
-			"failed: %d\n", __func__, handler->error);
-		ret = handler->error;
-		goto error;
+	sun4i_csi1_display_start_next(csi, new);
+
+	/* this frame went into the dummy, userspace will see the gap. */
+	if (!old) {
+		csi->field_broken = false;
+		if (sequence >= csi->sequence_start)
+			csi->frames_dropped++;
+		return;
 	}
 
-	csi->v4l2_dev->ctrl_handler = handler;
+	if (csi->timestamp_soe)
+		timestamp = csi->timestamp_top;
 
-	csi->hdisplay_start = hdisplay_start;
-	csi->vdisplay_start = vdisplay_start;
+	old->v4l2_buffer.vb2_buf.timestamp = timestamp;
+	old->v4l2_buffer.field = csi->field;
+	old->v4l2_buffer.sequence = sequence >> 1;
 
-	return 0;
+	if (csi->field_broken) {
+		csi->field_broken = false;
+		csi->frames_dropped++;
+		sun4i_csi1_buffer_done(csi, &old->v4l2_buffer.vb2_buf,
+				       VB2_BUF_STATE_ERROR);
+		return;
+	}
 
- error:
-	v4l2_ctrl_handler_free(handler);
-	return ret;
+	sun4i_csi1_readers_deliver(csi, old);
+
+	sun4i_csi1_buffer_done(csi, &old->v4l2_buffer.vb2_buf,
+			       VB2_BUF_STATE_DONE);
 }
 
 /*
- * We currently only care about 24bit YUV444.
+ * Called from ISR.
+ *
+ * When frame done interrupts got lost, the engine has also moved on by
+ * that many register pairs, so skipping the sequence numbers keeps us in
+ * step with the hardware. The register pair we then reprogram is the one
+ * that was just filled, while the other one is already being written to
+ * again, and simply stays in flight.
  */
-static void sun4i_csi1_format_initialize(struct sun4i_csi1 *csi,
-					 int width, int height,
-					 bool hsync_polarity,
-					 bool vsync_polarity)
+static void sun4i_csi1_frame_done(struct sun4i_csi1 *csi, uint64_t timestamp,
+				  int missed)
 {
-	struct v4l2_pix_format_mplane *pixel =
-		&csi->v4l2_format->fmt.pix_mp;
-	int i;
+	struct measure *measure = csi->measure;
+	struct sun4i_csi1_buffer *old, *new;
+	uint64_t sequence;
+	dma_addr_t dma_addr[3];
+	int index;
+
+	sequence = csi->sequence + missed;
+	csi->sequence = sequence + 1;
+	csi->frames_missed += missed;
 
-	csi->plane_count = 3;
-	csi->plane_size = width * height;
+	index = sequence & 0x01;
 
-	csi->width = width;
-	csi->height = height;
+	switch (READ_ONCE(measure->calibration)) {
+	case SUN4I_CSI1_CALIBRATION_RUNNING:
+		/* both register pairs still point at the dummy. */
+		if (sequence >= SUN4I_CSI1_CALIBRATION_FRAMES) {
+			WRITE_ONCE(measure->calibration,
+				   SUN4I_CSI1_CALIBRATION_SCANNING);
+			schedule_work(csi->calibrate_work);
+		}
+		return;
+	case SUN4I_CSI1_CALIBRATION_SCANNING:
+		return;
+	case SUN4I_CSI1_CALIBRATION_DONE:
+		/* this and the frame in flight are still calibration ones. */
+		WRITE_ONCE(measure->calibration, SUN4I_CSI1_CALIBRATION_NONE);
+		csi->sequence_start = sequence + 2;
+		break;
+	default:
+		break;
+	}
 
-	csi->hsync_polarity = hsync_polarity;
-	csi->vsync_polarity = vsync_polarity;
+	if (sun4i_csi1_field_paired(csi)) {
+		sun4i_csi1_field_done(csi, timestamp, sequence, missed);
+		return;
+	}
 
-	memset(pixel, 0, sizeof(struct v4l2_pix_format_mplane));
+	old = csi->buffers[index];
 
-	csi->v4l2_format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	new = sun4i_csi1_ring_pop(csi, dma_addr);
+	if (!new) {
+		if (!csi->starvation_keep_running)
+			/* disable module */
+			sun4i_csi1_mask_spin(csi, SUN4I_CSI1_ENABLE, 0, 0x01);
+		memcpy(dma_addr, csi->dummy_buffer->dma_addr,
+		       sizeof(dma_addr));
+	}
 
-	pixel->width = width;
-	pixel->height = height;
+	csi->buffers[index] = new;
 
-	pixel->pixelformat = V4L2_PIX_FMT_YUV444M;
+	sun4i_csi1_buffer_addresses_set(csi, index, dma_addr);
 
-	pixel->field = V4L2_FIELD_NONE;
+	sun4i_csi1_display_start_next(csi, csi->buffers[index ^ 1]);
 
-	pixel->colorspace = V4L2_COLORSPACE_RAW;
+	if (!new && !csi->starvation_keep_running)
+		dev_info(csi->dev, "%s(): engine disabled (%lluframes).\n",
+			 __func__, csi->sequence);
 
-	pixel->num_planes = csi->plane_count;
-	for (i = 0; i < csi->plane_count; i++) {
-		struct v4l2_plane_pix_format *plane =
-			&pixel->plane_fmt[i];
+	/* this frame went into the dummy, userspace will see the gap. */
+	if (!old) {
+		if (sequence >= csi->sequence_start)
+			csi->frames_dropped++;
+		return;
+	}
 
-		plane->sizeimage = csi->plane_size;
-		plane->bytesperline = width;
+	old->v4l2_buffer.vb2_buf.timestamp = timestamp;
+
+	/* both fields of a frame carry the same sequence number. */
+	if (csi->field == V4L2_FIELD_NONE) {
+		old->v4l2_buffer.field = V4L2_FIELD_NONE;
+		old->v4l2_buffer.sequence = sequence;
+	} else {
+		old->v4l2_buffer.field = (sequence & 0x01) ?
+			V4L2_FIELD_BOTTOM : V4L2_FIELD_TOP;
+		old->v4l2_buffer.sequence = sequence >> 1;
 	}
 
-	pixel->ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
-	pixel->quantization = V4L2_QUANTIZATION_DEFAULT;
-	pixel->xfer_func = V4L2_XFER_FUNC_NONE;
+	sun4i_csi1_readers_deliver(csi, old);
+
+	sun4i_csi1_buffer_done(csi, &old->v4l2_buffer.vb2_buf,
+			       VB2_BUF_STATE_DONE);
+}
+
+static void sun4i_csi1_isr_stats_update(struct sun4i_csi1 *csi,
+					uint64_t time)
+{
+	struct isr_stats *stats = csi->isr_stats;
+
+	stats->count++;
+	stats->last = time;
+	stats->total += time;
+	if (time > stats->max)
+		stats->max = time;
 }
 
 /*
- * This is second guessing v4l2 infrastructure, and to properly tell us when
- * there are any buffers still present.
- *
- * This whole buffer management stuff has me wondering though, why can we not
- * just ask vb2 infrastructure for the next queued buffer, and support us with
- * double or triple buffering? Perhaps it does, and it just not often used?
+ * Keep a running average over about 8 frames, and once that has settled,
+ * use it to find out how many frame done interrupts we did not see.
  */
-static void sun4i_csi1_buffer_list_clear(struct sun4i_csi1 *csi)
+static int sun4i_csi1_frame_period_update(struct sun4i_csi1 *csi,
+					  uint64_t now)
 {
-	while (1) {
-		struct sun4i_csi1_buffer *buffer;
-		unsigned long flags;
+	struct measure *measure = csi->measure;
+	uint64_t period = measure->frame_period;
+	uint64_t delta;
+	int missed = 0;
+
+	if (measure->frame_last) {
+		delta = now - measure->frame_last;
+
+		if (period && (csi->sequence >= 8) &&
+		    (delta > (period + (period >> 1)))) {
+			missed = div64_u64(delta + (period >> 1), period) - 1;
+			delta = div64_u64(delta, missed + 1);
+		}
 
-		spin_lock_irqsave(csi->buffer_lock, flags);
+		if (period)
+			period = (7 * period + delta) >> 3;
+		else
+			period = delta;
 
-		buffer = list_first_entry_or_null(csi->buffer_list,
-						  struct sun4i_csi1_buffer,
-						  list);
-		if (buffer)
-			list_del(&buffer->list);
+		WRITE_ONCE(measure->frame_period, period);
+	}
 
-		spin_unlock_irqrestore(csi->buffer_lock, flags);
+	WRITE_ONCE(measure->frame_last, now);
 
-		if (!buffer)
-			break;
+	return missed;
+}
+
+static irqreturn_t sun4i_csi1_isr(int irq, void *dev_id)
+{
+	struct sun4i_csi1 *csi = (struct sun4i_csi1 *) dev_id;
+	/* this is as close to the hardware event as we get. */
+	uint64_t start = ktime_get_ns();
+	uint64_t timestamp;
+	uint32_t value;
+	int missed;
 
-		vb2_buffer_done(&buffer->v4l2_buffer.vb2_buf,
-				VB2_BUF_STATE_ERROR);
+	/*
+	 * No need for the lock here, INT_STATUS is write one to clear,
+	 * and nothing else does a read-modify-write on it.
+	 */
+	value = sun4i_csi1_read(csi, SUN4I_CSI1_INT_STATUS);
 
-		dev_err(csi->dev, "%s: Cleared buffer 0x%px from the queue.\n",
-			__func__, &buffer->v4l2_buffer.vb2_buf);
+	/* ack. */
+	sun4i_csi1_write(csi, SUN4I_CSI1_INT_STATUS, value);
+
+	/*
+	 * When both are pending, the vsync is the one of the next frame, so
+	 * it has to wait until this frame is done with.
+	 */
+	if (value & SUN4I_CSI1_INT_FRAME_DONE) {
+		/* only when we saw the vsync of this very frame. */
+		if (csi->timestamp_soe &&
+		    (csi->vsync_last > csi->measure->frame_last))
+			timestamp = csi->vsync_last;
+		else
+			timestamp = start;
+
+		missed = sun4i_csi1_frame_period_update(csi, start);
+		sun4i_csi1_frame_done(csi, timestamp, missed);
+		sun4i_csi1_isr_stats_update(csi, ktime_get_ns() - start);
 	}
+
+	if (value & SUN4I_CSI1_INT_VSYNC)
+		csi->vsync_last = start;
+
+	return IRQ_HANDLED;
 }
 
 /*
- * This is a dummy area to stop our engine from overwriting at 0x00000000.
+ * A 1080p plane needs a 2-4MB chunk of CMA with vb2-dma-contig, which adds
+ * up fast for a deep buffer ring on a 1GB board. With this set, buffers are
+ * taken from the page allocator instead, through vb2-dma-sg. The engine
+ * only knows a base address per plane, and there is no iommu, so each plane
+ * is still allocated in one piece, just not from CMA. Imported dma-bufs
+ * likewise need to be contiguous per plane. Such pieces are limited to
+ * VB2_DMA_SG_CONTIGUOUS_MAX, 4MB with the default MAX_ORDER, and formats
+ * with larger planes are refused.
  */
-static int sun4i_csi1_dummy_buffer_free(struct sun4i_csi1 *csi)
+static bool sg_buffers;
+module_param(sg_buffers, bool, 0444);
+MODULE_PARM_DESC(sg_buffers, "Allocate buffers outside of CMA, through "
+		 "vb2-dma-sg.");
+
+/*
+ * A queue owner which takes frames off with VIDIOC_DQBUF_BATCH does not
+ * need to be woken up for every single one. With wake_batch set, it only
+ * gets woken once per that many frames, or once the first frame of a batch
+ * has waited for wake_delay_us.
+ */
+static unsigned int wake_batch;
+module_param(wake_batch, uint, 0444);
+MODULE_PARM_DESC(wake_batch, "Wake up the queue owner once per this many "
+		 "frames, 0 or 1 wakes it up for every frame.");
+
+static unsigned int wake_delay_us = 20000;
+module_param(wake_delay_us, uint, 0444);
+MODULE_PARM_DESC(wake_delay_us, "With wake_batch, the longest that a frame "
+		 "waits for the rest of its batch.");
+
+/*
+ * Without CMA, each plane has to come from the page allocator in one piece,
+ * which limits how large it can be.
+ */
+static bool sun4i_csi1_format_allocatable(struct sun4i_csi1 *csi,
+				const struct v4l2_pix_format_mplane *pixel)
+{
+	int i;
+
+	if (!csi->buffers_sg)
+		return true;
+
+	for (i = 0; i < pixel->num_planes; i++)
+		if (PAGE_ALIGN(pixel->plane_fmt[i].sizeimage) >
+		    VB2_DMA_SG_CONTIGUOUS_MAX)
+			return false;
+
+	return true;
+}
+
+static dma_addr_t sun4i_csi1_plane_dma_addr(struct sun4i_csi1 *csi,
+					    struct vb2_buffer *vb2_buffer,
+					    int plane)
+{
+	struct sg_table *sgt;
+
+	if (!csi->buffers_sg)
+		return vb2_dma_contig_plane_dma_addr(vb2_buffer, plane);
+
+	sgt = vb2_dma_sg_plane_desc(vb2_buffer, plane);
+	return sg_dma_address(sgt->sgl);
+}
+
+/* How much of a plane the engine can write, starting at its base address. */
+static size_t sun4i_csi1_plane_contiguous_size(struct sun4i_csi1 *csi,
+					       struct vb2_buffer *vb2_buffer,
+					       int plane)
+{
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	dma_addr_t expected;
+	size_t size = 0;
+	int i;
+
+	if (!csi->buffers_sg)
+		return vb2_plane_size(vb2_buffer, plane);
+
+	sgt = vb2_dma_sg_plane_desc(vb2_buffer, plane);
+	expected = sg_dma_address(sgt->sgl);
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (sg_dma_address(sg) != expected)
+			break;
+		expected += sg_dma_len(sg);
+		size += sg_dma_len(sg);
+	}
+
+	return size;
+}
+
+#ifdef CONFIG_VIDEO_SUN4I_CSI1_EMULATION
+/*
+ * Emulation of the CSI1 engine, so that the capture path can be exercised,
+ * and the isr profiled, on any machine, without an A20 or a signal source.
+ *
+ * The register block is plain memory, and a kthread plays the engine: once
+ * per frame period, when the module is enabled and capture is running, it
+ * stamps the frame count into the first line of each plane behind the
+ * active FIFO0/1/2 register pair, raises frame done (together with the
+ * vsync of the next frame), and calls our isr with interrupts disabled,
+ * just like the irq core would.
+ *
+ * INT_STATUS is not write one to clear here, so the thread clears it after
+ * the isr returns. BUFFER_CONTROL and BUFFER_STATUS are ignored, the
+ * register pairs simply alternate, starting with A.
+ */
+#define SUN4I_CSI1_EMULATION_NAME	MODULE_NAME "-emulated"
+#define SUN4I_CSI1_EMULATION_SIZE	0x100
+
+static unsigned int emulation_fps = 60;
+module_param(emulation_fps, uint, 0644);
+MODULE_PARM_DESC(emulation_fps, "Frame rate of the emulated engine.");
+
+struct sun4i_csi1_emulation {
+	uint32_t registers[SUN4I_CSI1_EMULATION_SIZE / 4];
+
+	struct task_struct *thread;
+	/* stands in for the irq descriptor lock, for synchronization. */
+	struct spinlock lock[1];
+
+	bool capturing;
+	int index;
+	uint64_t frames;
+};
+
+/*
+ * Find the cpu side of whatever the engine was pointed at. vb2 does not
+ * free buffers while we are streaming, and we are only called then.
+ */
+static void *sun4i_csi1_emulation_virtual(struct sun4i_csi1 *csi,
+					  dma_addr_t dma_addr, size_t *size)
 {
 	struct dummy_buffer *dummy = csi->dummy_buffer;
-	void *virtual_addr[3] = { NULL };
-	dma_addr_t dma_addr[3] = { 0 };
+	struct vb2_queue *queue = csi->vb2_queue;
+	uint8_t *virtual;
+	dma_addr_t start;
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		if (!dummy->virtual[i])
+			continue;
+
+		start = dummy->dma_addr[i];
+		if ((dma_addr >= start) && (dma_addr < (start + dummy->size[i]))) {
+			*size = start + dummy->size[i] - dma_addr;
+			virtual = dummy->virtual[i];
+			return virtual + (dma_addr - start);
+		}
+	}
+
+	for (i = 0; i < queue->num_buffers; i++) {
+		struct vb2_buffer *buffer = queue->bufs[i];
+
+		for (j = 0; j < buffer->num_planes; j++) {
+			size_t length = buffer->planes[j].length;
+
+			start = sun4i_csi1_plane_dma_addr(csi, buffer, j);
+			if ((dma_addr < start) || (dma_addr >= (start + length)))
+				continue;
+
+			virtual = vb2_plane_vaddr(buffer, j);
+			if (!virtual)
+				return NULL;
+
+			*size = start + length - dma_addr;
+			return virtual + (dma_addr - start);
+		}
+	}
+
+	return NULL;
+}
+
+static void sun4i_csi1_emulation_frame(struct sun4i_csi1 *csi)
+{
+	static const int addresses[2][3] = {
+		{
+			SUN4I_CSI1_FIFO0_BUFFER_A,
+			SUN4I_CSI1_FIFO1_BUFFER_A,
+			SUN4I_CSI1_FIFO2_BUFFER_A,
+		}, {
+			SUN4I_CSI1_FIFO0_BUFFER_B,
+			SUN4I_CSI1_FIFO1_BUFFER_B,
+			SUN4I_CSI1_FIFO2_BUFFER_B,
+		},
+	};
+	struct sun4i_csi1_emulation *emulation = csi->emulation;
 	unsigned long flags;
+	uint32_t status;
+	void *virtual;
+	size_t size;
 	int i;
 
-	spin_lock_irqsave(csi->buffer_lock, flags);
+	spin_lock_irqsave(emulation->lock, flags);
+
+	if (!(sun4i_csi1_read(csi, SUN4I_CSI1_ENABLE) & 0x01) ||
+	    !(sun4i_csi1_read(csi, SUN4I_CSI1_CAPTURE) & 0x02)) {
+		emulation->capturing = false;
+		goto out;
+	}
+
+	if (!emulation->capturing) {
+		emulation->capturing = true;
+		emulation->index = 0;
+	}
+
+	for (i = 0; i < csi->plane_count; i++) {
+		dma_addr_t dma_addr =
+			sun4i_csi1_read(csi, addresses[emulation->index][i]);
+
+		virtual = sun4i_csi1_emulation_virtual(csi, dma_addr, &size);
+		if (virtual)
+			memset(virtual, emulation->frames & 0xFF,
+			       min_t(size_t, size, csi->plane_stride[i]));
+	}
+
+	emulation->index ^= 1;
+	emulation->frames++;
+
+	status = sun4i_csi1_read(csi, SUN4I_CSI1_INT_ENABLE) &
+		(SUN4I_CSI1_INT_FRAME_DONE | SUN4I_CSI1_INT_VSYNC);
+	if (status) {
+		sun4i_csi1_write(csi, SUN4I_CSI1_INT_STATUS, status);
+		sun4i_csi1_isr(0, csi);
+		sun4i_csi1_write(csi, SUN4I_CSI1_INT_STATUS, 0);
+	}
+
+ out:
+	spin_unlock_irqrestore(emulation->lock, flags);
+}
+
+static int sun4i_csi1_emulation_thread(void *data)
+{
+	struct sun4i_csi1 *csi = data;
+	ktime_t next = ktime_get();
+
+	while (!kthread_should_stop()) {
+		unsigned int fps = max(READ_ONCE(emulation_fps), 1U);
+
+		next = ktime_add_ns(next, NSEC_PER_SEC / fps);
+
+		/* we fell behind, so did the signal, the isr will notice. */
+		if (ktime_before(next, ktime_get()))
+			next = ktime_get();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+
+		sun4i_csi1_emulation_frame(csi);
+	}
+
+	return 0;
+}
+
+/*
+ * No clocks, no reset, no irq: the NULL ones are no-ops for the clk and
+ * reset apis, and the thread calls our isr directly.
+ */
+static int sun4i_csi1_emulation_resources_get(struct sun4i_csi1 *csi)
+{
+	struct sun4i_csi1_emulation *emulation;
+
+	emulation = devm_kzalloc(csi->dev, sizeof(*emulation), GFP_KERNEL);
+	if (!emulation)
+		return -ENOMEM;
+
+	spin_lock_init(emulation->lock);
+
+	/* plain memory, but readl() and writel() do not mind. */
+	csi->mmio = (void __iomem __force *) emulation->registers;
+	csi->emulation = emulation;
+
+	return 0;
+}
+
+static void sun4i_csi1_emulation_synchronize(struct sun4i_csi1 *csi)
+{
+	spin_lock_irq(csi->emulation->lock);
+	spin_unlock_irq(csi->emulation->lock);
+}
+
+static int sun4i_csi1_emulation_start(struct sun4i_csi1 *csi)
+{
+	struct sun4i_csi1_emulation *emulation = csi->emulation;
+
+	if (!emulation)
+		return 0;
+
+	emulation->thread = kthread_run(sun4i_csi1_emulation_thread, csi,
+					"%s", dev_name(csi->dev));
+	if (IS_ERR(emulation->thread)) {
+		dev_err(csi->dev, "%s(): kthread_run() failed: %ld.\n",
+			__func__, PTR_ERR(emulation->thread));
+		return PTR_ERR(emulation->thread);
+	}
+
+	dev_info(csi->dev, "%s(): emulating the engine at %dfps.\n",
+		 __func__, emulation_fps);
+
+	return 0;
+}
+
+static void sun4i_csi1_emulation_stop(struct sun4i_csi1 *csi)
+{
+	if (csi->emulation)
+		kthread_stop(csi->emulation->thread);
+}
+#else
+static int sun4i_csi1_emulation_resources_get(struct sun4i_csi1 *csi)
+{
+	return -ENODEV;
+}
+
+static void sun4i_csi1_emulation_synchronize(struct sun4i_csi1 *csi)
+{
+}
+
+static int sun4i_csi1_emulation_start(struct sun4i_csi1 *csi)
+{
+	return 0;
+}
+
+static void sun4i_csi1_emulation_stop(struct sun4i_csi1 *csi)
+{
+}
+#endif /* CONFIG_VIDEO_SUN4I_CSI1_EMULATION */
+
+static int sun4i_csi1_resources_get(struct sun4i_csi1 *csi,
+				    struct platform_device *platform_dev)
+{
+	struct device *dev = csi->dev;
+	struct resource *resource;
+	int irq, ret;
+
+	csi->clk_bus = devm_clk_get(dev, "bus");
+	if (IS_ERR(csi->clk_bus)) {
+		dev_err(dev, "%s(): devm_clk_get(bus) failed: %ld.\n",
+			__func__, PTR_ERR(csi->clk_bus));
+		return PTR_ERR(csi->clk_bus);
+	}
+
+	csi->clk_module = devm_clk_get(dev, "mod");
+	if (IS_ERR(csi->clk_module)) {
+		dev_err(dev, "%s(): devm_clk_get(module) failed: %ld.\n",
+			__func__, PTR_ERR(csi->clk_module));
+		return PTR_ERR(csi->clk_module);
+	}
+
+	csi->clk_ram = devm_clk_get(dev, "ram");
+	if (IS_ERR(csi->clk_ram)) {
+		dev_err(dev, "%s(): devm_clk_get(ram) failed: %ld.\n",
+			__func__, PTR_ERR(csi->clk_ram));
+		return PTR_ERR(csi->clk_ram);
+	}
+
+	csi->reset = devm_reset_control_get(dev, NULL);
+	if (IS_ERR(csi->reset)) {
+		dev_err(dev, "%s(): devm_reset_control_get() failed: %ld.\n",
+			__func__, PTR_ERR(csi->reset));
+		return PTR_ERR(csi->reset);
+	}
+
+	resource = platform_get_resource(platform_dev, IORESOURCE_MEM, 0);
+	if (!resource) {
+		dev_err(dev, "%s(): platform_get_resource() failed.\n",
+			__func__);
+		return EINVAL;
+	}
+
+	csi->mmio = devm_ioremap_resource(dev, resource);
+	if (IS_ERR(csi->mmio)) {
+		dev_err(dev, "%s(): devm_ioremap_resource() failed: %ld.\n",
+			__func__, PTR_ERR(csi->mmio));
+		return PTR_ERR(csi->mmio);
+	}
+
+	irq = platform_get_irq(platform_dev, 0);
+	if (irq < 0) {
+		dev_err(dev, "%s(): platform_get_irq() failed: %d.\n",
+			__func__, -irq);
+		return -irq;
+	}
+
+	ret = devm_request_irq(dev, irq, sun4i_csi1_isr, 0, MODULE_NAME, csi);
+	if (ret) {
+		dev_err(dev, "%s(): devm_request_irq() failed: %d.\n",
+			__func__, ret);
+		return ret;
+	}
+	csi->irq = irq;
+
+	return 0;
+}
+
+/*
+ * We might want to power up/down depending on actual usage though.
+ */
+static int sun4i_csi1_resume(struct device *dev)
+{
+	struct sun4i_csi1 *csi = dev_get_drvdata(dev);
+
+	dev_info(dev, "%s();\n", __func__);
+
+	if (!csi->powered)
+		return 0;
+
+	return sun4i_csi1_poweron(csi);
+}
+
+static int sun4i_csi1_suspend(struct device *dev)
+{
+	struct sun4i_csi1 *csi = dev_get_drvdata(dev);
+
+	dev_info(dev, "%s();\n", __func__);
+
+	if (!csi->powered)
+		return 0;
+
+	return sun4i_csi1_poweroff(csi);
+}
+
+static const struct dev_pm_ops sun4i_csi1_pm_ops = {
+	SET_RUNTIME_PM_OPS(sun4i_csi1_suspend, sun4i_csi1_resume, NULL)
+};
+
+#define SUN4I_CSI1_HDISPLAY_START (V4L2_CID_USER_BASE + 0xC000 + 1)
+#define SUN4I_CSI1_VDISPLAY_START (V4L2_CID_USER_BASE + 0xC000 + 2)
+#define SUN4I_CSI1_STARVATION_KEEP_RUNNING (V4L2_CID_USER_BASE + 0xC000 + 3)
+#define SUN4I_CSI1_DISPLAY_START_AUTO (V4L2_CID_USER_BASE + 0xC000 + 4)
+#define SUN4I_CSI1_TIMESTAMP_SOE (V4L2_CID_USER_BASE + 0xC000 + 5)
+
+static int sun4i_csi1_ctrl_set(struct v4l2_ctrl *ctrl)
+{
+	struct sun4i_csi1 *csi = (struct sun4i_csi1 *) ctrl->priv;
+
+	dev_info(csi->dev, "%s(%s);\n", __func__, ctrl->name);
+
+	switch (ctrl->id) {
+	/*
+	 * With requests, the display start is bound to the buffer of the
+	 * request and applied by the isr, see sun4i_csi1_buffer_queue().
+	 */
+	case SUN4I_CSI1_HDISPLAY_START:
+		csi->hdisplay_start = ctrl->val;
+		if (csi->powered && !csi->vb2_queue->uses_requests)
+			sun4i_csi1_mask_spin(csi, SUN4I_CSI1_HSIZE,
+					     sun4i_csi1_hstart(csi, ctrl->val),
+					     0x1FFF);
+		return 0;
+	case SUN4I_CSI1_VDISPLAY_START:
+		csi->vdisplay_start = ctrl->val;
+		if (csi->powered && !csi->vb2_queue->uses_requests)
+			sun4i_csi1_mask_spin(csi, SUN4I_CSI1_VSIZE,
+					     sun4i_csi1_vstart(csi, ctrl->val),
+					     0x1FFF);
+		return 0;
+	case SUN4I_CSI1_STARVATION_KEEP_RUNNING:
+		/* picked up by the isr on the next starved frame. */
+		csi->starvation_keep_running = ctrl->val;
+		return 0;
+	case SUN4I_CSI1_DISPLAY_START_AUTO:
+		/* picked up on the next STREAMON. */
+		csi->measure->display_start_auto = ctrl->val;
+		return 0;
+	case SUN4I_CSI1_TIMESTAMP_SOE:
+		/* the buffers report the timestamp source of the queue. */
+		if (vb2_is_busy(csi->vb2_queue))
+			return -EBUSY;
+
+		csi->timestamp_soe = ctrl->val;
+		csi->vb2_queue->timestamp_flags &=
+			~V4L2_BUF_FLAG_TSTAMP_SRC_MASK;
+		if (ctrl->val)
+			csi->vb2_queue->timestamp_flags |=
+				V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+		else
+			csi->vb2_queue->timestamp_flags |=
+				V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct v4l2_ctrl_ops sun4i_csi1_ctrl_ops = {
+	.s_ctrl = sun4i_csi1_ctrl_set,
+};
+
+static struct v4l2_ctrl_config sun4i_csi1_ctrl_hdisplay_start = {
+	.ops = &sun4i_csi1_ctrl_ops,
+	.id = SUN4I_CSI1_HDISPLAY_START,
+	.name = "HDisplay Start",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_SLIDER,
+	.min = 0,
+	.max = 0x1FFF,
+	.step = 1,
+};
+
+static struct v4l2_ctrl_config sun4i_csi1_ctrl_vdisplay_start = {
+	.ops = &sun4i_csi1_ctrl_ops,
+	.id = SUN4I_CSI1_VDISPLAY_START,
+	.name = "VDisplay Start",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_SLIDER,
+	.min = 0,
+	.max = 0x1FFF,
+	.step = 1,
+};
+
+static struct v4l2_ctrl_config sun4i_csi1_ctrl_starvation_keep_running = {
+	.ops = &sun4i_csi1_ctrl_ops,
+	.id = SUN4I_CSI1_STARVATION_KEEP_RUNNING,
+	.name = "Keep Running When Starved",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 1,
+};
+
+static struct v4l2_ctrl_config sun4i_csi1_ctrl_display_start_auto = {
+	.ops = &sun4i_csi1_ctrl_ops,
+	.id = SUN4I_CSI1_DISPLAY_START_AUTO,
+	.name = "Display Start, Automatic",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static struct v4l2_ctrl_config sun4i_csi1_ctrl_timestamp_soe = {
+	.ops = &sun4i_csi1_ctrl_ops,
+	.id = SUN4I_CSI1_TIMESTAMP_SOE,
+	.name = "Timestamp At Start Of Frame",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 1,
+};
+
+static void sun4i_csi1_ctrl_handler_free(struct sun4i_csi1 *csi)
+{
+	v4l2_ctrl_handler_free(csi->v4l2_ctrl_handler);
+}
+
+static int sun4i_csi1_ctrl_handler_initialize(struct sun4i_csi1 *csi,
+					      int hdisplay_start,
+					      int vdisplay_start)
+{
+	struct v4l2_ctrl_handler *handler = csi->v4l2_ctrl_handler;
+	struct v4l2_ctrl *ctrl;
+	int ret;
+
+	ret = v4l2_ctrl_handler_init(handler, 5);
+	if (ret) {
+		dev_err(csi->dev, "%s: v4l2_ctrl_handler_init() failed: %d\n",
+			__func__, ret);
+		return ret;
+	}
+
+	sun4i_csi1_ctrl_hdisplay_start.def = hdisplay_start;
+	ctrl = v4l2_ctrl_new_custom(handler, &sun4i_csi1_ctrl_hdisplay_start,
+				    csi);
+	csi->ctrl_hdisplay_start = ctrl;
+	if (!ctrl) {
+		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(hdisplay_start) "
+			"failed: %d\n", __func__, handler->error);
+		ret = handler->error;
+		goto error;
+	}
+
+	sun4i_csi1_ctrl_vdisplay_start.def = vdisplay_start;
+	ctrl = v4l2_ctrl_new_custom(handler, &sun4i_csi1_ctrl_vdisplay_start,
+				    csi);
+	csi->ctrl_vdisplay_start = ctrl;
+	if (!ctrl) {
+		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(vdisplay_start) "
+			"failed: %d\n", __func__, handler->error);
+		ret = handler->error;
+		goto error;
+	}
+
+	ctrl = v4l2_ctrl_new_custom(handler,
+				    &sun4i_csi1_ctrl_starvation_keep_running,
+				    csi);
+	if (!ctrl) {
+		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(starvation_keep_"
+			"running) failed: %d\n", __func__, handler->error);
+		ret = handler->error;
+		goto error;
+	}
+
+	ctrl = v4l2_ctrl_new_custom(handler,
+				    &sun4i_csi1_ctrl_display_start_auto, csi);
+	if (!ctrl) {
+		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(display_start_auto)"
+			" failed: %d\n", __func__, handler->error);
+		ret = handler->error;
+		goto error;
+	}
+
+	ctrl = v4l2_ctrl_new_custom(handler, &sun4i_csi1_ctrl_timestamp_soe,
+				    csi);
+	if (!ctrl) {
+		dev_err(csi->dev, "%s: v4l2_ctrl_new_custom(timestamp_soe)"
+			" failed: %d\n", __func__, handler->error);
+		ret = handler->error;
+		goto error;
+	}
+
+	csi->v4l2_dev->ctrl_handler = handler;
+
+	csi->hdisplay_start = hdisplay_start;
+	csi->vdisplay_start = vdisplay_start;
+	csi->starvation_keep_running =
+		sun4i_csi1_ctrl_starvation_keep_running.def;
+	csi->measure->display_start_auto =
+		sun4i_csi1_ctrl_display_start_auto.def;
+	csi->timestamp_soe = sun4i_csi1_ctrl_timestamp_soe.def;
+
+	return 0;
+
+ error:
+	v4l2_ctrl_handler_free(handler);
+	return ret;
+}
+
+/*
+ * Stride and size of each plane as the engine writes it, whether or not the
+ * planes share a buffer.
+ */
+static void sun4i_csi1_format_planes(const struct sun4i_csi1_format *format,
+				     int width, int height,
+				     enum v4l2_field field,
+				     int *strides, size_t *sizes)
+{
+	int i;
+
+	/* every buffer holds a single field. */
+	if (field == V4L2_FIELD_ALTERNATE)
+		height /= 2;
+
+	for (i = 0; i < format->plane_count; i++) {
+		int stride, lines;
+
+		if (!i) {
+			stride = width;
+			lines = height;
+		} else if (format->uv_combined) {
+			stride = 2 * width / format->horizontal;
+			lines = height / format->vertical;
+		} else {
+			stride = width / format->horizontal;
+			lines = height / format->vertical;
+		}
+
+		strides[i] = stride;
+		sizes[i] = stride * lines;
+	}
+}
+
+/*
+ * Fill in a full pixel format for the given resolution. This is used
+ * for TRY_FMT, S_FMT and S_DV_TIMINGS, so this must not touch csi state.
+ */
+static void sun4i_csi1_pixel_format_fill(const struct sun4i_csi1_format *format,
+					 int width, int height,
+					 enum v4l2_field field,
+					 struct v4l2_pix_format_mplane *pixel)
+{
+	size_t sizes[3];
+	int strides[3];
+	int i;
+
+	memset(pixel, 0, sizeof(struct v4l2_pix_format_mplane));
+
+	sun4i_csi1_format_planes(format, width, height, field, strides, sizes);
+
+	/* every buffer holds a single field. */
+	if (field == V4L2_FIELD_ALTERNATE)
+		height /= 2;
+
+	pixel->width = width;
+	pixel->height = height;
+
+	pixel->pixelformat = format->pixelformat;
+
+	pixel->field = field;
+
+	pixel->colorspace = V4L2_COLORSPACE_RAW;
+
+	if (format->contiguous) {
+		pixel->num_planes = 1;
+		pixel->plane_fmt[0].bytesperline = strides[0];
+		for (i = 0; i < format->plane_count; i++)
+			pixel->plane_fmt[0].sizeimage += sizes[i];
+	} else {
+		pixel->num_planes = format->plane_count;
+		for (i = 0; i < format->plane_count; i++) {
+			pixel->plane_fmt[i].bytesperline = strides[i];
+			pixel->plane_fmt[i].sizeimage = sizes[i];
+		}
+	}
+
+	pixel->ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+	pixel->quantization = V4L2_QUANTIZATION_DEFAULT;
+	pixel->xfer_func = V4L2_XFER_FUNC_NONE;
+}
+
+static void sun4i_csi1_format_apply(struct sun4i_csi1 *csi,
+				    const struct sun4i_csi1_format *format)
+{
+	struct v4l2_pix_format_mplane *pixel =
+		&csi->v4l2_format->fmt.pix_mp;
+	int i;
+
+	csi->v4l2_format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	sun4i_csi1_pixel_format_fill(format,
+				     csi->crop->width / csi->hdecimate,
+				     csi->crop->height / csi->vdecimate,
+				     csi->field, pixel);
+
+	csi->format = format;
+	csi->plane_count = format->plane_count;
+	memset(csi->plane_size, 0, sizeof(csi->plane_size));
+	memset(csi->plane_stride, 0, sizeof(csi->plane_stride));
+	sun4i_csi1_format_planes(format, csi->crop->width / csi->hdecimate,
+				 csi->crop->height / csi->vdecimate,
+				 csi->field, csi->plane_stride,
+				 csi->plane_size);
+
+	csi->buffer_plane_count = pixel->num_planes;
+	for (i = 0; i < 3; i++) {
+		if (i < pixel->num_planes)
+			csi->buffer_plane_size[i] =
+				pixel->plane_fmt[i].sizeimage;
+		else
+			csi->buffer_plane_size[i] = 0;
+
+		if (format->contiguous && i)
+			csi->plane_offset[i] = csi->plane_offset[i - 1] +
+				csi->plane_size[i - 1];
+		else
+			csi->plane_offset[i] = 0;
+	}
+}
+
+/*
+ * vesa 640x480@60Hz: 640 656 752 800  480 490 492 525
+ * xtotal - xsync_start = xdisplay_start
+ * h: 800 - 656 = 144
+ * v: 525 - 492 = 33
+ *
+ * hacked 1024x600:
+ * Modeline "1024x600_60.00"   57.00  1024 1221 1319 1361  600 663 683 686 -hsync -vsync
+ * h: 1361 - 1221: 140
+ * v: 686 - 663: 23
+ * Experimental values, for the tfp401: h: 61, v: 3
+ *
+ * 1920x1080:
+ * Modeline "1920x1080_60.00"  148.50  1920 2008 2052 2200  1080 1084 1089 1125 +hsync +vsync
+ * h: 2200 - 2008: 192
+ * v: 1125 - 1084: 41
+ * Experimental values, for the tfp401: h: 148, v: 36
+ *
+ * 1280x720, the standard modeline is:
+ *  ModeLine "1280x720_60.00"	74.25	1280 1390 1430 1650  720 725 730 750 +hSync +vSync
+ * But the tfp401 accepts:
+ *  ModeLine "1280x720_60.00"	74.5    1280 1390 1430 1652  720 725 730 752 +hSync +vSync
+ * h: 1650 - 1390: 260
+ * v: 750 - 725: 25
+ *  Experimental values, for the tfp401: h: 216, v: 22
+ */
+static const struct sun4i_csi1_display_start {
+	int width;
+	int height;
+	int hdisplay_start;
+	int vdisplay_start;
+} sun4i_csi1_display_starts_tfp401[] = {
+	{ 1024, 600, 61, 3 },
+	{ 1280, 720, 216, 22 },
+	{ 1920, 1080, 148, 36 },
+};
+
+/*
+ * Use the values we found by experiment if we have them, otherwise go for
+ * the theoretical distance from the start of sync to the start of data,
+ * which can then be tuned through the controls.
+ *
+ * The adv7611 regenerates the syncs, and the porches it reports are what
+ * it measured, so there we always go for the latter.
+ */
+static void sun4i_csi1_display_start_get(struct sun4i_csi1 *csi,
+					 const struct v4l2_bt_timings *bt,
+					 int *hdisplay_start,
+					 int *vdisplay_start)
+{
+	int i;
+
+	for (i = 0; !csi->subdev &&
+		     (i < ARRAY_SIZE(sun4i_csi1_display_starts_tfp401)); i++) {
+		const struct sun4i_csi1_display_start *start =
+			&sun4i_csi1_display_starts_tfp401[i];
+
+		if ((start->width == bt->width) &&
+		    (start->height == bt->height)) {
+			*hdisplay_start = start->hdisplay_start;
+			*vdisplay_start = start->vdisplay_start;
+			return;
+		}
+	}
+
+	*hdisplay_start = bt->hsync + bt->hbackporch;
+	*vdisplay_start = bt->vsync + bt->vbackporch;
+}
+
+static const struct v4l2_dv_timings_cap sun4i_csi1_timings_cap = {
+	.type = V4L2_DV_BT_656_1120,
+	/* keep this initialization for compatibility with GCC < 4.4.6 */
+	.reserved = { 0 },
+	V4L2_INIT_BT_TIMINGS(640, 1920, 480, 1200, 25000000, 165000000,
+		V4L2_DV_BT_STD_CEA861 | V4L2_DV_BT_STD_DMT |
+			V4L2_DV_BT_STD_GTF | V4L2_DV_BT_STD_CVT,
+		V4L2_DV_BT_CAP_PROGRESSIVE | V4L2_DV_BT_CAP_INTERLACED |
+			V4L2_DV_BT_CAP_REDUCED_BLANKING | V4L2_DV_BT_CAP_CUSTOM)
+};
+
+/*
+ * Progressive input only knows NONE, interlaced input defaults to having
+ * both fields woven into one buffer.
+ */
+static enum v4l2_field
+sun4i_csi1_field_get(const struct v4l2_dv_timings *timings,
+		     enum v4l2_field field)
+{
+	if (!timings->bt.interlaced)
+		return V4L2_FIELD_NONE;
+
+	switch (field) {
+	case V4L2_FIELD_INTERLACED:
+	case V4L2_FIELD_SEQ_TB:
+	case V4L2_FIELD_ALTERNATE:
+		return field;
+	default:
+		return V4L2_FIELD_INTERLACED;
+	}
+}
+
+/*
+ * Our CSI looks at href and vref, which are high during active data, while
+ * hsync and vsync are high during the sync pulse, so a positive sync ends
+ * up being a negative reference.
+ *
+ * The adv7611 drives its syncs as its endpoint tells it to, so when our
+ * endpoint says what that is, that wins over the timings.
+ */
+static void sun4i_csi1_timings_apply(struct sun4i_csi1 *csi,
+				     const struct v4l2_dv_timings *timings)
+{
+	const struct v4l2_bt_timings *bt = &timings->bt;
+	unsigned int flags = csi->bus_flags;
+
+	csi->dv_timings[0] = *timings;
+
+	csi->width = bt->width;
+	csi->height = bt->height;
+	csi->field = sun4i_csi1_field_get(timings, csi->field);
+
+	csi->crop->left = 0;
+	csi->crop->top = 0;
+	csi->crop->width = bt->width;
+	csi->crop->height = bt->height;
+	csi->hdecimate = 1;
+	csi->vdecimate = 1;
+
+	csi->hsync_polarity = !(bt->polarities & V4L2_DV_HSYNC_POS_POL);
+	csi->vsync_polarity = !(bt->polarities & V4L2_DV_VSYNC_POS_POL);
+
+	if (!csi->subdev)
+		return;
+
+	if (flags & (V4L2_MBUS_HSYNC_ACTIVE_HIGH | V4L2_MBUS_HSYNC_ACTIVE_LOW))
+		csi->hsync_polarity = !(flags & V4L2_MBUS_HSYNC_ACTIVE_HIGH);
+	if (flags & (V4L2_MBUS_VSYNC_ACTIVE_HIGH | V4L2_MBUS_VSYNC_ACTIVE_LOW))
+		csi->vsync_polarity = !(flags & V4L2_MBUS_VSYNC_ACTIVE_HIGH);
+}
+
+/*
+ * Switch to the format table of the given input, and keep the current
+ * pixelformat if it can still be had.
+ */
+static void sun4i_csi1_input_mode_set(struct sun4i_csi1 *csi,
+				      uint32_t input_mode)
+{
+	const struct sun4i_csi1_format *format;
+
+	csi->input_mode = input_mode;
+	if (input_mode == SUN4I_CSI1_INPUT_YUV422_16BIT) {
+		csi->formats = sun4i_csi1_formats_yuv422;
+		csi->format_count = ARRAY_SIZE(sun4i_csi1_formats_yuv422);
+	} else {
+		csi->formats = sun4i_csi1_formats_yuv444;
+		csi->format_count = ARRAY_SIZE(sun4i_csi1_formats_yuv444);
+	}
+
+	format = NULL;
+	if (csi->format)
+		format = sun4i_csi1_format_find(csi, csi->format->pixelformat);
+	if (!format)
+		format = &csi->formats[0];
+
+	sun4i_csi1_format_apply(csi, format);
+}
+
+/* The adv7611 hands us 16bit yuv422, without it we emulate yuv444. */
+static uint32_t sun4i_csi1_input_mode_wanted(struct sun4i_csi1 *csi)
+{
+	if (csi->subdev)
+		return SUN4I_CSI1_INPUT_YUV422_16BIT;
+	return SUN4I_CSI1_INPUT_YUV444;
+}
+
+static void sun4i_csi1_format_initialize(struct sun4i_csi1 *csi,
+					 const struct v4l2_dv_timings *timings)
+{
+	sun4i_csi1_timings_apply(csi, timings);
+
+	sun4i_csi1_input_mode_set(csi, SUN4I_CSI1_INPUT_YUV444);
+}
+
+/*
+ * Take on new timings, and reset the display start to what belongs to it.
+ */
+static void sun4i_csi1_timings_update(struct sun4i_csi1 *csi,
+				      const struct v4l2_dv_timings *timings)
+{
+	int hdisplay_start, vdisplay_start;
+
+	sun4i_csi1_timings_apply(csi, timings);
+	sun4i_csi1_format_apply(csi, csi->format);
+
+	sun4i_csi1_display_start_get(csi, &timings->bt, &hdisplay_start,
+				     &vdisplay_start);
+	v4l2_ctrl_s_ctrl(csi->ctrl_hdisplay_start, hdisplay_start);
+	v4l2_ctrl_s_ctrl(csi->ctrl_vdisplay_start, vdisplay_start);
+}
+
+/*
+ * This is second guessing v4l2 infrastructure, and to properly tell us when
+ * there are any buffers still present.
+ *
+ * This takes the consumer side of the ring, so the isr must not be running.
+ */
+static void sun4i_csi1_ring_clear(struct sun4i_csi1 *csi,
+				  enum vb2_buffer_state state)
+{
+	while (1) {
+		struct sun4i_csi1_buffer *buffer;
+
+		buffer = sun4i_csi1_ring_pop(csi, NULL);
+		if (!buffer)
+			break;
+
+		sun4i_csi1_buffer_done(csi, &buffer->v4l2_buffer.vb2_buf,
+				       state);
+
+		dev_err(csi->dev, "%s: Cleared buffer 0x%px from the queue.\n",
+			__func__, &buffer->v4l2_buffer.vb2_buf);
+	}
+}
+
+/*
+ * This is a dummy area to stop our engine from overwriting at 0x00000000.
+ */
+static int sun4i_csi1_dummy_buffer_free(struct sun4i_csi1 *csi)
+{
+	struct dummy_buffer *dummy = csi->dummy_buffer;
+	void *virtual_addr[3] = { NULL };
+	dma_addr_t dma_addr[3] = { 0 };
+	size_t size[3] = { 0 };
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(csi->buffer_lock, flags);
+
+	/* the format might have changed since, so free all we have. */
+	for (i = 0; i < 3; i++)
+		if (dummy->virtual[i]) {
+			virtual_addr[i] = dummy->virtual[i];
+			dma_addr[i] = dummy->dma_addr[i];
+			size[i] = dummy->size[i];
+			dummy->virtual[i] = NULL;
+			dummy->dma_addr[i] = 0;
+			dummy->size[i] = 0;
+		}
+
+	spin_unlock_irqrestore(csi->buffer_lock, flags);
+
+	/* dma_free_coherent() must be called with interrupts enabled. */
+	for (i = 0; i < 3; i++)
+		if (virtual_addr[i])
+			dma_free_coherent(csi->dev, size[i],
+					  virtual_addr[i], dma_addr[i]);
+
+	return 0;
+}
+
+static int sun4i_csi1_dummy_buffer_alloc(struct sun4i_csi1 *csi)
+{
+	struct dummy_buffer *dummy = csi->dummy_buffer;
+	void *virtual_addr[3] = { NULL };
+	dma_addr_t dma_addr[3] = { 0 };
+	unsigned long flags;
+	int i;
+
+	sun4i_csi1_dummy_buffer_free(csi);
+
+	/* dma_alloc_coherent() might sleep, so do not hold the lock. */
+	for (i = 0; i < csi->plane_count; i++) {
+		virtual_addr[i] = dma_alloc_coherent(csi->dev,
+						     csi->plane_size[i],
+						     &dma_addr[i],
+						     GFP_KERNEL);
+		if (!virtual_addr[i])
+			break;
+	}
+
+	if (i != csi->plane_count) {
+		dev_err(csi->dev, "%s: dma_alloc_coherent() failed.\n",
+			__func__);
+		for (i = 0; i < csi->plane_count; i++)
+			if (virtual_addr[i])
+				dma_free_coherent(csi->dev, csi->plane_size[i],
+						  virtual_addr[i], dma_addr[i]);
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(csi->buffer_lock, flags);
+
+	for (i = 0; i < csi->plane_count; i++) {
+		dummy->virtual[i] = virtual_addr[i];
+		dummy->dma_addr[i] = dma_addr[i];
+		dummy->size[i] = csi->plane_size[i];
+	}
+
+	/* keep unused fifos away from 0x00000000 as well. */
+	for (; i < 3; i++)
+		dummy->dma_addr[i] = dma_addr[0];
+
+	spin_unlock_irqrestore(csi->buffer_lock, flags);
+
+	for (i = 0; i < csi->plane_count; i++)
+		dev_info(csi->dev, "%s: allocated dummy buffer[%d] at %pad.\n",
+			 __func__, i, &dummy->dma_addr[i]);
+
+	return 0;
+}
+
+/*
+ * The resolution might have changed without the buffers being reallocated,
+ * so make sure that our dummy still is big enough.
+ */
+static int sun4i_csi1_dummy_buffer_update(struct sun4i_csi1 *csi)
+{
+	struct dummy_buffer *dummy = csi->dummy_buffer;
+	int i;
+
+	for (i = 0; i < csi->plane_count; i++)
+		if (!dummy->virtual[i] || (dummy->size[i] != csi->plane_size[i]))
+			return sun4i_csi1_dummy_buffer_alloc(csi);
+
+	return 0;
+}
+
+/*
+ * How many buffers readers can hold at most, on top of what the queue owner
+ * needs to keep the engine going.
+ */
+static unsigned int sun4i_csi1_readers_depth(struct sun4i_csi1 *csi)
+{
+	struct sun4i_csi1_reader *reader;
+	unsigned int depth = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(csi->readers_lock, flags);
+	list_for_each_entry(reader, csi->readers, head)
+		depth += reader->depth;
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+
+	return depth;
+}
+
+static int sun4i_csi1_queue_setup(struct vb2_queue *queue,
+				  unsigned int *buffer_count,
+				  unsigned int *planes_count,
+				  unsigned int sizes[],
+				  struct device *alloc_devs[])
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
+	unsigned int depth;
+	int ret, i;
+
+	if (buffer_count)
+		dev_info(csi->dev, "%s(%d);\n", __func__, *buffer_count);
+	else
+		dev_info(csi->dev, "%s();\n", __func__);
+
+	/* VIDIOC_CREATE_BUFS */
+	if (*planes_count) {
+		if (*planes_count != csi->buffer_plane_count)
+			return -EINVAL;
+
+		for (i = 0; i < csi->buffer_plane_count; i++)
+			if (sizes[i] < csi->buffer_plane_size[i])
+				return -EINVAL;
+
+		return 0;
+	}
+
+	/* make sure that readers can never starve the queue owner. */
+	depth = queue->min_buffers_needed + sun4i_csi1_readers_depth(csi);
+	if (*buffer_count < depth)
+		*buffer_count = min_t(unsigned int, depth, VB2_MAX_FRAME);
+
+	*planes_count = csi->buffer_plane_count;
+	for (i = 0; i < csi->buffer_plane_count; i++)
+		sizes[i] = csi->buffer_plane_size[i];
+
+	/* the format might have come from the input timings instead. */
+	if (!sun4i_csi1_format_allocatable(csi,
+					   &csi->v4l2_format->fmt.pix_mp)) {
+		dev_err(csi->dev, "%s(): planes too large for sg_buffers.\n",
+			__func__);
+		return -EINVAL;
+	}
+
+	sun4i_csi1_ring_clear(csi, VB2_BUF_STATE_ERROR);
+
+	ret = sun4i_csi1_dummy_buffer_alloc(csi);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+static int sun4i_csi1_buffer_prepare(struct vb2_buffer *vb2_buffer)
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(vb2_buffer->vb2_queue);
+	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	struct sun4i_csi1_buffer *buffer =
+		container_of(v4l2_buffer, struct sun4i_csi1_buffer,
+			     v4l2_buffer);
+	int i;
+
+	for (i = 0; i < csi->buffer_plane_count; i++) {
+		size_t size = csi->buffer_plane_size[i];
+
+		if (vb2_plane_size(vb2_buffer, i) < size) {
+			dev_err(csi->dev, "%s(): plane %d too small (%lu < %zu)"
+				".\n", __func__, i,
+				vb2_plane_size(vb2_buffer, i), size);
+			return -EINVAL;
+		}
+
+		if (sun4i_csi1_plane_contiguous_size(csi, vb2_buffer, i) <
+		    size) {
+			dev_err(csi->dev, "%s(): plane %d is not contiguous.\n",
+				__func__, i);
+			return -EINVAL;
+		}
+
+		vb2_set_plane_payload(vb2_buffer, i, size);
+	}
+
+	/* contiguous formats have all engine planes in buffer plane 0. */
+	for (i = 0; i < csi->plane_count; i++)
+		if (csi->format->contiguous)
+			buffer->dma_addr[i] =
+				sun4i_csi1_plane_dma_addr(csi, vb2_buffer, 0) +
+				csi->plane_offset[i];
+		else
+			buffer->dma_addr[i] =
+				sun4i_csi1_plane_dma_addr(csi, vb2_buffer, i);
+
+	/* unused fifos get pointed at our first plane, as does the dummy. */
+	for (; i < 3; i++)
+		buffer->dma_addr[i] = buffer->dma_addr[0];
+
+	return 0;
+}
+
+static void sun4i_csi1_buffer_push(struct sun4i_csi1 *csi,
+				   struct sun4i_csi1_buffer *buffer)
+{
+	int ret;
+
+	sun4i_csi1_reader_fence_attach(csi, buffer);
+
+	ret = sun4i_csi1_ring_push(csi, buffer);
+	if (ret) {
+		dev_err(csi->dev, "%s(): ring is full.\n", __func__);
+		sun4i_csi1_buffer_done(csi, &buffer->v4l2_buffer.vb2_buf,
+				       VB2_BUF_STATE_ERROR);
+	}
+}
+
+static void sun4i_csi1_buffer_queue(struct vb2_buffer *vb2_buffer)
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(vb2_buffer->vb2_queue);
+	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	struct sun4i_csi1_buffer *buffer =
+		container_of(v4l2_buffer, struct sun4i_csi1_buffer,
+			     v4l2_buffer);
+	struct media_request *request = vb2_buffer->req_obj.req;
+	unsigned long flags;
+	bool deferred;
+
+	/*
+	 * Apply the controls of the request to the handler, and remember
+	 * what this frame needs, so that the isr can set it up in time. The
+	 * controls get completed with the buffer.
+	 */
+	if (request)
+		v4l2_ctrl_request_setup(request, csi->v4l2_ctrl_handler);
+	buffer->display_start_set = !!request;
+	buffer->hdisplay_start = csi->hdisplay_start;
+	buffer->vdisplay_start = csi->vdisplay_start;
+
+	/* readers still hold this one, it goes back when they are done. */
+	spin_lock_irqsave(csi->readers_lock, flags);
+	deferred = buffer->readers > 0;
+	buffer->deferred = deferred;
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+
+	if (!deferred)
+		sun4i_csi1_buffer_push(csi, buffer);
+}
+
+static void sun4i_csi1_requests_work(struct work_struct *work)
+{
+	struct sun4i_csi1 *csi =
+		container_of(work, struct sun4i_csi1, requests_work[0]);
+	struct media_request *request;
+	unsigned long flags;
+	bool found;
+
+	while (1) {
+		spin_lock_irqsave(csi->requests_lock, flags);
+		found = kfifo_get(&csi->requests_done, &request);
+		spin_unlock_irqrestore(csi->requests_lock, flags);
+
+		if (!found)
+			return;
+
+		v4l2_ctrl_request_complete(request, csi->v4l2_ctrl_handler);
+		media_request_put(request);
+	}
+}
+
+/* for buffers of requests that never made it to buf_queue. */
+static void sun4i_csi1_buffer_request_complete(struct vb2_buffer *vb2_buffer)
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(vb2_buffer->vb2_queue);
+
+	v4l2_ctrl_request_complete(vb2_buffer->req_obj.req,
+				   csi->v4l2_ctrl_handler);
+}
+
+/*
+ * With the vb2 queue lock held. Put those buffers that were queued while
+ * readers held them, and which are no longer held, back into the ring.
+ */
+static void sun4i_csi1_readers_requeue(struct sun4i_csi1 *csi)
+{
+	struct vb2_queue *queue = csi->vb2_queue;
+	struct sun4i_csi1_buffer *buffer;
+	unsigned long flags;
+	bool ready;
+	int i;
+
+	for (i = 0; i < queue->num_buffers; i++) {
+		buffer = sun4i_csi1_buffer_from_index(csi, i);
+
+		spin_lock_irqsave(csi->readers_lock, flags);
+		ready = buffer->deferred && !buffer->readers;
+		if (ready)
+			buffer->deferred = false;
+		spin_unlock_irqrestore(csi->readers_lock, flags);
+
+		if (ready)
+			sun4i_csi1_buffer_push(csi, buffer);
+	}
+}
+
+static void sun4i_csi1_readers_work(struct work_struct *work)
+{
+	struct sun4i_csi1 *csi =
+		container_of(work, struct sun4i_csi1, readers_work[0]);
+
+	mutex_lock(csi->vb2_queue_lock);
+
+	if (vb2_is_streaming(csi->vb2_queue))
+		sun4i_csi1_readers_requeue(csi);
+
+	mutex_unlock(csi->vb2_queue_lock);
+}
+
+/*
+ * When streaming stops, readers lose all their frames. Deferred buffers
+ * are still active, and get returned to vb2 with all the others.
+ */
+static void sun4i_csi1_readers_flush(struct sun4i_csi1 *csi)
+{
+	struct vb2_queue *queue = csi->vb2_queue;
+	struct sun4i_csi1_reader *reader;
+	struct sun4i_csi1_buffer *buffer;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(csi->readers_lock, flags);
+
+	list_for_each_entry(reader, csi->readers, head) {
+		reader->pending_first = 0;
+		reader->pending_count = 0;
+		bitmap_zero(reader->held, VB2_MAX_FRAME);
+		reader->held_count = 0;
+	}
+
+	for (i = 0; i < queue->num_buffers; i++) {
+		buffer = sun4i_csi1_buffer_from_index(csi, i);
+		buffer->readers = 0;
+		buffer->deferred = false;
+	}
+
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+}
+
+/*
+ * Anything below this is considered to be blanking. This is well above
+ * the 16 of limited range black, and the noise we see from the tfp401.
+ */
+#define SUN4I_CSI1_CALIBRATION_BLANK	0x20
+
+/*
+ * Scan the dummy, which the engine is happily still filling with frames
+ * captured from right after the syncs, for the first row and column which
+ * are not blank. That is where the picture starts.
+ *
+ * We only look at the first plane, which is luma, or, as long as we are
+ * fed RGB, a single colour component, which is good enough to find the
+ * edges of a desktop.
+ */
+static void sun4i_csi1_calibrate_work(struct work_struct *work)
+{
+	struct sun4i_csi1 *csi =
+		container_of(work, struct sun4i_csi1, calibrate_work[0]);
+	struct measure *measure = csi->measure;
+	const uint8_t *data = csi->dummy_buffer->virtual[0];
+	int stride = csi->plane_stride[0];
+	int hdisplay_start = csi->width;
+	int vdisplay_start = -1;
+	int x, y;
+
+	for (y = 0; y < csi->height; y++) {
+		const uint8_t *line = data + y * stride;
+		/* we need the full first line, to find the top. */
+		int end = (vdisplay_start < 0) ? csi->width : hdisplay_start;
+
+		for (x = 0; x < end; x++)
+			if (line[x] > SUN4I_CSI1_CALIBRATION_BLANK)
+				break;
+
+		if (x == end)
+			continue;
+
+		if (vdisplay_start < 0)
+			vdisplay_start = y;
+		if (x < hdisplay_start)
+			hdisplay_start = x;
+	}
+
+	if (vdisplay_start < 0) {
+		dev_info(csi->dev, "%s(): no picture found, keeping display "
+			 "start at %d/%d.\n", __func__, csi->hdisplay_start,
+			 csi->vdisplay_start);
+	} else {
+		dev_info(csi->dev, "%s(): display starts at %d/%d.\n",
+			 __func__, hdisplay_start, vdisplay_start);
+
+		measure->hdisplay_start = hdisplay_start;
+		measure->vdisplay_start = vdisplay_start;
+		measure->display_start_valid = true;
+
+		v4l2_ctrl_s_ctrl(csi->ctrl_hdisplay_start, hdisplay_start);
+		v4l2_ctrl_s_ctrl(csi->ctrl_vdisplay_start, vdisplay_start);
+	}
+
+	/* the controls only hit the hardware when their value changed. */
+	sun4i_csi1_mask_spin(csi, SUN4I_CSI1_HSIZE,
+			     sun4i_csi1_hstart(csi, csi->hdisplay_start),
+			     0x1FFF);
+	sun4i_csi1_mask_spin(csi, SUN4I_CSI1_VSIZE,
+			     sun4i_csi1_vstart(csi, csi->vdisplay_start),
+			     0x1FFF);
+
+	/* let the isr start handing out buffers again. */
+	WRITE_ONCE(measure->calibration, SUN4I_CSI1_CALIBRATION_DONE);
+}
+
+static void sun4i_csi1_engine_start(struct sun4i_csi1 *csi)
+{
+	struct measure *measure = csi->measure;
+	int hdisplay_start, vdisplay_start;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(csi->buffer_lock, flags);
+
+	csi->sequence = 0;
+	csi->sequence_start = 0;
+	csi->frames_dropped = 0;
+	csi->frames_missed = 0;
+	csi->vsync_last = 0;
+	csi->field_top_done = false;
+	csi->field_broken = false;
+	memset(csi->isr_stats, 0, sizeof(struct isr_stats));
+
+	measure->frame_last = 0;
+	measure->frame_period = 0;
+
+	/*
+	 * We only know how to find the picture in a whole frame, and the
+	 * dummy is only as large as what we are told to capture.
+	 */
+	if (measure->display_start_auto && (csi->field == V4L2_FIELD_NONE) &&
+	    !sun4i_csi1_cropped(csi)) {
+		/*
+		 * Capture from right after the syncs into the dummy, the
+		 * buffers stay queued until we know where the picture is.
+		 */
+		measure->calibration = SUN4I_CSI1_CALIBRATION_RUNNING;
+		measure->display_start_valid = false;
+		csi->buffers[0] = NULL;
+		csi->buffers[1] = NULL;
+		hdisplay_start = 0;
+		vdisplay_start = 0;
+	} else {
+		measure->calibration = SUN4I_CSI1_CALIBRATION_NONE;
+		/* min_buffers_needed guarantees that these are present. */
+		csi->buffers[0] = sun4i_csi1_ring_pop(csi, NULL);
+		if (sun4i_csi1_field_paired(csi))
+			csi->buffers[1] = NULL;
+		else
+			csi->buffers[1] = sun4i_csi1_ring_pop(csi, NULL);
+		hdisplay_start = csi->hdisplay_start;
+		vdisplay_start = csi->vdisplay_start;
+	}
+
+	/* set input format */
+	sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, csi->input_mode << 20,
+			0x00700000);
+
+	/* set output format */
+	sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG,
+			csi->format->output_mode << 16, 0x000F0000);
+
+	if (csi->vsync_polarity) /* positive */
+		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x04, 0x04);
+	else
+		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x04);
+	if (csi->hsync_polarity) /* positive */
+		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x02, 0x02);
+	else
+		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x02);
+
+	/* PCLK is low */
+	sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x01);
+
+	/* take in both fields, or just the one that progressive has. */
+	if (csi->field != V4L2_FIELD_NONE)
+		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x0800, 0x0C00);
+	else
+		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x0C00);
+
+	/* set buffer addresses */
+	if (sun4i_csi1_field_paired(csi)) {
+		for (i = 0; i < 2; i++)
+			if (csi->buffers[0])
+				sun4i_csi1_field_addresses_set(csi, i,
+						csi->buffers[0]->dma_addr);
+			else
+				sun4i_csi1_field_addresses_set(csi, i,
+						csi->dummy_buffer->dma_addr);
+	} else {
+		for (i = 0; i < 2; i++)
+			if (csi->buffers[i])
+				sun4i_csi1_buffer_addresses_set(csi, i,
+						csi->buffers[i]->dma_addr);
+			else
+				sun4i_csi1_buffer_addresses_set(csi, i,
+						csi->dummy_buffer->dma_addr);
+	}
+
+	/* enable double buffering, and select buffer A first */
+	sun4i_csi1_write(csi, SUN4I_CSI1_BUFFER_CONTROL, 0x01);
+
+	/* enable interrupts: frame done, and vsync when we timestamp on it. */
+	if (csi->timestamp_soe)
+		sun4i_csi1_mask(csi, SUN4I_CSI1_INT_ENABLE,
+				SUN4I_CSI1_INT_FRAME_DONE | SUN4I_CSI1_INT_VSYNC,
+				SUN4I_CSI1_INT_FRAME_DONE | SUN4I_CSI1_INT_VSYNC);
+	else
+		sun4i_csi1_mask(csi, SUN4I_CSI1_INT_ENABLE,
+				SUN4I_CSI1_INT_FRAME_DONE,
+				SUN4I_CSI1_INT_FRAME_DONE | SUN4I_CSI1_INT_VSYNC);
+
+	sun4i_csi1_mask(csi, SUN4I_CSI1_HSIZE, csi->crop->width << 16,
+			0x1FFF0000);
+	sun4i_csi1_mask(csi, SUN4I_CSI1_HSIZE,
+			sun4i_csi1_hstart(csi, hdisplay_start), 0x1FFF);
+
+	/* the engine counts lines per field. */
+	if (csi->field != V4L2_FIELD_NONE)
+		sun4i_csi1_mask(csi, SUN4I_CSI1_VSIZE,
+				(csi->crop->height / 2) << 16, 0x1FFF0000);
+	else
+		sun4i_csi1_mask(csi, SUN4I_CSI1_VSIZE,
+				csi->crop->height << 16, 0x1FFF0000);
+	sun4i_csi1_mask(csi, SUN4I_CSI1_VSIZE,
+			sun4i_csi1_vstart(csi, vdisplay_start), 0x1FFF);
+
+	/* decimation, after cropping. */
+	sun4i_csi1_write(csi, SUN4I_CSI1_SCALE,
+		SUN4I_CSI1_SCALE_HORIZONTAL(
+			sun4i_csi1_decimate_mask(csi->hdecimate, 16)) |
+		SUN4I_CSI1_SCALE_VERTICAL(
+			sun4i_csi1_decimate_mask(csi->vdecimate, 4)));
+
+	/*
+	 * luma line length, the engine derives the chroma one itself. When
+	 * weaving, every field skips the lines of the other.
+	 */
+	if (csi->field == V4L2_FIELD_INTERLACED)
+		sun4i_csi1_mask(csi, SUN4I_CSI1_STRIDE,
+				2 * csi->plane_stride[0], 0x1FFF);
+	else
+		sun4i_csi1_mask(csi, SUN4I_CSI1_STRIDE,
+				csi->plane_stride[0], 0x1FFF);
+
+	/* start. */
+	sun4i_csi1_mask(csi, SUN4I_CSI1_CAPTURE, 0x02, 0x02);
+
+	spin_unlock_irqrestore(csi->buffer_lock, flags);
+}
+
+static void sun4i_csi1_engine_stop(struct sun4i_csi1 *csi)
+{
+	sun4i_csi1_write_spin(csi, SUN4I_CSI1_CAPTURE, 0);
+
+	/* make sure that the isr is done with our buffers and the ring. */
+	if (csi->emulation)
+		sun4i_csi1_emulation_synchronize(csi);
+	else
+		synchronize_irq(csi->irq);
+
+	/* and that nobody is still looking at the dummy. */
+	cancel_work_sync(csi->calibrate_work);
+}
+
+static int sun4i_csi1_streaming_start(struct vb2_queue *queue, unsigned int count)
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
+	int ret;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	/* this is where the links get validated. */
+	ret = media_pipeline_start(&csi->slashdev->entity, csi->pipeline);
+	if (ret)
+		goto error;
+
+	ret = sun4i_csi1_dummy_buffer_update(csi);
+	if (ret)
+		goto error_pipeline;
+
+	ret =  sun4i_csi1_poweron(csi);
+	if (ret)
+		goto error_pipeline;
+	csi->powered = true;
+
+	sun4i_registers_print(csi);
+
+	sun4i_csi1_engine_start(csi);
+
+	dev_info(csi->dev, "After engine start:\n");
+
+	sun4i_registers_print(csi);
+
+	return 0;
+
+ error_pipeline:
+	media_pipeline_stop(&csi->slashdev->entity);
+ error:
+	sun4i_csi1_ring_clear(csi, VB2_BUF_STATE_QUEUED);
+	return ret;
+}
+
+static void sun4i_csi1_buffers_mark_done(struct vb2_queue *queue)
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
+	int i;
+
+	dev_info(csi->dev, "%s(%d);\n", __func__, queue->num_buffers);
+
+	for (i = 0; i < queue->num_buffers; i++) {
+		struct vb2_buffer *vb2_buffer = queue->bufs[i];
+
+		/* only disable active buffers, otherwise we get a WARN_ON() */
+		if (vb2_buffer->state == VB2_BUF_STATE_ACTIVE)
+			sun4i_csi1_buffer_done(csi, vb2_buffer,
+					       VB2_BUF_STATE_ERROR);
+	}
+}
+
+static void sun4i_csi1_streaming_stop(struct vb2_queue *queue)
+{
+	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	sun4i_csi1_engine_stop(csi);
+
+	sun4i_registers_print(csi);
+
+	if (csi->frames_dropped)
+		dev_info(csi->dev, "%s(): %llu/%llu frames dropped to dummy.\n",
+			 __func__, csi->frames_dropped, csi->sequence);
+	if (csi->frames_missed)
+		dev_info(csi->dev, "%s(): %llu/%llu frames missed.\n",
+			 __func__, csi->frames_missed, csi->sequence);
+
+	sun4i_csi1_ring_clear(csi, VB2_BUF_STATE_ERROR);
+
+	sun4i_csi1_readers_flush(csi);
+
+	sun4i_csi1_buffers_mark_done(queue);
+
+	/* so that all requests are complete when STREAMOFF returns. */
+	flush_work(csi->requests_work);
+
+	sun4i_csi1_poweroff(csi);
+	csi->powered = false;
+
+	media_pipeline_stop(&csi->slashdev->entity);
+}
+
+static int sun4i_csi1_buffer_init(struct vb2_buffer *vb2_buffer)
+{
+	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	struct sun4i_csi1_buffer *buffer =
+		container_of(v4l2_buffer, struct sun4i_csi1_buffer,
+			     v4l2_buffer);
+
+	buffer->reader_fence_context = dma_fence_context_alloc(1);
+	buffer->reader_fence_seqno = 0;
+
+	return 0;
+}
+
+static void sun4i_csi1_buffer_cleanup(struct vb2_buffer *vb2_buffer)
+{
+	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	struct sun4i_csi1_buffer *buffer =
+		container_of(v4l2_buffer, struct sun4i_csi1_buffer,
+			     v4l2_buffer);
+	int i;
+
+	/* the memory stays around for as long as readers have it. */
+	for (i = 0; i < VIDEO_MAX_PLANES; i++) {
+		if (buffer->reader_dbuf[i]) {
+			dma_buf_put(buffer->reader_dbuf[i]);
+			buffer->reader_dbuf[i] = NULL;
+		}
+	}
+}
+
+static const struct vb2_ops sun4i_csi1_vb2_queue_ops = {
+	.queue_setup = sun4i_csi1_queue_setup,
+	.buf_init = sun4i_csi1_buffer_init,
+	.buf_cleanup = sun4i_csi1_buffer_cleanup,
+	.buf_prepare = sun4i_csi1_buffer_prepare,
+	.buf_queue = sun4i_csi1_buffer_queue,
+	.buf_request_complete = sun4i_csi1_buffer_request_complete,
+	.start_streaming = sun4i_csi1_streaming_start,
+	.stop_streaming = sun4i_csi1_streaming_stop,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+};
+
+/*
+ * Keep up to a handful of 1080p 16bit frames around when buffers are freed,
+ * so that the next REQBUFS does not need to find them in CMA again. This can
+ * be tuned through the vb2_dc_pool directory in sysfs.
+ */
+#define SUN4I_CSI1_POOL_LIMIT	(4 * 1920 * 1088 * 2)
+
+static int sun4i_csi1_vb2_queue_initialize(struct sun4i_csi1 *csi)
+{
+	struct vb2_queue *queue = csi->vb2_queue;
+	int ret;
+
+	queue->drv_priv = csi;
+	queue->dev = csi->dev;
+
+	queue->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	queue->io_modes = VB2_MMAP | VB2_DMABUF;
+	queue->supports_requests = true;
+	queue->supports_out_fences = true;
+	queue->allow_cache_hints = true;
+	queue->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	if (csi->timestamp_soe)
+		queue->timestamp_flags |= V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+	else
+		queue->timestamp_flags |= V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+
+	queue->min_buffers_needed = 3;
+	queue->buf_struct_size = sizeof(struct sun4i_csi1_buffer);
+
+	if ((wake_batch > 1) && !wake_delay_us) {
+		dev_warn(csi->dev, "%s(): wake_batch needs wake_delay_us, "
+			 "ignored.\n", __func__);
+	} else if (wake_batch > 1) {
+		queue->done_wake_batch = wake_batch;
+		queue->done_wake_delay_us = wake_delay_us;
+	}
+
+	queue->ops = &sun4i_csi1_vb2_queue_ops;
+	csi->buffers_sg = sg_buffers;
+	if (csi->buffers_sg) {
+		queue->mem_ops = &vb2_dma_sg_memops;
+		/* one piece per plane, but not from CMA. */
+		queue->dma_attrs = VB2_DMA_SG_ATTR_CONTIGUOUS;
+	} else {
+		queue->mem_ops = &vb2_dma_contig_memops;
+	}
+
+	mutex_init(csi->vb2_queue_lock);
+	queue->lock = csi->vb2_queue_lock;
+
+	spin_lock_init(csi->buffer_lock);
+	csi->ring->head = 0;
+	csi->ring->tail = 0;
+
+	INIT_WORK(csi->calibrate_work, sun4i_csi1_calibrate_work);
+
+	spin_lock_init(csi->readers_lock);
+	INIT_LIST_HEAD(csi->readers);
+	INIT_WORK(csi->readers_work, sun4i_csi1_readers_work);
+
+	spin_lock_init(csi->requests_lock);
+	INIT_KFIFO(csi->requests_done);
+	INIT_WORK(csi->requests_work, sun4i_csi1_requests_work);
+
+	/* not fatal, we just allocate from scratch every time then. */
+	ret = vb2_dma_contig_pool_init(csi->dev, SUN4I_CSI1_POOL_LIMIT);
+	if (ret)
+		dev_warn(csi->dev, "%s(): vb2_dma_contig_pool_init() failed: "
+			 "%d\n", __func__, ret);
+
+	ret = vb2_queue_init(queue);
+	if (ret) {
+		dev_err(csi->dev, "%s(): vb2_queue_init() failed: %d\n",
+			__func__, ret);
+		vb2_dma_contig_pool_cleanup(csi->dev);
+		mutex_destroy(csi->vb2_queue_lock);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void sun4i_csi1_vb2_queue_free(struct sun4i_csi1 *csi)
+{
+	struct vb2_queue *queue = csi->vb2_queue;
+
+	cancel_work_sync(csi->readers_work);
+	vb2_queue_release(queue);
+	flush_work(csi->requests_work);
+	vb2_dma_contig_pool_cleanup(csi->dev);
+	sun4i_csi1_dummy_buffer_free(csi);
+	mutex_destroy(csi->vb2_queue_lock);
+}
+
+static int sun4i_csi1_fop_open(struct file *file)
+{
+	struct video_device *slashdev = video_devdata(file);
+	struct sun4i_csi1_fh *fh;
+
+	fh = kzalloc(sizeof(*fh), GFP_KERNEL);
+	if (!fh)
+		return -ENOMEM;
+
+	v4l2_fh_init(fh->fh, slashdev);
+	v4l2_fh_add(fh->fh);
+	file->private_data = fh->fh;
+
+	return 0;
+}
+
+/*
+ * With the vb2 queue lock held.
+ */
+static void sun4i_csi1_reader_stop(struct sun4i_csi1 *csi,
+				   struct sun4i_csi1_reader *reader)
+{
+	bool requeue = false;
+	unsigned long flags;
+	unsigned int index;
+
+	spin_lock_irqsave(csi->readers_lock, flags);
+
+	list_del(&reader->head);
+
+	for (; reader->pending_count; reader->pending_count--) {
+		index = reader->pending[reader->pending_first].index;
+		requeue |= sun4i_csi1_reader_put(csi, index);
+
+		reader->pending_first = (reader->pending_first + 1) %
+			SUN4I_CSI1_READER_DEPTH_MAX;
+	}
+
+	for_each_set_bit(index, reader->held, VB2_MAX_FRAME)
+		requeue |= sun4i_csi1_reader_put(csi, index);
+	bitmap_zero(reader->held, VB2_MAX_FRAME);
+	reader->held_count = 0;
+
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+
+	if (requeue)
+		sun4i_csi1_readers_requeue(csi);
+}
+
+static int sun4i_csi1_fop_release(struct file *file)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct sun4i_csi1_fh *fh =
+		container_of(file->private_data, struct sun4i_csi1_fh, fh[0]);
+
+	if (fh->reading) {
+		mutex_lock(csi->vb2_queue_lock);
+		sun4i_csi1_reader_stop(csi, fh->reader);
+		mutex_unlock(csi->vb2_queue_lock);
+	}
+
+	/* this frees our fh as well. */
+	return vb2_fop_release(file);
+}
+
+static __poll_t sun4i_csi1_fop_poll(struct file *file, poll_table *wait)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct sun4i_csi1_fh *fh =
+		container_of(file->private_data, struct sun4i_csi1_fh, fh[0]);
+	struct sun4i_csi1_reader *reader = fh->reader;
+	unsigned long flags;
+	__poll_t ret = 0;
+
+	if (!fh->reading)
+		return vb2_fop_poll(file, wait);
+
+	poll_wait(file, &reader->wait, wait);
+
+	spin_lock_irqsave(csi->readers_lock, flags);
+	if (reader->pending_count)
+		ret = EPOLLIN | EPOLLRDNORM;
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+
+	return ret;
+}
+
+static const struct v4l2_file_operations sun4i_csi1_slashdev_fops = {
+	.owner = THIS_MODULE,
+	.open = sun4i_csi1_fop_open,
+	.release = sun4i_csi1_fop_release,
+	.unlocked_ioctl = video_ioctl2,
+	.mmap = vb2_fop_mmap,
+	.poll = sun4i_csi1_fop_poll,
+};
+
+static int sun4i_csi1_ioctl_capability_query(struct file *file, void *handle,
+					     struct v4l2_capability *capability)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	strscpy(capability->driver, "sun4i_csi1", sizeof(capability->driver));
+	strscpy(capability->card, csi->slashdev->name,
+		sizeof(capability->card));
+
+	/* the emulated device does not come from the device tree. */
+	if (csi->dev->of_node)
+		snprintf(capability->bus_info, sizeof(capability->bus_info),
+			 "platform:%s", csi->dev->of_node->name);
+	else
+		snprintf(capability->bus_info, sizeof(capability->bus_info),
+			 "platform:%s", dev_name(csi->dev));
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_format_enumerate(struct file *file, void *handle,
+					     struct v4l2_fmtdesc *descriptor)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (descriptor->index >= csi->format_count)
+		return -EINVAL;
+
+	descriptor->pixelformat = csi->formats[descriptor->index].pixelformat;
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_format_get(struct file *file, void *handle,
+			       struct v4l2_format *format)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	*format = csi->v4l2_format[0];
+
+	return 0;
+}
+
+/*
+ * Only the pixelformat and, for interlaced input, the field order are
+ * really up for negotiation, everything else is dictated by the incoming
+ * signal.
+ */
+static const struct sun4i_csi1_format *
+sun4i_csi1_format_try(struct sun4i_csi1 *csi, struct v4l2_format *format)
+{
+	const struct sun4i_csi1_format *found;
+
+	enum v4l2_field field;
+
+	found = sun4i_csi1_format_find(csi, format->fmt.pix_mp.pixelformat);
+	if (!found)
+		found = csi->format;
+
+	field = sun4i_csi1_field_get(csi->dv_timings, format->fmt.pix_mp.field);
+
+	sun4i_csi1_pixel_format_fill(found, csi->crop->width / csi->hdecimate,
+				     csi->crop->height / csi->vdecimate, field,
+				     &format->fmt.pix_mp);
+
+	return found;
+}
+
+/*
+ * Check whether the buffers we already have can take a new format, so that
+ * changing resolution or format does not force userspace to reallocate
+ * everything.
+ */
+static bool sun4i_csi1_buffers_fit(struct sun4i_csi1 *csi,
+				   const struct v4l2_pix_format_mplane *pixel)
+{
+	struct vb2_queue *queue = csi->vb2_queue;
+	int i, j;
+
+	for (i = 0; i < queue->num_buffers; i++) {
+		struct vb2_buffer *buffer = queue->bufs[i];
+
+		if (buffer->num_planes != pixel->num_planes)
+			return false;
+
+		for (j = 0; j < pixel->num_planes; j++)
+			if (vb2_plane_size(buffer, j) <
+			    pixel->plane_fmt[j].sizeimage)
+				return false;
+	}
+
+	return true;
+}
+
+static int sun4i_csi1_ioctl_format_set(struct file *file, void *handle,
+				       struct v4l2_format *format)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	const struct sun4i_csi1_format *found;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (vb2_is_streaming(csi->vb2_queue))
+		return -EBUSY;
+
+	/*
+	 * The subdev came or went while the buffers were busy, so we are
+	 * still on the format table of the previous input.
+	 */
+	if (csi->input_mode != sun4i_csi1_input_mode_wanted(csi))
+		sun4i_csi1_input_mode_set(csi,
+					  sun4i_csi1_input_mode_wanted(csi));
+
+	found = sun4i_csi1_format_try(csi, format);
+
+	if (!sun4i_csi1_format_allocatable(csi, &format->fmt.pix_mp))
+		return -EINVAL;
+
+	if (vb2_is_busy(csi->vb2_queue) &&
+	    !sun4i_csi1_buffers_fit(csi, &format->fmt.pix_mp))
+		return -EBUSY;
+
+	csi->field = format->fmt.pix_mp.field;
+	sun4i_csi1_format_apply(csi, found);
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_format_try(struct file *file, void *handle,
+				       struct v4l2_format *format)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	sun4i_csi1_format_try(csi, format);
+
+	if (!sun4i_csi1_format_allocatable(csi, &format->fmt.pix_mp))
+		return -EINVAL;
+
+	return 0;
+}
+
+static bool sun4i_csi1_selection_type_valid(uint32_t type)
+{
+	return (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) ||
+		(type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+}
+
+static int sun4i_csi1_ioctl_selection_get(struct file *file, void *handle,
+					  struct v4l2_selection *selection)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct v4l2_rect *rect = &selection->r;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (!sun4i_csi1_selection_type_valid(selection->type))
+		return -EINVAL;
+
+	switch (selection->target) {
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		rect->left = 0;
+		rect->top = 0;
+		rect->width = csi->width;
+		rect->height = csi->height;
+		return 0;
+	case V4L2_SEL_TGT_CROP:
+		*rect = csi->crop[0];
+		return 0;
+	case V4L2_SEL_TGT_COMPOSE_BOUNDS:
+	case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+		rect->left = 0;
+		rect->top = 0;
+		rect->width = csi->crop->width;
+		rect->height = csi->crop->height;
+		return 0;
+	case V4L2_SEL_TGT_COMPOSE:
+		rect->left = 0;
+		rect->top = 0;
+		rect->width = csi->crop->width / csi->hdecimate;
+		rect->height = csi->crop->height / csi->vdecimate;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Find the decimation that gets us closest to the wanted size, while
+ * keeping the output a multiple of align. This honours the LE and GE
+ * flags where it can.
+ */
+static int sun4i_csi1_decimate_get(int size, int wanted, int align,
+				   uint32_t flags)
+{
+	int best = 1;
+	int i;
+
+	for (i = 2; i <= SUN4I_CSI1_DECIMATE_MAX; i *= 2) {
+		if (size % (align * i))
+			break;
+
+		if ((flags & V4L2_SEL_FLAG_GE) && ((size / i) < wanted))
+			break;
+
+		if ((flags & V4L2_SEL_FLAG_LE) && ((size / best) > wanted))
+			best = i;
+		else if (abs(size / i - wanted) < abs(size / best - wanted))
+			best = i;
+	}
+
+	return best;
+}
+
+/*
+ * Cropping resets the decimation. Offsets and sizes are kept even, and
+ * a multiple of 4 lines for interlaced input, so that the chroma and the
+ * fields stay intact.
+ */
+static int sun4i_csi1_ioctl_selection_set(struct file *file, void *handle,
+					  struct v4l2_selection *selection)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct v4l2_rect bounds = {
+		.width = csi->width,
+		.height = csi->height,
+	};
+	static const struct v4l2_rect minimum = {
+		.width = 32,
+		.height = 32,
+	};
+	struct v4l2_pix_format_mplane pixel[1];
+	struct v4l2_rect crop = csi->crop[0];
+	int valign = (csi->field == V4L2_FIELD_NONE) ? 2 : 4;
+	int hdecimate, vdecimate;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (!sun4i_csi1_selection_type_valid(selection->type))
+		return -EINVAL;
+
+	if (vb2_is_streaming(csi->vb2_queue))
+		return -EBUSY;
+
+	switch (selection->target) {
+	case V4L2_SEL_TGT_CROP:
+		crop = selection->r;
+		crop.left = round_down(crop.left, 2);
+		crop.top = round_down(crop.top, valign);
+		crop.width = round_down(crop.width, 2);
+		crop.height = round_down(crop.height, valign);
+
+		v4l2_rect_set_min_size(&crop, &minimum);
+		v4l2_rect_map_inside(&crop, &bounds);
+
+		hdecimate = 1;
+		vdecimate = 1;
+		break;
+	case V4L2_SEL_TGT_COMPOSE:
+		hdecimate = sun4i_csi1_decimate_get(crop.width,
+						    selection->r.width, 2,
+						    selection->flags);
+		vdecimate = sun4i_csi1_decimate_get(crop.height,
+						    selection->r.height, valign,
+						    selection->flags);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	sun4i_csi1_pixel_format_fill(csi->format, crop.width / hdecimate,
+				     crop.height / vdecimate, csi->field,
+				     pixel);
+
+	if (vb2_is_busy(csi->vb2_queue) && !sun4i_csi1_buffers_fit(csi, pixel))
+		return -EBUSY;
+
+	csi->crop[0] = crop;
+	csi->hdecimate = hdecimate;
+	csi->vdecimate = vdecimate;
+	sun4i_csi1_format_apply(csi, csi->format);
+
+	if (selection->target == V4L2_SEL_TGT_CROP) {
+		selection->r = crop;
+	} else {
+		selection->r.left = 0;
+		selection->r.top = 0;
+		selection->r.width = crop.width / hdecimate;
+		selection->r.height = crop.height / vdecimate;
+	}
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_input_enumerate(struct file *file, void *handle,
+					    struct v4l2_input *input)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	int ret;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (input->index)
+		return -EINVAL;
+
+	input->type = V4L2_INPUT_TYPE_CAMERA;
+	input->capabilities = V4L2_IN_CAP_DV_TIMINGS;
+
+	if (!csi->subdev) {
+		strscpy(input->name, "direct", sizeof(input->name));
+		return 0;
+	}
+
+	strscpy(input->name, csi->subdev->name, sizeof(input->name));
+
+	ret = v4l2_subdev_call(csi->subdev, video, g_input_status,
+			       &input->status);
+	if (ret && (ret != -ENOIOCTLCMD))
+		return ret;
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_input_set(struct file *file, void *handle,
+				      unsigned int input)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (input)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_input_get(struct file *file, void *handle,
+				      unsigned int *input)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	*input = 0;
+
+	return 0;
+}
+
+static int sun4i_csi1_ioctl_dv_timings_cap(struct file *file, void *handle,
+					   struct v4l2_dv_timings_cap *cap)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (cap->pad)
+		return -EINVAL;
+
+	if (csi->subdev)
+		return v4l2_subdev_call(csi->subdev, pad, dv_timings_cap, cap);
+
+	*cap = sun4i_csi1_timings_cap;
+
+	return 0;
+}
+
+static int
+sun4i_csi1_ioctl_dv_timings_enumerate(struct file *file, void *handle,
+				      struct v4l2_enum_dv_timings *timings)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (csi->subdev) {
+		if (timings->pad)
+			return -EINVAL;
+
+		return v4l2_subdev_call(csi->subdev, pad, enum_dv_timings,
+					timings);
+	}
+
+	return v4l2_enum_dv_timings_cap(timings, &sun4i_csi1_timings_cap,
+					NULL, NULL);
+}
+
+static int sun4i_csi1_ioctl_dv_timings_get(struct file *file, void *handle,
+					   struct v4l2_dv_timings *timings)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	*timings = csi->dv_timings[0];
+
+	return 0;
+}
+
+/*
+ * The adv7611 measures everything for us.
+ *
+ * The tfp401 gives us no way of finding out what is coming in, so we start
+ * from what we were told, and then fill in what we measured ourselves:
+ * the frame rate, which sets the pixelclock, and the display start, which
+ * gives us the porches. Totals are kept.
+ *
+ * When we are not capturing, we have nothing to measure with.
+ */
+static int sun4i_csi1_ioctl_dv_timings_query(struct file *file, void *handle,
+					     struct v4l2_dv_timings *timings)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct measure *measure = csi->measure;
+	struct v4l2_bt_timings *bt = &timings->bt;
+	uint64_t period, last;
+	int htotal, vtotal;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (csi->subdev)
+		return v4l2_subdev_call(csi->subdev, video, query_dv_timings,
+					timings);
+
+	*timings = csi->dv_timings[0];
+
+	if (!vb2_is_streaming(csi->vb2_queue))
+		return 0;
+
+	period = READ_ONCE(measure->frame_period);
+	last = READ_ONCE(measure->frame_last);
+	if (!period)
+		return -ENOLCK;
+
+	/* nothing came in for a handful of frames. */
+	if ((ktime_get_ns() - last) > (4 * period))
+		return -ENOLINK;
+
+	htotal = V4L2_DV_BT_FRAME_WIDTH(bt);
+	vtotal = V4L2_DV_BT_FRAME_HEIGHT(bt);
+
+	/* we measured fields. */
+	if (bt->interlaced)
+		period *= 2;
+
+	bt->pixelclock = div64_u64((uint64_t) htotal * vtotal * NSEC_PER_SEC,
+				   period);
+
+	if (measure->display_start_valid && !bt->interlaced) {
+		int hblank = htotal - bt->width;
+		int vblank = vtotal - bt->height;
+		int hstart = min(measure->hdisplay_start, hblank);
+		int vstart = min(measure->vdisplay_start, vblank);
+
+		/* keep the syncs, unless they no longer fit. */
+		bt->hsync = min_t(int, bt->hsync, hstart);
+		bt->hbackporch = hstart - bt->hsync;
+		bt->hfrontporch = hblank - hstart;
+
+		bt->vsync = min_t(int, bt->vsync, vstart);
+		bt->vbackporch = vstart - bt->vsync;
+		bt->vfrontporch = vblank - vstart;
+	}
+
+	return 0;
+}
+
+static void sun4i_csi1_source_change(struct sun4i_csi1 *csi)
+{
+	static const struct v4l2_event event = {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+		.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
+	};
+
+	v4l2_event_queue(csi->slashdev, &event);
+}
+
+/*
+ * Only the engine needs to be stopped for this. When the buffers we
+ * already have are big enough, they are kept, so a mode change is just
+ * STREAMOFF, S_DV_TIMINGS, STREAMON.
+ */
+static int sun4i_csi1_ioctl_dv_timings_set(struct file *file, void *handle,
+					   struct v4l2_dv_timings *timings)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct v4l2_pix_format_mplane pixel[1];
+	int ret;
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (!v4l2_valid_dv_timings(timings, &sun4i_csi1_timings_cap,
+				   NULL, NULL))
+		return -ERANGE;
+
+	if (v4l2_match_dv_timings(timings, csi->dv_timings, 0, false))
+		return 0;
+
+	if (vb2_is_streaming(csi->vb2_queue))
+		return -EBUSY;
+
+	sun4i_csi1_pixel_format_fill(csi->format, timings->bt.width,
+				     timings->bt.height,
+				     sun4i_csi1_field_get(timings, csi->field),
+				     pixel);
+
+	if (vb2_is_busy(csi->vb2_queue) && !sun4i_csi1_buffers_fit(csi, pixel))
+		return -EBUSY;
+
+	if (csi->subdev) {
+		ret = v4l2_subdev_call(csi->subdev, video, s_dv_timings,
+				       timings);
+		if (ret)
+			return ret;
+	}
+
+	sun4i_csi1_timings_update(csi, timings);
+
+	v4l2_print_dv_timings(dev_name(csi->dev), "new timings: ",
+			      timings, true);
+
+	/* let other listeners know that they need to renegotiate. */
+	sun4i_csi1_source_change(csi);
+
+	return 0;
+}
+
+/*
+ * Only the adv7611 has an edid, our input 0 is its first hdmi port.
+ */
+static int sun4i_csi1_ioctl_edid_get(struct file *file, void *handle,
+				     struct v4l2_edid *edid)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
+
+	dev_info(csi->dev, "%s();\n", __func__);
+
+	if (!csi->subdev)
+		return -ENOTTY;
+
+	if (edid->pad)
+		return -EINVAL;
+
+	return v4l2_subdev_call(csi->subdev, pad, get_edid, edid);
+}
+
+static int sun4i_csi1_ioctl_edid_set(struct file *file, void *handle,
+				     struct v4l2_edid *edid)
+{
+	struct sun4i_csi1 *csi = video_drvdata(file);
 
-	for (i = 0; i < csi->plane_count; i++)
-		if (dummy->virtual[i]) {
-			virtual_addr[i] = dummy->virtual[i];
-			dma_addr[i] = dummy->dma_addr[i];
-			dummy->virtual[i] = NULL;
-			dummy->dma_addr[i] = 0;
-		}
+	dev_info(csi->dev, "%s();\n", __func__);
 
-	spin_unlock_irqrestore(csi->buffer_lock, flags);
+	if (!csi->subdev)
+		return -ENOTTY;
 
-	/* dma_free_coherent() must be called with interrupts enabled. */
-	for (i = 0; i < csi->plane_count; i++)
-		if (virtual_addr[i])
-			dma_free_coherent(csi->dev, csi->plane_size,
-					  virtual_addr[i], dma_addr[i]);
+	if (edid->pad)
+		return -EINVAL;
 
-	return 0;
+	return v4l2_subdev_call(csi->subdev, pad, set_edid, edid);
 }
 
-static int sun4i_csi1_dummy_buffer_alloc(struct sun4i_csi1 *csi)
+static int sun4i_csi1_ioctl_reader_start(struct sun4i_csi1 *csi,
+					 struct sun4i_csi1_fh *fh,
+					 uint32_t depth)
 {
-	struct dummy_buffer *dummy = csi->dummy_buffer;
+	struct sun4i_csi1_reader *reader = fh->reader;
 	unsigned long flags;
-	int i;
 
-	sun4i_csi1_dummy_buffer_free(csi);
+	dev_info(csi->dev, "%s(%d);\n", __func__, depth);
 
-	spin_lock_irqsave(csi->buffer_lock, flags);
+	/* the queue owner already gets every frame. */
+	if (fh->reading || (csi->vb2_queue->owner == fh->fh))
+		return -EBUSY;
 
-	for (i = 0; i < csi->plane_count; i++) {
-		dummy->virtual[i] = dma_alloc_coherent(csi->dev,
-						       csi->plane_size,
-						       &dummy->dma_addr[i],
-						       GFP_KERNEL);
-		if (!dummy->virtual[i])
-			break;
-	}
+	if (!depth || (depth > SUN4I_CSI1_READER_DEPTH_MAX))
+		return -EINVAL;
 
-	if (i != csi->plane_count) {
-		spin_unlock_irqrestore(csi->buffer_lock, flags);
-		dev_err(csi->dev, "%s: dma_alloc_coherent() failed.\n",
-			__func__);
-		sun4i_csi1_dummy_buffer_free(csi);
-		return -ENOMEM;
-	}
+	/*
+	 * Frames that readers hold do not go back to the engine, so all
+	 * readers together must leave the queue owner enough buffers. When
+	 * there are no buffers yet, queue_setup asks for enough of them.
+	 */
+	if (csi->vb2_queue->num_buffers &&
+	    (csi->vb2_queue->num_buffers <
+	     (csi->vb2_queue->min_buffers_needed +
+	      sun4i_csi1_readers_depth(csi) + depth)))
+		return -EBUSY;
 
-	spin_unlock_irqrestore(csi->buffer_lock, flags);
+	init_waitqueue_head(&reader->wait);
+	reader->depth = depth;
 
-	for (i = 0; i < csi->plane_count; i++)
-		dev_info(csi->dev, "%s: allocated dummy buffer[%d] at 0x%X.\n",
-			 __func__, i, dummy->dma_addr[i]);
+	spin_lock_irqsave(csi->readers_lock, flags);
+	list_add_tail(&reader->head, csi->readers);
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+
+	fh->reading = true;
 
 	return 0;
 }
 
-static int sun4i_csi1_queue_setup(struct vb2_queue *queue,
-				  unsigned int *buffer_count,
-				  unsigned int *planes_count,
-				  unsigned int sizes[],
-				  struct device *alloc_devs[])
+static int sun4i_csi1_ioctl_reader_expbuf(struct sun4i_csi1 *csi,
+					  struct sun4i_csi1_fh *fh,
+					  struct v4l2_exportbuffer *export)
 {
-	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
-	int ret, i;
+	struct sun4i_csi1_reader *reader = fh->reader;
+	struct vb2_queue *queue = csi->vb2_queue;
+	struct sun4i_csi1_buffer *buffer;
+	struct vb2_buffer *vb2_buffer;
+	struct dma_buf *dbuf;
+	unsigned long flags;
+	bool held;
+	int ret;
 
-	if (buffer_count)
-		dev_info(csi->dev, "%s(%d);\n", __func__, *buffer_count);
-	else
-		dev_info(csi->dev, "%s();\n", __func__);
+	if (!fh->reading || (export->index >= VB2_MAX_FRAME))
+		return -EINVAL;
 
-	*planes_count = csi->plane_count;
-	for (i = 0; i < csi->plane_count; i++)
-		sizes[i] = csi->plane_size;
+	/*
+	 * Only the frames this reader holds, or it could read buffers that
+	 * are being written to. The ioctl core holds the vb2 queue lock, so
+	 * this cannot get released underneath us.
+	 */
+	spin_lock_irqsave(csi->readers_lock, flags);
+	held = test_bit(export->index, reader->held);
+	spin_unlock_irqrestore(csi->readers_lock, flags);
 
-	sun4i_csi1_buffer_list_clear(csi);
+	if (!held)
+		return -EBUSY;
 
-	ret = sun4i_csi1_dummy_buffer_alloc(csi);
-	if (ret)
+	if ((queue->memory != VB2_MEMORY_MMAP) || (export->type != queue->type))
+		return -EINVAL;
+
+	vb2_buffer = queue->bufs[export->index];
+	if (export->plane >= vb2_buffer->num_planes)
+		return -EINVAL;
+
+	buffer = container_of(to_vb2_v4l2_buffer(vb2_buffer),
+			      struct sun4i_csi1_buffer, v4l2_buffer);
+
+	/*
+	 * Readers never get to write to the buffers of the queue owner, and
+	 * all of them share one dma-buf per plane, which gets fenced every
+	 * time the buffer goes back to the engine.
+	 */
+	dbuf = buffer->reader_dbuf[export->plane];
+	if (!dbuf) {
+		dbuf = queue->mem_ops->get_dmabuf(
+			vb2_buffer->planes[export->plane].mem_priv, O_RDONLY);
+		if (IS_ERR_OR_NULL(dbuf))
+			return -EINVAL;
+
+		buffer->reader_dbuf[export->plane] = dbuf;
+	}
+
+	get_dma_buf(dbuf);
+	ret = dma_buf_fd(dbuf, O_CLOEXEC);
+	if (ret < 0) {
+		dma_buf_put(dbuf);
 		return ret;
+	}
+
+	export->fd = ret;
+	export->flags = O_RDONLY | O_CLOEXEC;
 
 	return 0;
 }
 
-static int sun4i_csi1_buffer_prepare(struct vb2_buffer *vb2_buffer)
+static int sun4i_csi1_ioctl_reader_dqframe(struct sun4i_csi1 *csi,
+					   struct sun4i_csi1_fh *fh,
+					   struct sun4i_csi1_reader_frame *frame)
 {
-	struct sun4i_csi1 *csi = vb2_get_drv_priv(vb2_buffer->vb2_queue);
-	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
-	struct sun4i_csi1_buffer *buffer =
-		container_of(v4l2_buffer, struct sun4i_csi1_buffer,
-			     v4l2_buffer);
-	int i;
+	struct sun4i_csi1_reader *reader = fh->reader;
+	unsigned long flags;
+	int ret = 0;
 
-	for (i = 0; i < csi->plane_count; i++)
-		vb2_set_plane_payload(vb2_buffer, i, csi->plane_size);
+	if (!fh->reading)
+		return -EINVAL;
 
-	/* make very sure that this is properly initialized */
-	INIT_LIST_HEAD(&buffer->list);
+	spin_lock_irqsave(csi->readers_lock, flags);
 
-	for (i = 0; i < csi->plane_count; i++)
-		buffer->dma_addr[i] =
-			vb2_dma_contig_plane_dma_addr(vb2_buffer, i);
+	if (!reader->pending_count) {
+		ret = -EAGAIN;
+		goto out;
+	}
 
-	return 0;
+	*frame = reader->pending[reader->pending_first];
+	frame->dropped = reader->dropped;
+	reader->dropped = 0;
+
+	reader->pending_first = (reader->pending_first + 1) %
+		SUN4I_CSI1_READER_DEPTH_MAX;
+	reader->pending_count--;
+
+	set_bit(frame->index, reader->held);
+	reader->held_count++;
+
+ out:
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+	return ret;
 }
 
-static void sun4i_csi1_buffer_queue(struct vb2_buffer *vb2_buffer)
+static int sun4i_csi1_ioctl_reader_release(struct sun4i_csi1 *csi,
+					   struct sun4i_csi1_fh *fh,
+					   uint32_t index)
 {
-	struct sun4i_csi1 *csi = vb2_get_drv_priv(vb2_buffer->vb2_queue);
-	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
-	struct sun4i_csi1_buffer *buffer =
-		container_of(v4l2_buffer, struct sun4i_csi1_buffer,
-			     v4l2_buffer);
+	struct sun4i_csi1_reader *reader = fh->reader;
+	bool requeue = false;
 	unsigned long flags;
+	int ret = 0;
 
-	spin_lock_irqsave(csi->buffer_lock, flags);
-	list_add_tail(&buffer->list, csi->buffer_list);
-	spin_unlock_irqrestore(csi->buffer_lock, flags);
+	if (!fh->reading || (index >= VB2_MAX_FRAME))
+		return -EINVAL;
+
+	spin_lock_irqsave(csi->readers_lock, flags);
+
+	/* frames are also gone when streaming was stopped. */
+	if (test_and_clear_bit(index, reader->held)) {
+		reader->held_count--;
+		requeue = sun4i_csi1_reader_put(csi, index);
+	} else
+		ret = -EINVAL;
+
+	spin_unlock_irqrestore(csi->readers_lock, flags);
+
+	/* the ioctl core holds the vb2 queue lock for us. */
+	if (requeue)
+		sun4i_csi1_readers_requeue(csi);
+
+	return ret;
 }
 
-static void sun4i_csi1_engine_start(struct sun4i_csi1 *csi)
+static long sun4i_csi1_ioctl_default(struct file *file, void *handle,
+				     bool valid_priority, unsigned int command,
+				     void *arg)
 {
-	unsigned long flags;
+	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct sun4i_csi1_fh *fh =
+		container_of(handle, struct sun4i_csi1_fh, fh[0]);
+
+	switch (command) {
+	case VIDIOC_SUN4I_CSI1_READER_START:
+		return sun4i_csi1_ioctl_reader_start(csi, fh, *(uint32_t *) arg);
+	case VIDIOC_SUN4I_CSI1_READER_EXPBUF:
+		return sun4i_csi1_ioctl_reader_expbuf(csi, fh, arg);
+	case VIDIOC_SUN4I_CSI1_READER_DQFRAME:
+		return sun4i_csi1_ioctl_reader_dqframe(csi, fh, arg);
+	case VIDIOC_SUN4I_CSI1_READER_RELEASE:
+		return sun4i_csi1_ioctl_reader_release(csi, fh,
+						       *(uint32_t *) arg);
+	default:
+		return -ENOTTY;
+	}
+}
 
-	spin_lock_irqsave(csi->buffer_lock, flags);
+static int
+sun4i_csi1_ioctl_event_subscribe(struct v4l2_fh *handle,
+				 const struct v4l2_event_subscription *event)
+{
+	switch (event->type) {
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subscribe(handle, event);
+	default:
+		return v4l2_ctrl_subscribe_event(handle, event);
+	}
+}
 
-	csi->sequence = 0;
+static const struct v4l2_ioctl_ops sun4i_csi1_ioctl_ops = {
+	.vidioc_querycap = sun4i_csi1_ioctl_capability_query,
+	.vidioc_enum_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_enumerate,
+	.vidioc_g_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_get,
+	.vidioc_s_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_set,
+	.vidioc_try_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_try,
 
-	csi->buffers[0] = list_first_entry(csi->buffer_list,
-					   struct sun4i_csi1_buffer, list);
-	list_del_init(&csi->buffers[0]->list);
-	csi->buffers[1] = list_first_entry(csi->buffer_list,
-					   struct sun4i_csi1_buffer, list);
-	list_del_init(&csi->buffers[1]->list);
+	.vidioc_g_selection = sun4i_csi1_ioctl_selection_get,
+	.vidioc_s_selection = sun4i_csi1_ioctl_selection_set,
 
-	/* set input format: yuv444 */
-	sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x00400000, 0x00700000);
+	.vidioc_enum_input = sun4i_csi1_ioctl_input_enumerate,
+	.vidioc_s_input = sun4i_csi1_ioctl_input_set,
+	.vidioc_g_input = sun4i_csi1_ioctl_input_get,
 
-	/* set output format: field planar yuv444 */
-	sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x000C0000, 0x000F0000);
+	.vidioc_dv_timings_cap = sun4i_csi1_ioctl_dv_timings_cap,
+	.vidioc_enum_dv_timings = sun4i_csi1_ioctl_dv_timings_enumerate,
+	.vidioc_g_dv_timings = sun4i_csi1_ioctl_dv_timings_get,
+	.vidioc_s_dv_timings = sun4i_csi1_ioctl_dv_timings_set,
+	.vidioc_query_dv_timings = sun4i_csi1_ioctl_dv_timings_query,
 
-	if (csi->vsync_polarity) /* positive */
-		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x04, 0x04);
-	else
-		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x04);
-	if (csi->hsync_polarity) /* positive */
-		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0x02, 0x02);
-	else
-		sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x02);
+	.vidioc_g_edid = sun4i_csi1_ioctl_edid_get,
+	.vidioc_s_edid = sun4i_csi1_ioctl_edid_set,
 
-	/* PCLK is low */
-	sun4i_csi1_mask(csi, SUN4I_CSI1_CONFIG, 0, 0x01);
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_dqbuf_batch = vb2_ioctl_dqbuf_batch,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
 
-	/* set buffer addresses */
-	sun4i_csi1_write(csi, SUN4I_CSI1_FIFO0_BUFFER_A,
-			 csi->buffers[0]->dma_addr[0]);
-	sun4i_csi1_write(csi, SUN4I_CSI1_FIFO1_BUFFER_A,
-			 csi->buffers[0]->dma_addr[1]);
-	sun4i_csi1_write(csi, SUN4I_CSI1_FIFO2_BUFFER_A,
-			 csi->buffers[0]->dma_addr[2]);
-
-	sun4i_csi1_write(csi, SUN4I_CSI1_FIFO0_BUFFER_B,
-			 csi->buffers[1]->dma_addr[0]);
-	sun4i_csi1_write(csi, SUN4I_CSI1_FIFO1_BUFFER_B,
-			 csi->buffers[1]->dma_addr[1]);
-	sun4i_csi1_write(csi, SUN4I_CSI1_FIFO2_BUFFER_B,
-			 csi->buffers[1]->dma_addr[2]);
+	.vidioc_log_status = v4l2_ctrl_log_status,
+	.vidioc_subscribe_event = sun4i_csi1_ioctl_event_subscribe,
+	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
 
-	/* enable double buffering, and select buffer A first */
-	sun4i_csi1_write(csi, SUN4I_CSI1_BUFFER_CONTROL, 0x01);
+	.vidioc_default = sun4i_csi1_ioctl_default,
+};
 
-	/* enable interrupts: frame done */
-	sun4i_csi1_mask(csi, SUN4I_CSI1_INT_ENABLE, 0x02, 0x02);
+/*
+ * The csi entity takes in the bus format on its sink pad, and passes the
+ * same on to the video node, which then decides on the pixelformat. As
+ * everything here is dictated by the incoming signal, setting a format just
+ * hands back what we have.
+ */
+#define SUN4I_CSI1_PAD_SINK	0
+#define SUN4I_CSI1_PAD_SOURCE	1
 
-	sun4i_csi1_mask(csi, SUN4I_CSI1_HSIZE, csi->width << 16, 0x1FFF0000);
-	sun4i_csi1_mask(csi, SUN4I_CSI1_HSIZE, csi->hdisplay_start, 0x1FFF);
+static uint32_t sun4i_csi1_input_mbus_code(uint32_t input_mode)
+{
+	if (input_mode == SUN4I_CSI1_INPUT_YUV422_16BIT)
+		return MEDIA_BUS_FMT_YUYV8_1X16;
+	else
+		return MEDIA_BUS_FMT_YUV8_1X24;
+}
 
-	sun4i_csi1_mask(csi, SUN4I_CSI1_VSIZE, csi->height << 16, 0x1FFF0000);
-	sun4i_csi1_mask(csi, SUN4I_CSI1_VSIZE, csi->vdisplay_start, 0x1FFF);
+/*
+ * Like the adv7611, we take in whole frames. What comes out has the size
+ * and field order of the video node.
+ */
+static void sun4i_csi1_mbus_format_fill(struct sun4i_csi1 *csi, int pad,
+					struct v4l2_mbus_framefmt *mbus)
+{
+	struct v4l2_pix_format_mplane *pixel = &csi->v4l2_format->fmt.pix_mp;
 
-	sun4i_csi1_mask(csi, SUN4I_CSI1_STRIDE, csi->width, 0x1FFF);
+	memset(mbus, 0, sizeof(struct v4l2_mbus_framefmt));
 
-	/* start. */
-	sun4i_csi1_mask(csi, SUN4I_CSI1_CAPTURE, 0x02, 0x02);
+	mbus->code = sun4i_csi1_input_mbus_code(csi->input_mode);
+	mbus->colorspace = pixel->colorspace;
 
-	spin_unlock_irqrestore(csi->buffer_lock, flags);
+	if (pad == SUN4I_CSI1_PAD_SOURCE) {
+		mbus->width = pixel->width;
+		mbus->height = pixel->height;
+		mbus->field = pixel->field;
+	} else {
+		mbus->width = csi->width;
+		mbus->height = csi->height;
+		mbus->field = V4L2_FIELD_NONE;
+	}
 }
 
-static void sun4i_csi1_engine_stop(struct sun4i_csi1 *csi)
+static int sun4i_csi1_pad_config_initialize(struct v4l2_subdev *subdev,
+					    struct v4l2_subdev_pad_config *config)
 {
-	sun4i_csi1_write_spin(csi, SUN4I_CSI1_CAPTURE, 0);
+	struct sun4i_csi1 *csi = v4l2_get_subdevdata(subdev);
+	int i;
+
+	for (i = 0; i < subdev->entity.num_pads; i++)
+		sun4i_csi1_mbus_format_fill(csi, i,
+			v4l2_subdev_get_try_format(subdev, config, i));
+
+	return 0;
 }
 
-static int sun4i_csi1_streaming_start(struct vb2_queue *queue, unsigned int count)
+static int
+sun4i_csi1_pad_mbus_code_enumerate(struct v4l2_subdev *subdev,
+				   struct v4l2_subdev_pad_config *config,
+				   struct v4l2_subdev_mbus_code_enum *code)
 {
-	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
-	int ret;
+	struct sun4i_csi1 *csi = v4l2_get_subdevdata(subdev);
 
 	dev_info(csi->dev, "%s();\n", __func__);
 
-	ret =  sun4i_csi1_poweron(csi);
-	if (ret)
-		return ret;
-	csi->powered = true;
+	if (code->index)
+		return -EINVAL;
 
-	sun4i_registers_print(csi);
+	code->code = sun4i_csi1_input_mbus_code(csi->input_mode);
 
-	sun4i_csi1_engine_start(csi);
+	return 0;
+}
 
-	dev_info(csi->dev, "After engine start:\n");
+static int sun4i_csi1_pad_format_get(struct v4l2_subdev *subdev,
+				     struct v4l2_subdev_pad_config *config,
+				     struct v4l2_subdev_format *format)
+{
+	struct sun4i_csi1 *csi = v4l2_get_subdevdata(subdev);
 
-	sun4i_registers_print(csi);
+	dev_info(csi->dev, "%s(%d);\n", __func__, format->pad);
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY)
+		format->format = *v4l2_subdev_get_try_format(subdev, config,
+							     format->pad);
+	else
+		sun4i_csi1_mbus_format_fill(csi, format->pad, &format->format);
 
 	return 0;
 }
 
-static void sun4i_csi1_buffers_mark_done(struct vb2_queue *queue)
+static int sun4i_csi1_pad_format_set(struct v4l2_subdev *subdev,
+				     struct v4l2_subdev_pad_config *config,
+				     struct v4l2_subdev_format *format)
 {
-	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
-	int i;
+	struct sun4i_csi1 *csi = v4l2_get_subdevdata(subdev);
 
-	dev_info(csi->dev, "%s(%d);\n", __func__, queue->num_buffers);
+	dev_info(csi->dev, "%s(%d);\n", __func__, format->pad);
 
-	for (i = 0; i < queue->num_buffers; i++) {
-		struct vb2_buffer *vb2_buffer = queue->bufs[i];
-		struct vb2_v4l2_buffer *v4l2_buffer =
-			to_vb2_v4l2_buffer(vb2_buffer);
-		struct sun4i_csi1_buffer *buffer =
-			container_of(v4l2_buffer, struct sun4i_csi1_buffer,
-				     v4l2_buffer);
-		unsigned long flags;
+	sun4i_csi1_mbus_format_fill(csi, format->pad, &format->format);
 
-		spin_lock_irqsave(csi->buffer_lock, flags);
-		list_del(&buffer->list);
-		spin_unlock_irqrestore(csi->buffer_lock, flags);
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY)
+		*v4l2_subdev_get_try_format(subdev, config, format->pad) =
+			format->format;
 
-		/* only disable active buffers, otherwise we get a WARN_ON() */
-		if (vb2_buffer->state == VB2_BUF_STATE_ACTIVE)
-			vb2_buffer_done(vb2_buffer, VB2_BUF_STATE_ERROR);
-	}
+	return 0;
 }
 
-static void sun4i_csi1_streaming_stop(struct vb2_queue *queue)
+static const struct v4l2_subdev_pad_ops sun4i_csi1_pad_ops = {
+	.init_cfg = sun4i_csi1_pad_config_initialize,
+	.enum_mbus_code = sun4i_csi1_pad_mbus_code_enumerate,
+	.get_fmt = sun4i_csi1_pad_format_get,
+	.set_fmt = sun4i_csi1_pad_format_set,
+	.link_validate = v4l2_subdev_link_validate_default,
+};
+
+static const struct v4l2_subdev_ops sun4i_csi1_entity_subdev_ops = {
+	.pad = &sun4i_csi1_pad_ops,
+};
+
+static const struct media_entity_operations sun4i_csi1_entity_media_ops = {
+	.link_validate = v4l2_subdev_link_validate,
+};
+
+static int sun4i_csi1_entity_initialize(struct sun4i_csi1 *csi)
 {
-	struct sun4i_csi1 *csi = vb2_get_drv_priv(queue);
+	struct v4l2_subdev *entity = csi->entity;
+	struct media_pad *pads = csi->entity_pads;
+	int ret;
 
-	dev_info(csi->dev, "%s();\n", __func__);
+	v4l2_subdev_init(entity, &sun4i_csi1_entity_subdev_ops);
+	v4l2_set_subdevdata(entity, csi);
+	entity->owner = THIS_MODULE;
+	entity->dev = csi->dev;
+	entity->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
+	snprintf(entity->name, sizeof(entity->name), "%s", dev_name(csi->dev));
 
-	sun4i_csi1_engine_stop(csi);
+	entity->entity.function = MEDIA_ENT_F_VID_IF_BRIDGE;
+	entity->entity.ops = &sun4i_csi1_entity_media_ops;
 
-	sun4i_registers_print(csi);
+	pads[SUN4I_CSI1_PAD_SINK].flags = MEDIA_PAD_FL_SINK;
+	pads[SUN4I_CSI1_PAD_SOURCE].flags = MEDIA_PAD_FL_SOURCE;
 
-	sun4i_csi1_buffers_mark_done(queue);
+	ret = media_entity_pads_init(&entity->entity, 2, pads);
+	if (ret) {
+		dev_err(csi->dev, "%s(): media_entity_pads_init() failed: %d\n",
+			__func__, ret);
+		return ret;
+	}
 
-	sun4i_csi1_buffer_list_clear(csi);
+	ret = v4l2_device_register_subdev(csi->v4l2_dev, entity);
+	if (ret) {
+		dev_err(csi->dev, "%s(): v4l2_device_register_subdev() failed:"
+			" %d\n", __func__, ret);
+		media_entity_cleanup(&entity->entity);
+		return ret;
+	}
 
-	sun4i_csi1_poweroff(csi);
-	csi->powered = false;
+	return 0;
 }
 
-static const struct vb2_ops sun4i_csi1_vb2_queue_ops = {
-	.queue_setup = sun4i_csi1_queue_setup,
-	.buf_prepare = sun4i_csi1_buffer_prepare,
-	.buf_queue = sun4i_csi1_buffer_queue,
-	.start_streaming = sun4i_csi1_streaming_start,
-	.stop_streaming = sun4i_csi1_streaming_stop,
-	.wait_prepare = vb2_ops_wait_prepare,
-	.wait_finish = vb2_ops_wait_finish,
-};
+static void sun4i_csi1_entity_free(struct sun4i_csi1 *csi)
+{
+	v4l2_device_unregister_subdev(csi->entity);
+	media_entity_cleanup(&csi->entity->entity);
+}
 
-static int sun4i_csi1_vb2_queue_initialize(struct sun4i_csi1 *csi)
+/*
+ * Check that the format of the video node matches what the csi entity
+ * hands us.
+ */
+static int sun4i_csi1_slashdev_link_validate(struct media_link *link)
 {
-	struct vb2_queue *queue = csi->vb2_queue;
+	struct video_device *slashdev =
+		media_entity_to_video_device(link->sink->entity);
+	struct sun4i_csi1 *csi = video_get_drvdata(slashdev);
+	struct v4l2_pix_format_mplane *pixel = &csi->v4l2_format->fmt.pix_mp;
+	struct v4l2_subdev_format format = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+		.pad = link->source->index,
+	};
+	struct v4l2_subdev *entity;
 	int ret;
 
-	queue->drv_priv = csi;
-	queue->dev = csi->dev;
-
-	queue->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	queue->io_modes = VB2_MMAP | VB2_DMABUF;
-	queue->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
-
-	queue->min_buffers_needed = 3;
-	queue->buf_struct_size = sizeof(struct sun4i_csi1_buffer);
+	dev_info(csi->dev, "%s();\n", __func__);
 
-	queue->ops = &sun4i_csi1_vb2_queue_ops;
-	queue->mem_ops = &vb2_dma_contig_memops;
+	if (!is_media_entity_v4l2_subdev(link->source->entity))
+		return -EINVAL;
+	entity = media_entity_to_v4l2_subdev(link->source->entity);
 
-	mutex_init(csi->vb2_queue_lock);
-	queue->lock = csi->vb2_queue_lock;
+	ret = v4l2_subdev_call(entity, pad, get_fmt, NULL, &format);
+	if (ret)
+		return ret;
 
-	spin_lock_init(csi->buffer_lock);
-	INIT_LIST_HEAD(csi->buffer_list);
+	if (format.format.code != sun4i_csi1_input_mbus_code(csi->input_mode)) {
+		dev_err(csi->dev, "%s(): mbus code 0x%04X does not fit %4.4s\n",
+			__func__, format.format.code,
+			(char *) &pixel->pixelformat);
+		return -EPIPE;
+	}
 
-	ret = vb2_queue_init(queue);
-	if (ret) {
-		dev_err(csi->dev, "%s(): vb2_queue_init() failed: %d\n",
-			__func__, ret);
-		mutex_destroy(csi->vb2_queue_lock);
-		return ret;
+	if ((format.format.width != pixel->width) ||
+	    (format.format.height != pixel->height)) {
+		dev_err(csi->dev, "%s(): %dx%d does not match %dx%d\n",
+			__func__, format.format.width, format.format.height,
+			pixel->width, pixel->height);
+		return -EPIPE;
 	}
 
 	return 0;
 }
 
-static void sun4i_csi1_vb2_queue_free(struct sun4i_csi1 *csi)
+static const struct media_entity_operations sun4i_csi1_slashdev_media_ops = {
+	.link_validate = sun4i_csi1_slashdev_link_validate,
+};
+
+static int sun4i_csi1_slashdev_initialize(struct sun4i_csi1 *csi)
 {
-	struct vb2_queue *queue = csi->vb2_queue;
+	struct video_device *slashdev = csi->slashdev;
+	int ret;
 
-	vb2_queue_release(queue);
-	sun4i_csi1_dummy_buffer_free(csi);
-	mutex_destroy(csi->vb2_queue_lock);
-}
+	video_set_drvdata(slashdev, csi);
+	strscpy(slashdev->name, KBUILD_MODNAME, sizeof(slashdev->name));
 
-static const struct v4l2_file_operations sun4i_csi1_slashdev_fops = {
-	.owner = THIS_MODULE,
-	.open = v4l2_fh_open,
-	.release = vb2_fop_release,
-	.unlocked_ioctl = video_ioctl2,
-	.mmap = vb2_fop_mmap,
-	.poll = vb2_fop_poll,
-};
+	slashdev->vfl_type = VFL_TYPE_GRABBER;
+	slashdev->vfl_dir = VFL_DIR_RX;
+	slashdev->device_caps = V4L2_CAP_STREAMING | V4L2_CAP_VIDEO_CAPTURE_MPLANE;
 
-static int sun4i_csi1_ioctl_capability_query(struct file *file, void *handle,
-					     struct v4l2_capability *capability)
-{
-	struct sun4i_csi1 *csi = video_drvdata(file);
+	slashdev->v4l2_dev = csi->v4l2_dev;
+	slashdev->queue = csi->vb2_queue;
+	slashdev->lock = csi->vb2_queue_lock;
 
-	dev_info(csi->dev, "%s();\n", __func__);
+	slashdev->release = video_device_release_empty;
+	slashdev->fops = &sun4i_csi1_slashdev_fops;
+	slashdev->ioctl_ops = &sun4i_csi1_ioctl_ops;
 
-	strscpy(capability->driver, "sun4i_csi1", sizeof(capability->driver));
-	strscpy(capability->card, csi->slashdev->name,
-		sizeof(capability->card));
+	csi->slashdev_pad->flags = MEDIA_PAD_FL_SINK | MEDIA_PAD_FL_MUST_CONNECT;
+	slashdev->entity.ops = &sun4i_csi1_slashdev_media_ops;
+	ret = media_entity_pads_init(&slashdev->entity, 1, csi->slashdev_pad);
+	if (ret) {
+		dev_err(csi->dev, "%s(): media_entity_pads_init() failed: %d\n",
+			__func__, ret);
+		return ret;
+	}
+
+	ret = video_register_device(slashdev, VFL_TYPE_GRABBER, -1);
+	if (ret) {
+		dev_err(csi->dev, "%s(): video_register_device failed: %d\n",
+			__func__, ret);
+		goto error;
+	}
 
-	snprintf(capability->bus_info, sizeof(capability->bus_info),
-		 "platform:%s", csi->dev->of_node->name);
+	ret = media_create_pad_link(&csi->entity->entity, SUN4I_CSI1_PAD_SOURCE,
+				    &slashdev->entity, 0,
+				    MEDIA_LNK_FL_ENABLED |
+				    MEDIA_LNK_FL_IMMUTABLE);
+	if (ret) {
+		dev_err(csi->dev, "%s(): media_create_pad_link() failed: %d\n",
+			__func__, ret);
+		video_unregister_device(slashdev);
+		goto error;
+	}
 
 	return 0;
+
+ error:
+	media_entity_cleanup(&slashdev->entity);
+	return ret;
 }
 
-static int sun4i_csi1_ioctl_format_enumerate(struct file *file, void *handle,
-					     struct v4l2_fmtdesc *descriptor)
+static void sun4i_csi1_slashdev_free(struct sun4i_csi1 *csi)
 {
-	struct sun4i_csi1 *csi = video_drvdata(file);
-
-	dev_info(csi->dev, "%s();\n", __func__);
-
-	if (descriptor->index > 0)
-		return -EINVAL;
-
-	descriptor->pixelformat = V4L2_PIX_FMT_RGB24;
+	struct video_device *slashdev = csi->slashdev;
 
-	return 0;
+	video_unregister_device(slashdev);
+	media_entity_cleanup(&slashdev->entity);
 }
 
-static int sun4i_csi1_ioctl_format_get(struct file *file, void *handle,
-			       struct v4l2_format *format)
+/*
+ * Have the adv7611 convert to YCbCr 4:2:2, and hand it to us over 16 bits.
+ */
+static int sun4i_csi1_subdev_format_set(struct sun4i_csi1 *csi)
 {
-	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct v4l2_subdev_format format = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+		.pad = csi->subdev_pad,
+		.format.code = MEDIA_BUS_FMT_YUYV8_1X16,
+	};
+	int ret;
 
-	dev_info(csi->dev, "%s();\n", __func__);
+	ret = v4l2_subdev_call(csi->subdev, pad, set_fmt, NULL, &format);
+	if (ret) {
+		dev_err(csi->dev, "%s(): set_fmt failed: %d\n", __func__, ret);
+		return ret;
+	}
 
-	*format = csi->v4l2_format[0];
+	if (format.format.code != MEDIA_BUS_FMT_YUYV8_1X16) {
+		dev_err(csi->dev, "%s(): wrong bus format: 0x%04X\n",
+			__func__, format.format.code);
+		return -EINVAL;
+	}
 
 	return 0;
 }
 
-static int sun4i_csi1_format_test(struct sun4i_csi1 *csi,
-				  struct v4l2_format *format_new)
+static int sun4i_csi1_subdev_bound(struct v4l2_async_notifier *notifier,
+				   struct v4l2_subdev *subdev,
+				   struct v4l2_async_subdev *asd)
 {
-	struct v4l2_pix_format_mplane *old = &csi->v4l2_format->fmt.pix_mp;
-	struct v4l2_pix_format_mplane *new = &format_new->fmt.pix_mp;
-	int i;
+	struct sun4i_csi1 *csi =
+		container_of(notifier, struct sun4i_csi1, notifier[0]);
+	struct v4l2_dv_timings timings;
+	int pad, ret;
+
+	dev_info(csi->dev, "%s(%s);\n", __func__, subdev->name);
+
+	pad = media_entity_get_fwnode_pad(&subdev->entity, subdev->fwnode,
+					  MEDIA_PAD_FL_SOURCE);
+	if (pad < 0) {
+		dev_err(csi->dev, "%s(): %s has no source pad.\n",
+			__func__, subdev->name);
+		return pad;
+	}
 
-	if (csi->v4l2_format->type != format_new->type)
-		return -EINVAL;
+	mutex_lock(csi->vb2_queue_lock);
 
-	if ((csi->width != new->width) ||
-	    (csi->height != new->height) ||
-	    (csi->plane_count != new->num_planes))
-		return -EINVAL;
+	/* we are about to change the format underneath userspace. */
+	if (vb2_is_busy(csi->vb2_queue)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
 
-	for (i = 0; i < csi->plane_count; i++) {
-		struct v4l2_plane_pix_format *plane = &new->plane_fmt[i];
+	csi->subdev = subdev;
+	csi->subdev_pad = pad;
 
-		if ((csi->width != plane->bytesperline) ||
-		    (csi->plane_size != plane->sizeimage))
-			return -EINVAL;
+	ret = sun4i_csi1_subdev_format_set(csi);
+	if (ret) {
+		csi->subdev = NULL;
+		goto unlock;
 	}
 
-	if ((old->pixelformat != new->pixelformat) ||
-	    (old->field != new->field) ||
-	    (old->colorspace != new->colorspace) ||
-	    (old->quantization != new->quantization) ||
-	    (old->xfer_func != new->xfer_func))
-		return -EINVAL;
+	ret = media_create_pad_link(&subdev->entity, pad,
+				    &csi->entity->entity, SUN4I_CSI1_PAD_SINK,
+				    MEDIA_LNK_FL_ENABLED |
+				    MEDIA_LNK_FL_IMMUTABLE);
+	if (ret) {
+		dev_err(csi->dev, "%s(): media_create_pad_link() failed: %d\n",
+			__func__, ret);
+		csi->subdev = NULL;
+		goto unlock;
+	}
 
-	return 0;
+	sun4i_csi1_input_mode_set(csi, SUN4I_CSI1_INPUT_YUV422_16BIT);
+
+	/* start off with whatever the adv7611 currently has. */
+	if (!v4l2_subdev_call(subdev, video, g_dv_timings, &timings))
+		sun4i_csi1_timings_update(csi, &timings);
+
+ unlock:
+	mutex_unlock(csi->vb2_queue_lock);
+	return ret;
 }
 
-static int sun4i_csi1_ioctl_format_set(struct file *file, void *handle,
-				       struct v4l2_format *format)
+static void sun4i_csi1_subdev_unbind(struct v4l2_async_notifier *notifier,
+				     struct v4l2_subdev *subdev,
+				     struct v4l2_async_subdev *asd)
 {
-	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct sun4i_csi1 *csi =
+		container_of(notifier, struct sun4i_csi1, notifier[0]);
 
-	dev_info(csi->dev, "%s();\n", __func__);
+	dev_info(csi->dev, "%s(%s);\n", __func__, subdev->name);
 
-	return sun4i_csi1_format_test(csi, format);
-}
+	mutex_lock(csi->vb2_queue_lock);
 
-static int sun4i_csi1_ioctl_format_try(struct file *file, void *handle,
-				       struct v4l2_format *format)
-{
-	struct sun4i_csi1 *csi = video_drvdata(file);
+	csi->subdev = NULL;
 
-	dev_info(csi->dev, "%s();\n", __func__);
+	/*
+	 * The buffers that are out there were sized for the adv7611, so
+	 * when busy, the format table of the emulated input only takes over
+	 * at the next S_FMT, which checks them against the new format.
+	 */
+	if (!vb2_is_busy(csi->vb2_queue))
+		sun4i_csi1_input_mode_set(csi,
+					  sun4i_csi1_input_mode_wanted(csi));
 
-	return sun4i_csi1_format_test(csi, format);
+	mutex_unlock(csi->vb2_queue_lock);
 }
 
-static int sun4i_csi1_ioctl_input_enumerate(struct file *file, void *handle,
-					    struct v4l2_input *input)
+static int sun4i_csi1_subdev_complete(struct v4l2_async_notifier *notifier)
 {
-	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct sun4i_csi1 *csi =
+		container_of(notifier, struct sun4i_csi1, notifier[0]);
+
+	int ret;
 
 	dev_info(csi->dev, "%s();\n", __func__);
 
-	if (input->index)
-		return -EINVAL;
+	/* so that the edid can also be handled through the usual tools. */
+	ret = v4l2_device_register_subdev_nodes(csi->v4l2_dev);
+	if (ret)
+		return ret;
 
-	strscpy(input->name, "direct", sizeof(input->name));
-	input->type = V4L2_INPUT_TYPE_CAMERA;
+	/* we get here again when the adv7611 returns after an unbind. */
+	if (media_devnode_is_registered(csi->media_dev->devnode))
+		return 0;
 
-	return 0;
+	return media_device_register(csi->media_dev);
 }
 
-static int sun4i_csi1_ioctl_input_set(struct file *file, void *handle,
-				      unsigned int input)
-{
-	struct sun4i_csi1 *csi = video_drvdata(file);
-
-	dev_info(csi->dev, "%s();\n", __func__);
+static const struct v4l2_async_notifier_operations sun4i_csi1_notifier_ops = {
+	.bound = sun4i_csi1_subdev_bound,
+	.unbind = sun4i_csi1_subdev_unbind,
+	.complete = sun4i_csi1_subdev_complete,
+};
 
-	if (input)
-		return -EINVAL;
+/*
+ * The adv7611 tells us about hotplug and source changes through events.
+ */
+static void sun4i_csi1_subdev_notify(struct v4l2_subdev *subdev,
+				     unsigned int notification, void *arg)
+{
+	struct sun4i_csi1 *csi =
+		container_of(subdev->v4l2_dev, struct sun4i_csi1, v4l2_dev[0]);
 
-	return 0;
+	if (notification == V4L2_DEVICE_NOTIFY_EVENT)
+		v4l2_event_queue(csi->slashdev, arg);
 }
 
-static int sun4i_csi1_ioctl_input_get(struct file *file, void *handle,
-				      unsigned int *input)
+static int sun4i_csi1_fwnode_parse(struct device *dev,
+				   struct v4l2_fwnode_endpoint *endpoint,
+				   struct v4l2_async_subdev *asd)
 {
-	struct sun4i_csi1 *csi = video_drvdata(file);
+	struct sun4i_csi1 *csi = dev_get_drvdata(dev);
 
-	dev_info(csi->dev, "%s();\n", __func__);
+	if (endpoint->base.port || endpoint->base.id) {
+		dev_warn(dev, "%s(): only a single endpoint is supported.\n",
+			 __func__);
+		return -ENOTCONN;
+	}
 
-	*input = 0;
+	if (endpoint->bus_type != V4L2_MBUS_PARALLEL) {
+		dev_err(dev, "%s(): only a parallel bus is supported.\n",
+			__func__);
+		return -ENOTCONN;
+	}
+
+	csi->bus_flags = endpoint->bus.parallel.flags;
 
 	return 0;
 }
 
-static const struct v4l2_ioctl_ops sun4i_csi1_ioctl_ops = {
-	.vidioc_querycap = sun4i_csi1_ioctl_capability_query,
-	.vidioc_enum_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_enumerate,
-	.vidioc_g_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_get,
-	.vidioc_s_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_set,
-	.vidioc_try_fmt_vid_cap_mplane = sun4i_csi1_ioctl_format_try,
-
-	.vidioc_enum_input = sun4i_csi1_ioctl_input_enumerate,
-	.vidioc_s_input = sun4i_csi1_ioctl_input_set,
-	.vidioc_g_input = sun4i_csi1_ioctl_input_get,
-
-	.vidioc_reqbufs = vb2_ioctl_reqbufs,
-	.vidioc_querybuf = vb2_ioctl_querybuf,
-	.vidioc_qbuf = vb2_ioctl_qbuf,
-	.vidioc_expbuf = vb2_ioctl_expbuf,
-	.vidioc_dqbuf = vb2_ioctl_dqbuf,
-	.vidioc_create_bufs = vb2_ioctl_create_bufs,
-	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
-	.vidioc_streamon = vb2_ioctl_streamon,
-	.vidioc_streamoff = vb2_ioctl_streamoff,
-
-	.vidioc_log_status = v4l2_ctrl_log_status,
-	.vidioc_subscribe_event = v4l2_ctrl_subscribe_event,
-	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
-};
-
-static int sun4i_csi1_slashdev_initialize(struct sun4i_csi1 *csi)
+/*
+ * Without an endpoint, this notifier completes straight away, and we keep
+ * on assuming a tfp401.
+ */
+static int sun4i_csi1_notifier_initialize(struct sun4i_csi1 *csi)
 {
-	struct video_device *slashdev = csi->slashdev;
+	struct v4l2_async_notifier *notifier = csi->notifier;
+	struct device *dev = csi->dev;
 	int ret;
 
-	video_set_drvdata(slashdev, csi);
-	strscpy(slashdev->name, KBUILD_MODNAME, sizeof(slashdev->name));
-
-	slashdev->vfl_type = VFL_TYPE_GRABBER;
-	slashdev->vfl_dir = VFL_DIR_RX;
-	slashdev->device_caps = V4L2_CAP_STREAMING | V4L2_CAP_VIDEO_CAPTURE_MPLANE;
+	v4l2_async_notifier_init(notifier);
 
-	slashdev->v4l2_dev = csi->v4l2_dev;
-	slashdev->queue = csi->vb2_queue;
-	slashdev->lock = csi->vb2_queue_lock;
+	ret = v4l2_async_notifier_parse_fwnode_endpoints(dev, notifier,
+					sizeof(struct v4l2_async_subdev),
+					sun4i_csi1_fwnode_parse);
+	if (ret) {
+		dev_err(dev, "%s(): endpoint parsing failed: %d\n",
+			__func__, ret);
+		goto error;
+	}
 
-	slashdev->release = video_device_release_empty;
-	slashdev->fops = &sun4i_csi1_slashdev_fops;
-	slashdev->ioctl_ops = &sun4i_csi1_ioctl_ops;
+	notifier->ops = &sun4i_csi1_notifier_ops;
 
-	ret = video_register_device(slashdev, VFL_TYPE_GRABBER, -1);
+	ret = v4l2_async_notifier_register(csi->v4l2_dev, notifier);
 	if (ret) {
-		dev_err(csi->dev, "%s(): video_register_device failed: %d\n",
+		dev_err(dev, "%s(): notifier registration failed: %d\n",
 			__func__, ret);
-		return ret;
+		goto error;
 	}
 
 	return 0;
+
+ error:
+	v4l2_async_notifier_cleanup(notifier);
+	return ret;
 }
 
-static void sun4i_csi1_slashdev_free(struct sun4i_csi1 *csi)
+static void sun4i_csi1_notifier_free(struct sun4i_csi1 *csi)
 {
-	struct video_device *slashdev = csi->slashdev;
-
-	video_unregister_device(slashdev);
+	v4l2_async_notifier_unregister(csi->notifier);
+	v4l2_async_notifier_cleanup(csi->notifier);
 }
 
+static const struct media_device_ops sun4i_csi1_media_ops = {
+	.req_validate = vb2_request_validate,
+	.req_queue = vb2_request_queue,
+};
+
 static int sun4i_csi1_v4l2_initialize(struct sun4i_csi1 *csi)
 {
 	struct device *dev = csi->dev;
+	struct v4l2_dv_timings timings = V4L2_DV_BT_CEA_1280X720P60;
+	int hdisplay_start, vdisplay_start;
 	int ret;
 
+	csi->media_dev->dev = dev;
+	strscpy(csi->media_dev->model, "Allwinner A10/A20 CSI1",
+		sizeof(csi->media_dev->model));
+	csi->media_dev->ops = &sun4i_csi1_media_ops;
+	snprintf(csi->media_dev->bus_info, sizeof(csi->media_dev->bus_info),
+		 "platform:%s", dev_name(dev));
+	media_device_init(csi->media_dev);
+
+	csi->v4l2_dev->mdev = csi->media_dev;
 	ret = v4l2_device_register(dev, csi->v4l2_dev);
 	if (ret) {
 		dev_err(dev, "%s(): v4l2_device_register() failed: %d.\n",
 			__func__, ret);
+		media_device_cleanup(csi->media_dev);
 		return ret;
 	}
+	csi->v4l2_dev->notify = sun4i_csi1_subdev_notify;
 
-	/*
-	 * vesa 640x480@60Hz: 640 656 752 800  480 490 492 525
-	 * xtotal - xsync_start = xdisplay_start
-	 * h: 800 - 656 = 144
-	 * v: 525 - 492 = 33
-	 *
-	 * hacked 1024x600:
-	 * Modeline "1024x600_60.00"   57.00  1024 1221 1319 1361  600 663 683 686 -hsync -vsync
-	 * h: 1361 - 1221: 140
-	 * v: 686 - 663: 23
-	 * Experimental values, for the tfp401: h: 61, v: 3
-	 *
-	 * 1920x1080:
-	 * Modeline "1920x1080_60.00"  148.50  1920 2008 2052 2200  1080 1084 1089 1125 +hsync +vsync
-	 * h: 2200 - 2008: 192
-	 * v: 1125 - 1084: 41
-	 * Experimental values, for the tfp401: h: 148, v: 36
-	 *
-	 * 1280x720, the standard modeline is:
-	 *  ModeLine "1280x720_60.00"	74.25	1280 1390 1430 1650  720 725 730 750 +hSync +vSync
-	 * But the tfp401 accepts:
-	 *  ModeLine "1280x720_60.00"	74.5    1280 1390 1430 1652  720 725 730 752 +hSync +vSync
-	 * h: 1650 - 1390: 260
-	 * v: 750 - 725: 25
-	 *  Experimental values, for the tfp401: h: 216, v: 22
-	 */
-	sun4i_csi1_format_initialize(csi, 1280, 720, false, false);
+	sun4i_csi1_format_initialize(csi, &timings);
+
+	sun4i_csi1_display_start_get(csi, &timings.bt, &hdisplay_start,
+				     &vdisplay_start);
 
-	ret =  sun4i_csi1_ctrl_handler_initialize(csi, 216, 22);
+	/* each of these cleans up after itself when it fails. */
+	ret =  sun4i_csi1_ctrl_handler_initialize(csi, hdisplay_start,
+						  vdisplay_start);
 	if (ret)
-		goto error;
+		goto error_v4l2;
 
 	ret = sun4i_csi1_vb2_queue_initialize(csi);
 	if (ret)
-		goto error;
+		goto error_ctrl;
+
+	ret = sun4i_csi1_entity_initialize(csi);
+	if (ret)
+		goto error_vb2;
 
 	ret = sun4i_csi1_slashdev_initialize(csi);
 	if (ret)
-		goto error;
+		goto error_entity;
+
+	ret = sun4i_csi1_notifier_initialize(csi);
+	if (ret)
+		goto error_slashdev;
 
 	return 0;
 
- error:
+ error_slashdev:
+	sun4i_csi1_slashdev_free(csi);
+ error_entity:
+	sun4i_csi1_entity_free(csi);
+ error_vb2:
 	sun4i_csi1_vb2_queue_free(csi);
+ error_ctrl:
+	sun4i_csi1_ctrl_handler_free(csi);
+ error_v4l2:
 	v4l2_device_unregister(csi->v4l2_dev);
+	media_device_cleanup(csi->media_dev);
 	return ret;
 }
 
 static int sun4i_csi1_v4l2_cleanup(struct sun4i_csi1 *csi)
 {
+	media_device_unregister(csi->media_dev);
+	sun4i_csi1_notifier_free(csi);
 	sun4i_csi1_slashdev_free(csi);
+	sun4i_csi1_entity_free(csi);
 	sun4i_csi1_vb2_queue_free(csi);
 	sun4i_csi1_ctrl_handler_free(csi);
 	v4l2_device_unregister(csi->v4l2_dev);
+	media_device_cleanup(csi->media_dev);
+
+	return 0;
+}
+
+static int sun4i_csi1_debugfs_isr_stats_show(struct seq_file *file,
+					     void *data)
+{
+	struct sun4i_csi1 *csi = file->private;
+	struct isr_stats stats = csi->isr_stats[0];
+
+	seq_printf(file, "frames: %llu\n", stats.count);
+	seq_printf(file, "last: %lluns\n", stats.last);
+	seq_printf(file, "max: %lluns\n", stats.max);
+	seq_printf(file, "average: %lluns\n", stats.count ?
+		   div64_u64(stats.total, stats.count) : 0);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(sun4i_csi1_debugfs_isr_stats);
+
+/*
+ * debugfs failures are not fatal, so we do not bother checking.
+ */
+static void sun4i_csi1_debugfs_initialize(struct sun4i_csi1 *csi)
+{
+	csi->debugfs = debugfs_create_dir(dev_name(csi->dev), NULL);
+
+	debugfs_create_file("isr_stats", 0444, csi->debugfs, csi,
+			    &sun4i_csi1_debugfs_isr_stats_fops);
+	debugfs_create_u64("frames_dropped", 0444, csi->debugfs,
+			   &csi->frames_dropped);
+	debugfs_create_u64("frames_missed", 0444, csi->debugfs,
+			   &csi->frames_missed);
+	vb2_queue_stats_create(csi->vb2_queue, "vb2_stats", csi->debugfs);
+}
+
+static void sun4i_csi1_debugfs_free(struct sun4i_csi1 *csi)
+{
+	vb2_queue_stats_remove(csi->vb2_queue);
+	debugfs_remove_recursive(csi->debugfs);
+	csi->debugfs = NULL;
+}
 
 static int sun4i_csi1_probe(struct platform_device *platform_dev)
 {
@@ -1287,7 +4707,11 @@ static int sun4i_csi1_probe(struct platform_device *platform_dev)
 		return -ENOMEM;
 	csi->dev = dev;
 
-	ret = sun4i_csi1_resources_get(csi, platform_dev);
+	/* only the emulated device comes through our id table. */
+	if (platform_get_device_id(platform_dev))
+		ret = sun4i_csi1_emulation_resources_get(csi);
+	else
+		ret = sun4i_csi1_resources_get(csi, platform_dev);
 	if (ret)
 		return ret;
 
@@ -1297,6 +4721,14 @@ static int sun4i_csi1_probe(struct platform_device *platform_dev)
 	if (ret)
 		return ret;
 
+	ret = sun4i_csi1_emulation_start(csi);
+	if (ret) {
+		sun4i_csi1_v4l2_cleanup(csi);
+		return ret;
+	}
+
+	sun4i_csi1_debugfs_initialize(csi);
+
 	return 0;
 }
 
@@ -1308,6 +4740,10 @@ static int sun4i_csi1_remove(struct platform_device *platform_dev)
 
 	dev_info(dev, "%s();\n", __func__);
 
+	sun4i_csi1_debugfs_free(csi);
+
+	sun4i_csi1_emulation_stop(csi);
+
 	ret = sun4i_csi1_v4l2_cleanup(csi);
 	if (ret)
 		return ret;
@@ -1323,16 +4759,65 @@ static const struct of_device_id sun4i_csi1_of_match[] = {
 };
 MODULE_DEVICE_TABLE(of, sun4i_csi1_of_match);
 
+#ifdef CONFIG_VIDEO_SUN4I_CSI1_EMULATION
+static const struct platform_device_id sun4i_csi1_emulation_ids[] = {
+	{ .name = SUN4I_CSI1_EMULATION_NAME, },
+	{},
+};
+#endif
+
 static struct platform_driver sun4i_csi1_platform_driver = {
 	.probe = sun4i_csi1_probe,
 	.remove = sun4i_csi1_remove,
+#ifdef CONFIG_VIDEO_SUN4I_CSI1_EMULATION
+	.id_table = sun4i_csi1_emulation_ids,
+#endif
 	.driver = {
 		.name = MODULE_NAME,
 		.of_match_table = of_match_ptr(sun4i_csi1_of_match),
 		.pm = &sun4i_csi1_pm_ops,
 	},
 };
+
+#ifdef CONFIG_VIDEO_SUN4I_CSI1_EMULATION
+/*
+ * Besides whatever the device tree gives us, we always instantiate one
+ * emulated device.
+ */
+static struct platform_device *sun4i_csi1_emulation_device;
+
+static int __init sun4i_csi1_module_init(void)
+{
+	struct platform_device_info info = {
+		.name = SUN4I_CSI1_EMULATION_NAME,
+		.id = PLATFORM_DEVID_NONE,
+		.dma_mask = DMA_BIT_MASK(32),
+	};
+	int ret;
+
+	ret = platform_driver_register(&sun4i_csi1_platform_driver);
+	if (ret)
+		return ret;
+
+	sun4i_csi1_emulation_device = platform_device_register_full(&info);
+	if (IS_ERR(sun4i_csi1_emulation_device)) {
+		platform_driver_unregister(&sun4i_csi1_platform_driver);
+		return PTR_ERR(sun4i_csi1_emulation_device);
+	}
+
+	return 0;
+}
+module_init(sun4i_csi1_module_init);
+
+static void __exit sun4i_csi1_module_exit(void)
+{
+	platform_device_unregister(sun4i_csi1_emulation_device);
+	platform_driver_unregister(&sun4i_csi1_platform_driver);
+}
+module_exit(sun4i_csi1_module_exit);
+#else
 module_platform_driver(sun4i_csi1_platform_driver);
+#endif /* CONFIG_VIDEO_SUN4I_CSI1_EMULATION */
 
 MODULE_DESCRIPTION("Allwinner A10/A20 CMOS Sensor Interface 1 V4L2 driver");
 MODULE_AUTHOR("Luc Verhaegen <libv@skynet.be>");
@@ -512,6 +512,14 @@ static void v4l_print_exportbuffer(const void *arg, bool write_only)
 		p->index, p->plane, p->flags);
 }
 
+static void v4l_print_dqbuf_batch(const void *arg, bool write_only)
+{
+	const struct v4l2_dqbuf_batch *p = arg;
+
+	pr_cont("type=%s, count=%u\n",
+		prt_names(p->type, v4l2_type_names), p->count);
+}
+
 static void v4l_print_create_buffers(const void *arg, bool write_only)
 {
 	const struct v4l2_create_buffers *p = arg;
@@ -1960,6 +1968,15 @@ static int v4l_dqbuf(const struct v4l2_ioctl_ops *ops,
 	return ret ? ret : ops->vidioc_dqbuf(file, fh, p);
 }
 
+static int v4l_dqbuf_batch(const struct v4l2_ioctl_ops *ops,
+				struct file *file, void *fh, void *arg)
+{
+	struct v4l2_dqbuf_batch *p = arg;
+	int ret = check_fmt(file, p->type);
+
+	return ret ? ret : ops->vidioc_dqbuf_batch(file, fh, p);
+}
+
 static int v4l_create_bufs(const struct v4l2_ioctl_ops *ops,
 				struct file *file, void *fh, void *arg)
 {
@@ -2732,6 +2749,7 @@ static const struct v4l2_ioctl_info v4l2_ioctls[] = {
 	IOCTL_INFO(VIDIOC_ENUM_FREQ_BANDS, v4l_enum_freq_bands, v4l_print_freq_band, 0),
 	IOCTL_INFO(VIDIOC_DBG_G_CHIP_INFO, v4l_dbg_g_chip_info, v4l_print_dbg_chip_info, INFO_FL_CLEAR(v4l2_dbg_chip_info, match)),
 	IOCTL_INFO(VIDIOC_QUERY_EXT_CTRL, v4l_query_ext_ctrl, v4l_print_query_ext_ctrl, INFO_FL_CTRL | INFO_FL_CLEAR(v4l2_query_ext_ctrl, id)),
+	IOCTL_INFO(VIDIOC_DQBUF_BATCH, v4l_dqbuf_batch, v4l_print_dqbuf_batch, INFO_FL_QUEUE | INFO_FL_CLEAR(v4l2_dqbuf_batch, count)),
 };
 #define V4L2_IOCTLS ARRAY_SIZE(v4l2_ioctls)
 
@@ -2882,7 +2900,8 @@ static long __video_do_ioctl(struct file *file,
 done:
 	if (dev_debug & (V4L2_DEV_DEBUG_IOCTL | V4L2_DEV_DEBUG_IOCTL_ARG)) {
 		if (!(dev_debug & V4L2_DEV_DEBUG_STREAMING) &&
-		    (cmd == VIDIOC_QBUF || cmd == VIDIOC_DQBUF))
+		    (cmd == VIDIOC_QBUF || cmd == VIDIOC_DQBUF ||
+		     cmd == VIDIOC_DQBUF_BATCH))
 			goto unlock;
 
 		v4l_printk_ioctl(video_device_node_name(vfd), cmd);
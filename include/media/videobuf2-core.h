@@ -16,7 +16,10 @@
 #include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/dma-buf.h>
+#include <linux/dma-fence.h>
 #include <linux/bitops.h>
+#include <linux/llist.h>
+#include <linux/hrtimer.h>
 #include <media/media-request.h>
 
 #define VB2_MAX_FRAME	(32)
@@ -45,6 +48,8 @@ enum vb2_memory {
 
 struct vb2_fileio_data;
 struct vb2_threadio_data;
+struct vb2_stats;
+struct dentry;
 
 /**
  * struct vb2_mem_ops - memory handling/memory allocator operations.
@@ -166,6 +171,11 @@ struct vb2_mem_ops {
  *		descriptor associated with this plane.
  * @data_offset:	offset in the plane to the start of data; usually 0,
  *		unless there is a header in front of the data.
+ * @dbuf_exported:	when memory is %VB2_MEMORY_MMAP, the dma_buf that
+ *		this plane was first exported as. Further exports with the
+ *		same access mode hand out this same dma_buf, and out-fences
+ *		get attached to its reservation object.
+ * @dbuf_exported_flags:	access mode of @dbuf_exported.
  *
  * Should contain enough information to be able to cover all the fields
  * of &struct v4l2_plane at videodev2.h.
@@ -183,6 +193,8 @@ struct vb2_plane {
 		int		fd;
 	} m;
 	unsigned int		data_offset;
+	struct dma_buf		*dbuf_exported;
+	unsigned int		dbuf_exported_flags;
 };
 
 /**
@@ -262,20 +274,48 @@ struct vb2_buffer {
 	 *			after the 'buf_finish' op is called.
 	 * copied_timestamp:	the timestamp of this capture buffer was copied
 	 *			from an output buffer.
+	 * skip_cache_sync_on_prepare: userspace did not write to this
+	 *			buffer with the cpu, so the 'prepare' memop is
+	 *			not called.
+	 * skip_cache_sync_on_finish: userspace will not read this buffer
+	 *			with the cpu, so the 'finish' memop is not
+	 *			called.
+	 * out_fence_requested:	userspace asked for an out-fence fd with this
+	 *			qbuf.
+	 * out_fence:		signalled once the driver is done with this
+	 *			buffer; set from qbuf until then.
+	 * out_fence_fd:	sync_file fd of out_fence, still to be handed
+	 *			to userspace, or -1.
+	 * out_fence_context:	dma_fence context of the out-fences of this
+	 *			buffer. Buffers do not necessarily complete in
+	 *			the order they were queued in, so each has its
+	 *			own timeline.
+	 * out_fence_seqno:	seqno of the last out-fence of this buffer.
 	 * queued_entry:	entry on the queued buffers list, which holds
 	 *			all buffers queued from userspace
 	 * done_entry:		entry on the list that stores all buffers ready
 	 *			to be dequeued to userspace
+	 * done_llnode:		entry on the lock-free list that
+	 *			vb2_buffer_done() pushes to, until a reader
+	 *			moves it over to the done list.
 	 * vb2_plane:		per-plane information; do not change
 	 */
 	enum vb2_buffer_state	state;
 	unsigned int		synced:1;
 	unsigned int		prepared:1;
 	unsigned int		copied_timestamp:1;
+	unsigned int		skip_cache_sync_on_prepare:1;
+	unsigned int		skip_cache_sync_on_finish:1;
+	unsigned int		out_fence_requested:1;
+	struct dma_fence	*out_fence;
+	int			out_fence_fd;
+	u64			out_fence_context;
+	unsigned int		out_fence_seqno;
 
 	struct vb2_plane	planes[VB2_MAX_PLANES];
 	struct list_head	queued_entry;
 	struct list_head	done_entry;
+	struct llist_node	done_llnode;
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 	/*
 	 * Counters for how often these buffer-related ops are
@@ -484,6 +524,12 @@ struct vb2_buf_ops {
  * @supports_requests: this queue supports the Request API.
  * @requires_requests: this queue requires the Request API. If this is set to 1,
  *		then supports_requests must be set to 1 as well.
+ * @supports_out_fences: this queue hands out out-fences, and attaches them
+ *		to the reservation objects of the dma-bufs behind its capture
+ *		buffers. Exported planes are then kept, see vb2_core_expbuf().
+ * @allow_cache_hints: honour V4L2_BUF_FLAG_NO_CACHE_CLEAN and
+ *		V4L2_BUF_FLAG_NO_CACHE_INVALIDATE, and skip the cache
+ *		maintenance of buffers that the cpu does not touch.
  * @uses_qbuf:	qbuf was used directly for this queue. Set to 1 the first
  *		time this is called. Set to 0 when the queue is canceled.
  *		If this is 1, then you cannot queue buffers from a request.
@@ -517,6 +563,13 @@ struct vb2_buf_ops {
  *		@start_streaming can be called. Used when a DMA engine
  *		cannot be started unless at least this number of buffers
  *		have been queued into the driver.
+ * @done_wake_batch: wake up waiters once per this many finished buffers,
+ *		instead of for every single one. 0 or 1 keeps the wakeup per
+ *		buffer.
+ * @done_wake_delay_us: when @done_wake_batch is used, the longest time in
+ *		microseconds that a finished buffer waits for the rest of its
+ *		batch before waiters are woken up anyway. Must be set along
+ *		with @done_wake_batch.
  */
 /*
  * Private elements (won't appear at the uAPI book):
@@ -530,6 +583,10 @@ struct vb2_buf_ops {
  * @owned_by_drv_count: number of buffers owned by the driver
  * @done_list:	list of buffers ready to be dequeued to userspace
  * @done_lock:	lock to protect done_list list
+ * @done_llist:	buffers finished by the driver, not yet moved to @done_list.
+ *		Filled without locking, from any context.
+ * @done_wake_pending: finished buffers not yet announced on @done_wq
+ * @done_wake_timer: announces a partial batch after @done_wake_delay_us
  * @done_wq:	waitqueue for processes waiting for buffers ready to be dequeued
  * @streaming:	current streaming state
  * @start_streaming_called: @start_streaming was called successfully and we
@@ -546,6 +603,7 @@ struct vb2_buf_ops {
  *		when a buffer with the %V4L2_BUF_FLAG_LAST is dequeued.
  * @fileio:	file io emulator internal data, used only if emulator is active
  * @threadio:	thread io internal data, used only if thread is active
+ * @stats:	latency statistics, see vb2_queue_stats_create()
  */
 struct vb2_queue {
 	unsigned int			type;
@@ -559,6 +617,8 @@ struct vb2_queue {
 	unsigned		   quirk_poll_must_check_waiting_for_buffers:1;
 	unsigned			supports_requests:1;
 	unsigned			requires_requests:1;
+	unsigned			supports_out_fences:1;
+	unsigned			allow_cache_hints:1;
 	unsigned			uses_qbuf:1;
 	unsigned			uses_requests:1;
 
@@ -574,6 +634,8 @@ struct vb2_queue {
 	u32				timestamp_flags;
 	gfp_t				gfp_flags;
 	u32				min_buffers_needed;
+	unsigned int			done_wake_batch;
+	unsigned int			done_wake_delay_us;
 
 	struct device			*alloc_devs[VB2_MAX_PLANES];
 
@@ -590,7 +652,10 @@ struct vb2_queue {
 	atomic_t			owned_by_drv_count;
 	struct list_head		done_list;
 	spinlock_t			done_lock;
+	struct llist_head		done_llist;
 	wait_queue_head_t		done_wq;
+	atomic_t			done_wake_pending;
+	struct hrtimer			done_wake_timer;
 
 	unsigned int			streaming:1;
 	unsigned int			start_streaming_called:1;
@@ -605,6 +670,8 @@ struct vb2_queue {
 	struct vb2_fileio_data		*fileio;
 	struct vb2_threadio_data	*threadio;
 
+	struct vb2_stats		*stats;
+
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 	/*
 	 * Counters for how often these queue-related ops are
@@ -679,6 +746,52 @@ void vb2_buffer_done(struct vb2_buffer *vb, enum vb2_buffer_state state);
  */
 void vb2_discard_done(struct vb2_queue *q);
 
+/**
+ * vb2_done_list_collect() - move finished buffers over to the done list.
+ * @q:		pointer to &struct vb2_queue with videobuf2 queue.
+ *
+ * vb2_buffer_done() does not touch &vb2_queue->done_list, it queues the
+ * buffer locklessly instead. Drivers that look at the done list themselves,
+ * under &vb2_queue->done_lock, must call this first to see all finished
+ * buffers, in order.
+ */
+void vb2_done_list_collect(struct vb2_queue *q);
+
+#ifdef CONFIG_VIDEOBUF2_STATS
+/**
+ * vb2_queue_stats_create() - start collecting latency statistics.
+ * @q:		pointer to &struct vb2_queue with videobuf2 queue.
+ * @name:	name of the debugfs file.
+ * @parent:	debugfs directory to create the file in.
+ *
+ * Keeps histograms of the time buffers of this queue spend between qbuf and
+ * the buf_queue op, between buf_queue and vb2_buffer_done(), and between
+ * vb2_buffer_done() and dqbuf, and of the number of buffers held by the
+ * driver and by userspace. They are read from the debugfs file, writing to
+ * it clears them.
+ *
+ * Must be balanced with vb2_queue_stats_remove().
+ */
+int vb2_queue_stats_create(struct vb2_queue *q, const char *name,
+			   struct dentry *parent);
+
+/**
+ * vb2_queue_stats_remove() - stop collecting latency statistics.
+ * @q:		pointer to &struct vb2_queue with videobuf2 queue.
+ */
+void vb2_queue_stats_remove(struct vb2_queue *q);
+#else
+static inline int vb2_queue_stats_create(struct vb2_queue *q, const char *name,
+					 struct dentry *parent)
+{
+	return 0;
+}
+
+static inline void vb2_queue_stats_remove(struct vb2_queue *q)
+{
+}
+#endif
+
 /**
  * vb2_wait_for_all_buffers() - wait until all buffers are given back to vb2.
  * @q:		pointer to &struct vb2_queue with videobuf2 queue.
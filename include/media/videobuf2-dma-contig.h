@@ -27,6 +27,9 @@ vb2_dma_contig_plane_dma_addr(struct vb2_buffer *vb, unsigned int plane_no)
 int vb2_dma_contig_set_max_seg_size(struct device *dev, unsigned int size);
 void vb2_dma_contig_clear_max_seg_size(struct device *dev);
 
+int vb2_dma_contig_pool_init(struct device *dev, unsigned long limit);
+void vb2_dma_contig_pool_cleanup(struct device *dev);
+
 extern const struct vb2_mem_ops vb2_dma_contig_memops;
 
 #endif
@@ -13,8 +13,19 @@
 #ifndef _MEDIA_VIDEOBUF2_DMA_SG_H
 #define _MEDIA_VIDEOBUF2_DMA_SG_H
 
+#include <linux/mmzone.h>
 #include <media/videobuf2-v4l2.h>
 
+/*
+ * VB2_DMA_SG_ATTR_CONTIGUOUS: for &vb2_queue.dma_attrs. Allocate each plane
+ * in one piece from the page allocator, for devices without an iommu which
+ * need contiguous planes, but which should not tie up CMA. This is not a
+ * DMA API attribute, and it never gets passed on as one. Planes are then
+ * limited to VB2_DMA_SG_CONTIGUOUS_MAX bytes.
+ */
+#define VB2_DMA_SG_ATTR_CONTIGUOUS	(1UL << 31)
+#define VB2_DMA_SG_CONTIGUOUS_MAX	(PAGE_SIZE << (MAX_ORDER - 1))
+
 static inline struct sg_table *vb2_dma_sg_plane_desc(
 		struct vb2_buffer *vb, unsigned int plane_no)
 {
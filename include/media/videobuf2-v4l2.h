@@ -181,6 +181,22 @@ int vb2_expbuf(struct vb2_queue *q, struct v4l2_exportbuffer *eb);
  */
 int vb2_dqbuf(struct vb2_queue *q, struct v4l2_buffer *b, bool nonblocking);
 
+/**
+ * vb2_dqbuf_batch() - Dequeue several buffers to the userspace at once
+ * @q:		pointer to &struct vb2_queue with videobuf2 queue.
+ * @batch:	batch structure passed from userspace to
+ *		&v4l2_ioctl_ops->vidioc_dqbuf_batch handler in driver
+ * @nonblocking: if true, this call will not sleep waiting for a buffer if no
+ *		 buffers ready for dequeuing are present. Normally the driver
+ *		 would be passing (&file->f_flags & %O_NONBLOCK) here
+ *
+ * Works like vb2_dqbuf(), for up to &v4l2_dqbuf_batch->count buffers. Only
+ * the first buffer is waited for, the others are only dequeued if they are
+ * ready already. Succeeds when at least one buffer was dequeued.
+ */
+int vb2_dqbuf_batch(struct vb2_queue *q, struct v4l2_dqbuf_batch *batch,
+		    bool nonblocking);
+
 /**
  * vb2_streamon - start streaming
  * @q:		pointer to &struct vb2_queue with videobuf2 queue.
@@ -281,6 +297,8 @@ int vb2_ioctl_prepare_buf(struct file *file, void *priv,
 int vb2_ioctl_querybuf(struct file *file, void *priv, struct v4l2_buffer *p);
 int vb2_ioctl_qbuf(struct file *file, void *priv, struct v4l2_buffer *p);
 int vb2_ioctl_dqbuf(struct file *file, void *priv, struct v4l2_buffer *p);
+int vb2_ioctl_dqbuf_batch(struct file *file, void *priv,
+			  struct v4l2_dqbuf_batch *p);
 int vb2_ioctl_streamon(struct file *file, void *priv, enum v4l2_buf_type i);
 int vb2_ioctl_streamoff(struct file *file, void *priv, enum v4l2_buf_type i);
 int vb2_ioctl_expbuf(struct file *file, void *priv,
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0+ WITH Linux-syscall-note */
+/*
+ * Allwinner A10/A20 CMOS Sensor Interface 1 - User-space API
+ *
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ */
+
+#ifndef _UAPI_LINUX_SUN4I_CSI1_H
+#define _UAPI_LINUX_SUN4I_CSI1_H
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/*
+ * Readers.
+ *
+ * Any file handle on the video node, other than the one owning the buffer
+ * queue, can become a reader. A reader gets handed every captured frame as
+ * well, and can export the buffers as dma-bufs, so several consumers can
+ * share a single capture stream without copying.
+ *
+ * A frame that is handed to a reader is held until the reader releases it,
+ * or until the reader drops it for a newer one. Held buffers are still
+ * dequeued to the queue owner as usual, but when it queues them again,
+ * they only go back to the engine once all readers are done with them.
+ *
+ * Each reader holds at most depth frames. When a new frame arrives and
+ * the reader is full, the oldest frame which it has not dequeued yet is
+ * dropped. VIDIOC_REQBUFS allocates the depth of all readers on top of
+ * the buffers that the queue owner needs, and a reader is refused when
+ * the buffers that already exist do not leave enough of them. A slow
+ * reader therefore never stalls the queue owner.
+ *
+ * VIDIOC_SUN4I_CSI1_READER_START: make this file handle a reader, of the
+ *	given depth. Returns -EBUSY when the allocated buffers, less the depth
+ *	of all readers, would be fewer than the queue owner needs.
+ * VIDIOC_SUN4I_CSI1_READER_EXPBUF: VIDIOC_EXPBUF, for readers. Only for
+ *	the index of a frame that is dequeued and not released yet, returns
+ *	-EBUSY otherwise. The flags are ignored, the dma-buf is always
+ *	O_RDONLY | O_CLOEXEC. It stays valid after the frame is released,
+ *	but whenever the buffer goes back to the engine, it gets an exclusive
+ *	fence which is signalled once the next frame is in. Anything that
+ *	touches it after the release has to wait for that fence, for instance
+ *	by poll()ing the dma-buf.
+ * VIDIOC_SUN4I_CSI1_READER_DQFRAME: take the oldest pending frame, returns
+ *	-EAGAIN when there is none. Use poll() to wait for frames.
+ * VIDIOC_SUN4I_CSI1_READER_RELEASE: hand back a dequeued frame by index.
+ */
+#define SUN4I_CSI1_READER_DEPTH_MAX	8
+
+struct sun4i_csi1_reader_frame {
+	__u32 index;
+	__u32 sequence;
+	__u32 field;
+	/* frames this reader lost since its previous dequeue. */
+	__u32 dropped;
+	/* in ns, CLOCK_MONOTONIC. */
+	__u64 timestamp;
+	__u32 reserved[4];
+};
+
+#define VIDIOC_SUN4I_CSI1_READER_START \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 0, __u32)
+#define VIDIOC_SUN4I_CSI1_READER_EXPBUF \
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 1, struct v4l2_exportbuffer)
+#define VIDIOC_SUN4I_CSI1_READER_DQFRAME \
+	_IOR('V', BASE_VIDIOC_PRIVATE + 2, struct sun4i_csi1_reader_frame)
+#define VIDIOC_SUN4I_CSI1_READER_RELEASE \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 3, __u32)
+
+#endif /* _UAPI_LINUX_SUN4I_CSI1_H */
@@ -914,6 +914,8 @@ struct v4l2_requestbuffers {
 #define V4L2_BUF_CAP_SUPPORTS_DMABUF	(1 << 2)
 #define V4L2_BUF_CAP_SUPPORTS_REQUESTS	(1 << 3)
 #define V4L2_BUF_CAP_SUPPORTS_ORPHANED_BUFS (1 << 4)
+#define V4L2_BUF_CAP_SUPPORTS_OUT_FENCES (1 << 5)
+#define V4L2_BUF_CAP_SUPPORTS_CACHE_HINTS (1 << 6)
 
 /**
  * struct v4l2_plane - plane info for multi-planar buffers
@@ -973,6 +975,8 @@ struct v4l2_plane {
  * @length:	size in bytes of the buffer (NOT its payload) for single-plane
  *		buffers (when type != *_MPLANE); number of elements in the
  *		planes array for multi-plane buffers
+ * @fence_fd:	out-fence sync_file fd, returned by VIDIOC_QBUF when
+ *		V4L2_BUF_FLAG_OUT_FENCE is set
  * @request_fd: fd of the request that this buffer should use
  *
  * Contains data exchanged by application and driver using one of the Streaming
@@ -997,7 +1001,10 @@ struct v4l2_buffer {
 		__s32		fd;
 	} m;
 	__u32			length;
-	__u32			reserved2;
+	union {
+		__s32		fence_fd;
+		__u32		reserved2;
+	};
 	union {
 		__s32		request_fd;
 		__u32		reserved;
@@ -1051,6 +1058,8 @@ static inline __u64 v4l2_timeval_to_ns(const struct timeval *tv)
 #define V4L2_BUF_FLAG_TSTAMP_SRC_SOE		0x00010000
 /* mem2mem encoder/decoder */
 #define V4L2_BUF_FLAG_LAST			0x00100000
+/* ask for, and return, an out-fence in fence_fd */
+#define V4L2_BUF_FLAG_OUT_FENCE			0x00400000
 /* request_fd is valid */
 #define V4L2_BUF_FLAG_REQUEST_FD		0x00800000
 
@@ -1081,6 +1090,46 @@ struct v4l2_exportbuffer {
 	__u32		reserved[11];
 };
 
+/**
+ * struct v4l2_dqbuf_batch_entry - one buffer dequeued by VIDIOC_DQBUF_BATCH
+ *
+ * @index:	id number of the buffer
+ * @flags:	buffer informational flags, as in &struct v4l2_buffer
+ * @field:	enum v4l2_field; field order of the image in the buffer
+ * @sequence:	sequence count of this frame
+ * @timestamp:	frame timestamp, in ns
+ * @bytesused:	number of bytes occupied by data in each plane
+ */
+struct v4l2_dqbuf_batch_entry {
+	__u32		index;
+	__u32		flags;
+	__u32		field;
+	__u32		sequence;
+	__u64		timestamp;
+	__u32		bytesused[VIDEO_MAX_PLANES];
+	__u32		reserved[2];
+};
+
+/**
+ * struct v4l2_dqbuf_batch - dequeue several buffers at once
+ *
+ * @type:	enum v4l2_buf_type; buffer type (type == *_MPLANE for
+ *		multiplanar buffers)
+ * @count:	in: the most buffers to dequeue, up to VIDEO_MAX_FRAME.
+ *		out: the number of buffers dequeued
+ * @entries:	the dequeued buffers, in dequeue order
+ *
+ * Only the wait for the first buffer blocks, when the file handle is in
+ * blocking mode. Whatever else is ready at that point is dequeued as well,
+ * up to @count buffers. All reserved fields must be set to zero.
+ */
+struct v4l2_dqbuf_batch {
+	__u32				type; /* enum v4l2_buf_type */
+	__u32				count;
+	__u32				reserved[6];
+	struct v4l2_dqbuf_batch_entry	entries[VIDEO_MAX_FRAME];
+};
+
 /*
  *	O V E R L A Y   P R E V I E W
  */
@@ -2498,6 +2547,7 @@ struct v4l2_create_buffers {
 #define VIDIOC_DBG_G_CHIP_INFO  _IOWR('V', 102, struct v4l2_dbg_chip_info)
 
 #define VIDIOC_QUERY_EXT_CTRL	_IOWR('V', 103, struct v4l2_query_ext_ctrl)
+#define VIDIOC_DQBUF_BATCH	_IOWR('V', 104, struct v4l2_dqbuf_batch)
 
 /* Reminder: when adding new ioctls please add support for them to
    drivers/media/v4l2-core/v4l2-compat-ioctl32.c as well! */